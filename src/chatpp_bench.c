@@ -0,0 +1,544 @@
+/* Chat++ Load Generator
+ * Copyright(C) 2012 y2c2 */
+
+/* Opens many simulated clients against chatpp_server from one process,
+ * every thread drives its share of them through non-blocking sockets
+ * and one epoll instance
+ * senders stamp every message with the time it was sent, every client
+ * times every message it gets back, so the latency covers the whole
+ * fan-out of the server, sender and receivers share the monotonic
+ * clock, which is why it only makes sense on one host */
+
+/* base */
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+/* network */
+#if defined(UNIX)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <pthread.h>
+#else
+#error "chatpp_bench runs on UNIX only"
+#endif
+
+/* server commands and frames */
+#include "chatpp_protocol.h"
+
+/* latency histogram, the same buckets as the server's */
+#include "chatpp_histogram.h"
+
+#define SERVER_PORT_DEFAULT 8089
+
+/* defaults of the options */
+#define CLIENTS_DEFAULT 1000
+#define SENDERS_DEFAULT 10
+#define RATE_DEFAULT 10 /* messages per second per sender */
+#define SIZE_DEFAULT 64 /* message bytes */
+#define DURATION_DEFAULT 10 /* seconds of sending */
+#define DRAIN_DEFAULT 2 /* seconds to wait for messages still on their way */
+
+#define SETTLE_MS 200 /* after the last connect, for history replays */
+#define EVENTS_MAX 256
+#define CONNECTS_PER_LOOP 64 /* so a big connect burst does not starve reads */
+#define OUT_MAX (1 << 20) /* bytes queued for a sender before it holds back */
+
+/* what a sender puts in front of every message, padded up to the size:
+ * magic, u32 run, u32 sender, u32 seq, u64 ns sent at */
+#define BENCH_MAGIC "cpb1"
+#define STAMP_SIZE 24
+
+/* options */
+const char *server_host = "127.0.0.1";
+unsigned short server_port = SERVER_PORT_DEFAULT;
+unsigned int client_count = CLIENTS_DEFAULT;
+unsigned int sender_count = SENDERS_DEFAULT;
+unsigned int send_rate = RATE_DEFAULT;
+unsigned int msg_size = SIZE_DEFAULT;
+unsigned int duration = DURATION_DEFAULT;
+unsigned int drain = DRAIN_DEFAULT;
+unsigned int connect_rate; /* per second, 0: as fast as possible */
+int thread_count = 1;
+
+unsigned int run_id; /* tells messages of this run from older ones */
+unsigned long long start_ns; /* sending starts, 0: not yet */
+int threads_connected; /* threads done with connecting */
+struct sockaddr_in server_addr;
+
+static void histogram_record(struct histogram *h, unsigned long long ns)
+{
+	h->counts[histogram_index(ns)]++;
+	h->sum += ns;
+	if (ns > h->max) h->max = ns;
+}
+
+static void histogram_merge(struct histogram *to, const struct histogram *from)
+{
+	unsigned int i;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) to->counts[i] += from->counts[i];
+	to->sum += from->sum;
+	if (from->max > to->max) to->max = from->max;
+}
+
+/* ns below which a fraction q of the samples are */
+static unsigned long long histogram_quantile(const struct histogram *h, unsigned long long total, double q)
+{
+	unsigned long long seen = 0, v;
+	unsigned int i;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		seen += h->counts[i];
+		if (seen >= q * total) break;
+	}
+	v = histogram_value(i < HISTOGRAM_BUCKETS ? i : HISTOGRAM_BUCKETS - 1);
+	return v < h->max ? v : h->max;
+}
+
+static unsigned long long monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+enum {
+	CLIENT_IDLE = 0, /* not connected yet */
+	CLIENT_CONNECTING = 1,
+	CLIENT_UP = 2,
+	CLIENT_DOWN = 3, /* failed to connect or closed by the server */
+};
+
+/* simulated client */
+struct bench_client
+{
+	int fd;
+	int state;
+	unsigned int id;
+	int sender;
+	unsigned int seq; /* messages sent, senders only */
+	unsigned long long delivered; /* messages of this run received */
+	struct frame_decoder decoder; /* frames received so far */
+	char *out; /* frames not taken by the socket yet */
+	size_t out_len;
+	size_t out_size;
+};
+
+/* thread driving a share of the clients */
+struct bench_thread
+{
+	pthread_t thd;
+	int epfd;
+	struct bench_client *clients;
+	unsigned int count;
+	unsigned int connected;
+	unsigned int failed;
+	unsigned int closed; /* by the server after connecting */
+	unsigned long long sent;
+	unsigned long long held; /* not sent, the socket of the sender was full */
+	unsigned long long foreign; /* messages of earlier runs or other clients */
+	unsigned long long errors; /* CMD_ERROR frames */
+	unsigned long long bytes_in;
+	char *msg; /* stamped anew for every message sent */
+	struct histogram latency;
+};
+
+struct bench_thread *threads;
+
+int set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1) return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void client_watch(struct bench_thread *t, struct bench_client *c, int op)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN | (c->state == CLIENT_CONNECTING || c->out_len > 0 ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	epoll_ctl(t->epfd, op, c->fd, &ev);
+}
+
+static void client_down(struct bench_thread *t, struct bench_client *c)
+{
+	if (c->state == CLIENT_UP) t->closed++;
+	else t->failed++;
+	c->state = CLIENT_DOWN;
+	epoll_ctl(t->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	c->out_len = 0;
+}
+
+/* write what the socket takes, return -1 if the connection is broken */
+static int client_flush(struct bench_client *c)
+{
+	ssize_t n;
+	size_t done = 0;
+	while (done < c->out_len)
+	{
+		n = send(c->fd, c->out + done, c->out_len - done, MSG_NOSIGNAL);
+		if (n == -1)
+		{
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+		done += n;
+	}
+	memmove(c->out, c->out + done, c->out_len - done);
+	c->out_len -= done;
+	return 0;
+}
+
+/* queue a frame and send it if the socket takes it,
+ * return -1 if the connection is broken or out of memory */
+static int client_send(struct bench_thread *t, struct bench_client *c, unsigned char cmd, const char *payload, size_t len)
+{
+	int was_empty = c->out_len == 0;
+	if (c->out_len + FRAME_HEADER_SIZE + len > c->out_size)
+	{
+		size_t size = (c->out_len + FRAME_HEADER_SIZE + len) * 2;
+		char *out = (char *)realloc(c->out, size);
+		if (out == NULL) return -1;
+		c->out = out;
+		c->out_size = size;
+	}
+	frame_encode_header(c->out + c->out_len, cmd, 0, len);
+	memcpy(c->out + c->out_len + FRAME_HEADER_SIZE, payload, len);
+	c->out_len += FRAME_HEADER_SIZE + len;
+	if (client_flush(c) == -1) return -1;
+	/* only a socket left with data is watched for writability */
+	if (was_empty && c->out_len > 0) client_watch(t, c, EPOLL_CTL_MOD);
+	return 0;
+}
+
+static void client_connect(struct bench_thread *t, struct bench_client *c)
+{
+	int opt = 1;
+	c->state = CLIENT_CONNECTING;
+	if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+	{
+		c->state = CLIENT_DOWN;
+		t->failed++;
+		return;
+	}
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	if (set_nonblocking(c->fd) == -1
+			|| (connect(c->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 && errno != EINPROGRESS))
+	{
+		close(c->fd);
+		c->fd = -1;
+		c->state = CLIENT_DOWN;
+		t->failed++;
+		return;
+	}
+	client_watch(t, c, EPOLL_CTL_ADD);
+}
+
+/* connection completed, take a nickname of our own */
+static void client_connected(struct bench_thread *t, struct bench_client *c)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	char nickname[32];
+	if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0)
+	{
+		client_down(t, c);
+		return;
+	}
+	c->state = CLIENT_UP;
+	t->connected++;
+	client_watch(t, c, EPOLL_CTL_MOD);
+	snprintf(nickname, sizeof(nickname), "bench%u-%u", run_id % 100000, c->id);
+	if (client_send(t, c, CMD_SET_NICKNAME, nickname, strlen(nickname)) == -1) client_down(t, c);
+}
+
+/* time a received message if it is one of this run */
+static void client_message(struct bench_thread *t, struct bench_client *c, struct frame *f, unsigned long long now)
+{
+	char *nickname, *msg;
+	size_t nickname_len, msg_len;
+	unsigned long long sent_at;
+	if (frame_decode_recv_msg(f, &nickname, &nickname_len, &msg, &msg_len) == -1
+			|| msg_len < STAMP_SIZE || memcmp(msg, BENCH_MAGIC, 4) != 0 || frame_get_u32(msg + 4) != run_id)
+	{
+		t->foreign++;
+		return;
+	}
+	sent_at = frame_get_u64(msg + 16);
+	histogram_record(&t->latency, now > sent_at ? now - sent_at : 0);
+	c->delivered++;
+}
+
+static void client_read(struct bench_thread *t, struct bench_client *c)
+{
+	size_t room;
+	ssize_t n;
+	char *space;
+	struct frame f;
+	unsigned long long now;
+	while (1)
+	{
+		if ((space = frame_decoder_space(&c->decoder, &room)) == NULL)
+		{
+			client_down(t, c);
+			return;
+		}
+		n = recv(c->fd, space, room, 0);
+		if (n == 0 || (n == -1 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+			client_down(t, c);
+			return;
+		}
+		if (n == -1)
+		{
+			if (errno == EINTR) continue;
+			return;
+		}
+		t->bytes_in += n;
+		frame_decoder_commit(&c->decoder, n);
+		/* one clock read for everything this read completed */
+		now = monotonic_ns();
+		while (frame_decoder_next(&c->decoder, &f))
+		{
+			if (f.cmd == CMD_RECV_MSG) client_message(t, c, &f, now);
+			else if (f.cmd == CMD_ERROR) t->errors++;
+		}
+	}
+}
+
+/* send every message a sender is due by now, elapsed ns into sending */
+static void client_send_due(struct bench_thread *t, struct bench_client *c, unsigned long long elapsed)
+{
+	unsigned long long due = elapsed * send_rate / 1000000000 + 1;
+	char *msg = t->msg;
+	frame_put_u32(msg + 8, c->id);
+	while (c->state == CLIENT_UP && c->seq < due)
+	{
+		/* a server not reading does not grow the queue forever */
+		if (c->out_len > OUT_MAX)
+		{
+			t->held += due - c->seq;
+			c->seq = (unsigned int)due;
+			return;
+		}
+		frame_put_u32(msg + 12, c->seq++);
+		frame_put_u64(msg + 16, monotonic_ns());
+		if (client_send(t, c, CMD_SEND_MSG, msg, msg_size) == -1)
+		{
+			client_down(t, c);
+			return;
+		}
+		t->sent++;
+	}
+}
+
+/* bench thread, connects its clients, waits for the start, sends for
+ * duration seconds and keeps reading for drain seconds more */
+void *bench_start(void *data)
+{
+	struct bench_thread *t = (struct bench_thread *)data;
+	struct epoll_event events[EVENTS_MAX];
+	struct bench_client *c;
+	unsigned int next = 0, i, n;
+	unsigned long long begin = monotonic_ns(), now, start, allowed;
+	int nfds, reported = 0;
+	while (1)
+	{
+		now = monotonic_ns();
+		/* this thread's share of the connect rate */
+		allowed = connect_rate == 0 ? t->count : (now - begin) * connect_rate / thread_count / 1000000000 + 1;
+		for (n = 0; next < t->count && next < allowed && n < CONNECTS_PER_LOOP; n++)
+		{
+			client_connect(t, &t->clients[next++]);
+		}
+		if (!reported && t->connected + t->failed == t->count)
+		{
+			reported = 1;
+			__sync_fetch_and_add(&threads_connected, 1);
+		}
+		start = __atomic_load_n(&start_ns, __ATOMIC_ACQUIRE);
+		if (start != 0 && now >= start)
+		{
+			if (now >= start + (unsigned long long)(duration + drain) * 1000000000) break;
+			if (now < start + (unsigned long long)duration * 1000000000)
+			{
+				for (i = 0; i < t->count; i++)
+				{
+					if (t->clients[i].sender) client_send_due(t, &t->clients[i], now - start);
+				}
+			}
+		}
+		nfds = epoll_wait(t->epfd, events, EVENTS_MAX, 1);
+		for (i = 0; i < (unsigned int)(nfds > 0 ? nfds : 0); i++)
+		{
+			c = (struct bench_client *)events[i].data.ptr;
+			if (c->state == CLIENT_CONNECTING)
+			{
+				client_connected(t, c);
+				continue;
+			}
+			if (c->state != CLIENT_UP) continue;
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) client_read(t, c);
+			if (c->state == CLIENT_UP && (events[i].events & EPOLLOUT) && c->out_len > 0)
+			{
+				if (client_flush(c) == -1) client_down(t, c);
+				else if (c->out_len == 0) client_watch(t, c, EPOLL_CTL_MOD);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void usage(void)
+{
+	printf("usage: chatpp_bench [-h host] [-p port] [--clients=n] [--senders=n]\n"
+			"                    [--rate=n] [--size=bytes] [--duration=secs]\n"
+			"                    [--drain=secs] [--connect-rate=n] [--threads=n]\n");
+	exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	struct histogram latency;
+	unsigned long long connect_begin, connect_ns, sent = 0, held = 0, foreign = 0, errors = 0, bytes_in = 0;
+	unsigned long long delivered = 0, expected, total;
+	unsigned int connected = 0, failed = 0, closed = 0, up = 0, i;
+	int t;
+
+	/* parser argv */
+	for (i = 1; i < (unsigned int)argc; i++)
+	{
+		if (!strcmp(argv[i], "-h") && i + 1 < (unsigned int)argc) server_host = argv[++i];
+		else if (!strcmp(argv[i], "-p") && i + 1 < (unsigned int)argc) server_port = atoi(argv[++i]);
+		else if (!strncmp(argv[i], "--clients=", strlen("--clients="))) client_count = atoi(argv[i] + strlen("--clients="));
+		else if (!strncmp(argv[i], "--senders=", strlen("--senders="))) sender_count = atoi(argv[i] + strlen("--senders="));
+		else if (!strncmp(argv[i], "--rate=", strlen("--rate="))) send_rate = atoi(argv[i] + strlen("--rate="));
+		else if (!strncmp(argv[i], "--size=", strlen("--size="))) msg_size = atoi(argv[i] + strlen("--size="));
+		else if (!strncmp(argv[i], "--duration=", strlen("--duration="))) duration = atoi(argv[i] + strlen("--duration="));
+		else if (!strncmp(argv[i], "--drain=", strlen("--drain="))) drain = atoi(argv[i] + strlen("--drain="));
+		else if (!strncmp(argv[i], "--connect-rate=", strlen("--connect-rate="))) connect_rate = atoi(argv[i] + strlen("--connect-rate="));
+		else if (!strncmp(argv[i], "--threads=", strlen("--threads="))) thread_count = atoi(argv[i] + strlen("--threads="));
+		else usage();
+	}
+	if (client_count == 0 || thread_count <= 0 || send_rate == 0 || duration == 0) usage();
+	if (sender_count > client_count) sender_count = client_count;
+	if (msg_size < STAMP_SIZE) msg_size = STAMP_SIZE;
+	if (msg_size > FRAME_PAYLOAD_MAX - 64) msg_size = FRAME_PAYLOAD_MAX - 64;
+	if ((unsigned int)thread_count > client_count) thread_count = client_count;
+
+	bzero(&server_addr, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(server_port);
+	if (inet_pton(AF_INET, server_host, &server_addr.sin_addr) != 1)
+	{
+		printf("Error : %s is not an IPv4 address\n", server_host);
+		exit(1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	raise_fd_limit();
+	run_id = (unsigned int)(monotonic_ns() ^ ((unsigned long long)getpid() << 16));
+
+	/* clients are dealt out to the threads, so are the senders */
+	threads = (struct bench_thread *)calloc(thread_count, sizeof(struct bench_thread));
+	if (threads == NULL) return 1;
+	for (t = 0; t < thread_count; t++)
+	{
+		threads[t].count = client_count / thread_count + ((unsigned int)t < client_count % thread_count);
+		threads[t].clients = (struct bench_client *)calloc(threads[t].count, sizeof(struct bench_client));
+		threads[t].msg = (char *)malloc(msg_size);
+		if (threads[t].clients == NULL || threads[t].msg == NULL || (threads[t].epfd = epoll_create1(0)) == -1)
+		{
+			printf("Error : out of memory\n");
+			exit(1);
+		}
+		memcpy(threads[t].msg, BENCH_MAGIC, 4);
+		frame_put_u32(threads[t].msg + 4, run_id);
+		memset(threads[t].msg + STAMP_SIZE, 'x', msg_size - STAMP_SIZE);
+		for (i = 0; i < threads[t].count; i++)
+		{
+			struct bench_client *c = &threads[t].clients[i];
+			c->fd = -1;
+			c->id = i * thread_count + t;
+			c->sender = c->id < sender_count;
+			frame_decoder_init(&c->decoder);
+		}
+	}
+	printf("%u client(s), %u sender(s) at %u msg/s of %u bytes for %u s, %d thread(s)\n",
+			client_count, sender_count, send_rate, msg_size, duration, thread_count);
+	connect_begin = monotonic_ns();
+	for (t = 0; t < thread_count; t++)
+	{
+		if (pthread_create(&threads[t].thd, NULL, bench_start, &threads[t]) != 0)
+		{
+			printf("Error : start thread failed\n");
+			exit(1);
+		}
+	}
+	/* everybody is connected, or given up on, before anything is sent */
+	while (__atomic_load_n(&threads_connected, __ATOMIC_ACQUIRE) < thread_count) usleep(1000);
+	connect_ns = monotonic_ns() - connect_begin;
+	__atomic_store_n(&start_ns, monotonic_ns() + SETTLE_MS * 1000000ULL, __ATOMIC_RELEASE);
+	for (t = 0; t < thread_count; t++)
+	{
+		pthread_join(threads[t].thd, NULL);
+	}
+
+	bzero(&latency, sizeof(latency));
+	for (t = 0; t < thread_count; t++)
+	{
+		struct bench_thread *th = &threads[t];
+		connected += th->connected;
+		failed += th->failed;
+		closed += th->closed;
+		sent += th->sent;
+		held += th->held;
+		foreign += th->foreign;
+		errors += th->errors;
+		bytes_in += th->bytes_in;
+		histogram_merge(&latency, &th->latency);
+		/* every message goes to every client, the sender included,
+		 * drops are counted against the clients still connected */
+		for (i = 0; i < th->count; i++)
+		{
+			if (th->clients[i].state != CLIENT_UP) continue;
+			up++;
+			delivered += th->clients[i].delivered;
+		}
+	}
+	expected = sent * up;
+	for (total = 0, i = 0; i < HISTOGRAM_BUCKETS; i++) total += latency.counts[i];
+
+	printf("connect   : %u of %u in %.1f ms, %.0f connect(s)/s, %u failed\n", connected, client_count,
+			connect_ns / 1e6, connected * 1e9 / (connect_ns > 0 ? connect_ns : 1), failed);
+	printf("sent      : %llu message(s), %.0f msg/s, %llu held back by a full socket\n",
+			sent, sent / (double)duration, held);
+	printf("delivered : %llu of %llu to %u client(s) still connected, %llu dropped, %u client(s) disconnected\n",
+			delivered, expected, up, expected > delivered ? expected - delivered : 0, closed);
+	printf("throughput: %.0f msg/s, %.1f MB/s received\n", delivered / (double)duration, bytes_in / 1e6 / (duration + drain));
+	if (total > 0)
+	{
+		printf("latency   : mean %.1f us, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+				latency.sum / 1e3 / total,
+				histogram_quantile(&latency, total, 0.5) / 1e3,
+				histogram_quantile(&latency, total, 0.99) / 1e3,
+				histogram_quantile(&latency, total, 0.999) / 1e3,
+				latency.max / 1e3);
+	}
+	if (foreign > 0 || errors > 0)
+	{
+		printf("ignored   : %llu message(s) of earlier runs or other clients, %llu error(s)\n", foreign, errors);
+	}
+	return 0;
+}
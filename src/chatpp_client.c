@@ -18,6 +18,7 @@
 #include <stdio.h>
 
 #include <sys/time.h>
+#include <time.h>
 
 /* network */
 #if defined(UNIX)
@@ -40,6 +41,9 @@
 #include <process.h>
 #endif
 
+/* compression */
+#include <zlib.h>
+
 /* GUI */
 #include <gtk/gtk.h>
 #include <gdk/gdk.h>
@@ -48,6 +52,9 @@
 /* icon */
 #include "chat.xpm"
 
+/* server commands and frames */
+#include "chatpp_protocol.h"
+
 /* global constant */
 /*#define SERVER_ADDR "127.0.0.1"*/
 #define SERVER_PORT 8089
@@ -56,15 +63,6 @@
 #define EXIT_STATE_MANUAL 0
 #define EXIT_STATE_SERVER_DISCONNECTED 1
 
-/* server commands
- * WARNING: first byte of every message is the command number */
-enum {
-    CMD_NULL = 0,
-    CMD_SET_NICKNAME = 1, /* cmd, name */
-    CMD_SEND_MSG = 2, /* cmd, msg */
-    CMD_RECV_MSG = 3, /* cmd, u8 name_len, name, u8 msg_len, msg */
-};
-
 /* global variables */
 int sockfd;
 int exit_state;
@@ -250,23 +248,128 @@ static void menu_item_help_about_callback(GtkWidget *widget, gpointer *data)
 	gtk_widget_destroy(dialog);
 }
 
+/* send one command frame, a room name is put in front of body
+ * when room is not NULL */
+static int send_command(unsigned char cmd, const char *room, size_t room_len, const char *body, size_t body_len)
+{
+	char send_buf[FRAME_SIZE_MAX];
+	char *p = send_buf + FRAME_HEADER_SIZE;
+	if (room != NULL)
+	{
+		if (room_len > 255) room_len = 255;
+		*p++ = (char)room_len;
+		memcpy(p, room, room_len);
+		p += room_len;
+	}
+	if (body_len > (size_t)(send_buf + FRAME_SIZE_MAX - p)) body_len = send_buf + FRAME_SIZE_MAX - p;
+	memcpy(p, body, body_len);
+	p += body_len;
+	frame_encode_header(send_buf, cmd, 0, p - send_buf - FRAME_HEADER_SIZE);
+	if (send(sockfd, (char *)&send_buf, p - send_buf, 0) == -1)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* ms since the epoch of a time of today */
+static unsigned long long today_ms(int hour, int min)
+{
+	time_t now = time(NULL);
+	struct tm tm = *localtime(&now);
+	tm.tm_hour = hour;
+	tm.tm_min = min;
+	tm.tm_sec = 0;
+	return (unsigned long long)mktime(&tm) * 1000;
+}
+
+/* ask for a range of the message log, "seq from [to]" or
+ * "time hh:mm [hh:mm]", return -1 if args are not one of them */
+static int send_range(const char *args)
+{
+	char body[17];
+	unsigned long long from, to = 0;
+	int hour_from, min_from, hour_to, min_to, n;
+	if (sscanf(args, "seq %llu %llu", &from, &to) >= 1)
+	{
+		body[0] = 0;
+	}
+	else if ((n = sscanf(args, "time %d:%d %d:%d", &hour_from, &min_from, &hour_to, &min_to)) >= 2)
+	{
+		body[0] = 1;
+		from = today_ms(hour_from, min_from);
+		if (n == 4) to = today_ms(hour_to, min_to);
+	}
+	else
+	{
+		return -1;
+	}
+	frame_put_u64(body + 1, from);
+	frame_put_u64(body + 9, to);
+	return send_command(CMD_LOG_RANGE, NULL, 0, body, sizeof(body));
+}
+
 static void button_send_callback(GtkWidget *widget, gpointer *data)
 {
 	/* get text from entry widget */
 	GtkWidget *entry_msg = (GtkWidget *)data;
 	const char *msg_p = gtk_entry_get_text(GTK_ENTRY(entry_msg));
-
-	/* copy and send text */
-	char send_buf[BUFFER_SIZE];
-	char *send_buf_msg_cmd = send_buf;
-	char *send_buf_msg_body = send_buf + 1;
-	size_t send_len;
-	*send_buf_msg_cmd = CMD_SEND_MSG;
-	strncpy(send_buf_msg_body, msg_p, strlen(msg_p));
-	send_len = strlen(msg_p) + 1;
-	if (send(sockfd, (char *)&send_buf, send_len, 0) == -1)
+	const char *room_end;
+
+	/* "/join room", "/leave room" and "/room room message" talk to
+	 * rooms, "/msg nickname message" to one user, "/history [room]"
+	 * shows the last messages again, "/range seq from [to]" and
+	 * "/range time hh:mm [hh:mm]" read them from the log of the server,
+	 * "/search words" finds them there, "/who" lists everybody online,
+	 * anything else goes to everybody */
+	if (!strncmp(msg_p, "/join ", 6))
 	{
-
+		send_command(CMD_JOIN_ROOM, NULL, 0, msg_p + 6, strlen(msg_p + 6));
+	}
+	else if (!strncmp(msg_p, "/leave ", 7))
+	{
+		send_command(CMD_LEAVE_ROOM, NULL, 0, msg_p + 7, strlen(msg_p + 7));
+	}
+	else if (!strcmp(msg_p, "/history"))
+	{
+		send_command(CMD_HISTORY, NULL, 0, "", 0);
+	}
+	else if (!strncmp(msg_p, "/history ", 9))
+	{
+		send_command(CMD_HISTORY, NULL, 0, msg_p + 9, strlen(msg_p + 9));
+	}
+	else if (!strncmp(msg_p, "/range ", 7) && send_range(msg_p + 7) == 0)
+	{
+		/* records arrive as CMD_LOG_RECORDS */
+	}
+	else if (!strcmp(msg_p, "/who"))
+	{
+		send_command(CMD_ROSTER, NULL, 0, "", 0);
+	}
+	else if (!strncmp(msg_p, "/search ", 8))
+	{
+		send_command(CMD_SEARCH, NULL, 0, msg_p + 8, strlen(msg_p + 8));
+	}
+	else if (!strncmp(msg_p, "/room ", 6) && (room_end = strchr(msg_p + 6, ' ')) != NULL)
+	{
+		send_command(CMD_SEND_ROOM_MSG, msg_p + 6, room_end - (msg_p + 6), room_end + 1, strlen(room_end + 1));
+	}
+	else if (!strncmp(msg_p, "/msg ", 5) && (room_end = strchr(msg_p + 5, ' ')) != NULL)
+	{
+		if (send_command(CMD_SEND_DM, msg_p + 5, room_end - (msg_p + 5), room_end + 1, strlen(room_end + 1)) == 0)
+		{
+			/* the server does not echo private messages */
+			GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+			GtkTextIter iter;
+			gtk_text_buffer_get_end_iter(buffer, &iter);
+			gtk_text_buffer_insert(buffer, &iter, "-> ", -1);
+			gtk_text_buffer_insert(buffer, &iter, msg_p + 5, -1);
+			gtk_text_buffer_insert(buffer, &iter, "\n", -1);
+		}
+	}
+	else
+	{
+		send_command(CMD_SEND_MSG, NULL, 0, msg_p, strlen(msg_p));
 	}
 	/* focus */
 	gtk_widget_grab_focus(entry_msg);
@@ -435,12 +538,10 @@ int register_nickname(int sockfd, char *nickname)
 	char paste_buf[BUFFER_SIZE];
 	char *paste_buf_p;
 	paste_buf_p = paste_buf;
-	/* command */
-	*paste_buf_p++ = CMD_SET_NICKNAME;
-	/* nickname length */
-	*paste_buf_p++ = nickname_len;
-	strncpy(paste_buf_p, nickname, strlen(nickname));
-	paste_buf_p += strlen(nickname) + 1;
+	/* command and nickname length */
+	paste_buf_p += frame_encode_header(paste_buf_p, CMD_SET_NICKNAME, 0, nickname_len);
+	memcpy(paste_buf_p, nickname, nickname_len);
+	paste_buf_p += nickname_len;
 	unsigned int msg_len = paste_buf_p - paste_buf;
 	if (send(sockfd, (char *)&paste_buf, msg_len, 0) == -1)
 	{
@@ -450,68 +551,241 @@ int register_nickname(int sockfd, char *nickname)
 	return 0;
 }
 
-/* message receiving threading */
-void *recv_message(void *data)
+/* write a message, room message, private message or error as a line
+ * of text at p, return the end of it, NULL if the frame is malformed */
+static char *format_message(char *p, struct frame *f)
 {
-	char recv_buf[BUFFER_SIZE];
-	char *recv_buf_p;
-	char *msg_cmd = recv_buf;
 	char *msg_nickname;
 	char *msg_content;
-	unsigned char msg_nickname_len;
-	unsigned char msg_content_len;
-	char paste_buf[BUFFER_SIZE];
+	size_t msg_nickname_len;
+	size_t msg_content_len;
+	char *msg_room;
+	size_t msg_room_len;
+	struct frame msg = *f;
+	if (f->cmd == CMD_ERROR)
+	{
+		/* failed command is not shown, only why */
+		if (f->len < 1) return NULL;
+		memcpy(p, "error: ", 7);
+		p += 7;
+		memcpy(p, f->payload + 1, f->len - 1);
+		p += f->len - 1;
+		*p++ = '\n';
+		return p;
+	}
+	if (f->cmd == CMD_RECV_DM)
+	{
+		memcpy(p, "<- ", 3);
+		p += 3;
+	}
+	if (f->cmd == CMD_RECV_ROOM_MSG)
+	{
+		if (frame_decode_name(f, &msg_room, &msg_room_len, &msg) == -1)
+		{
+			return NULL;
+		}
+		*p++ = '[';
+		memcpy(p, msg_room, msg_room_len);
+		p += msg_room_len;
+		*p++ = ']';
+		*p++ = ' ';
+	}
+	if (frame_decode_recv_msg(&msg, &msg_nickname, &msg_nickname_len, &msg_content, &msg_content_len) == -1)
+	{
+		return NULL;
+	}
+	/* make message */
+	memcpy(p, msg_nickname, msg_nickname_len);
+	p += msg_nickname_len;
+	*p++ = ':';
+	memcpy(p, msg_content, msg_content_len);
+	p += msg_content_len;
+	*p++ = '\n';
+	return p;
+}
+
+/* append text to the conversation */
+static void append_text(const char *text, size_t len)
+{
+	g_usleep(1);
+	gdk_threads_enter();
+	GtkTextBuffer *buffer;
+	buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+	GtkTextIter iter;
+	gtk_text_buffer_get_end_iter(buffer, &iter);
+	gtk_text_buffer_insert(buffer, &iter, text, len);
+	/* scroll to buttom */
+	g_idle_add(autoscroll_idle, scrolled_window);
+
+	gdk_threads_leave();
+}
+
+/* replace a compressed payload by the real one, inflated into buf of
+ * FRAME_PAYLOAD_MAX bytes, return -1 if it is malformed */
+static int inflate_frame(z_stream *z, struct frame *f, char *buf)
+{
+	if (inflateReset(z) != Z_OK) return -1;
+	if (inflateSetDictionary(z, (const Bytef *)deflate_dictionary, sizeof(deflate_dictionary) - 1) != Z_OK) return -1;
+	z->next_in = (Bytef *)f->payload;
+	z->avail_in = f->len;
+	z->next_out = (Bytef *)buf;
+	z->avail_out = FRAME_PAYLOAD_MAX;
+	if (inflate(z, Z_FINISH) != Z_STREAM_END) return -1;
+	f->payload = buf;
+	f->len = FRAME_PAYLOAD_MAX - z->avail_out;
+	f->flags &= ~FRAME_FLAG_DEFLATE;
+	return 0;
+}
+
+/* message receiving threading */
+void *recv_message(void *data)
+{
+	struct frame_decoder decoder;
+	struct frame f;
+	struct frame record;
+	char *space;
+	size_t room;
+	/* prefixes and the newline take a few bytes more than the payload */
+	char paste_buf[FRAME_PAYLOAD_MAX + 32];
 	char *paste_buf_p;
+	/* compressed frames, the server compresses them once agreed */
+	z_stream z;
+	int inflating;
+	char inflate_buf[FRAME_PAYLOAD_MAX];
+	size_t batch_pos;
+	size_t roster_pos;
+	size_t name_len;
 	int recv_len;
+	/* log records of a range, a record may span chunks */
+	char *range_buf = NULL;
+	size_t range_len = 0;
+	size_t range_pos;
+	size_t record_len;
+	frame_decoder_init(&decoder);
+	bzero(&z, sizeof(z));
+	inflating = inflateInit2(&z, -DEFLATE_WINDOW_BITS) == Z_OK;
 	while (1)
 	{
-		/* receive message from socket */
-		recv_len = recv(sockfd, recv_buf, BUFFER_SIZE, 0);
+		/* receive from socket, a read may hold many frames
+		 * or just a piece of one */
+		space = frame_decoder_space(&decoder, &room);
+		if (space == NULL)
+		{
+			break;
+		}
+		recv_len = recv(sockfd, space, room, 0);
 		if (recv_len <= 0)
 		{
 			break;
 		}
-		switch (*msg_cmd)
+		frame_decoder_commit(&decoder, recv_len);
+		while (frame_decoder_next(&decoder, &f))
 		{
-			case CMD_RECV_MSG:
-				recv_buf_p = recv_buf + 1;
-				/* nickname length of sender */
-				msg_nickname_len = *recv_buf_p++;
-				/* nickname */
-				msg_nickname = recv_buf_p;
-				recv_buf_p += msg_nickname_len;
-				/* content length */
-				msg_content_len = *recv_buf_p++;
-				/* content */
-				msg_content = recv_buf_p;
-				recv_buf_p += msg_content_len;
-				/* make message */
-				paste_buf_p = paste_buf;
-				strncpy(paste_buf_p, msg_nickname, msg_nickname_len);
-				paste_buf_p += msg_nickname_len;
-				*paste_buf_p++ = ':';
-				strncpy(paste_buf_p, msg_content, msg_content_len);
-				paste_buf_p += msg_content_len;
-				*paste_buf_p++ = '\n';
-				/* append message into textview widget */
-				g_usleep(1);
-				gdk_threads_enter();
-				GtkTextBuffer *buffer;
-				buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
-				GtkTextIter iter;
-				gtk_text_buffer_get_end_iter(buffer, &iter);
-				gtk_text_buffer_insert(buffer, &iter, paste_buf, paste_buf_p - paste_buf);
-				/* scroll to buttom */
-				g_idle_add(autoscroll_idle, scrolled_window);
-
-				gdk_threads_leave();
-
-				break;
-			default:
-				/* not supported */
-				break;
+			if ((f.flags & FRAME_FLAG_DEFLATE) && (!inflating || inflate_frame(&z, &f, inflate_buf) == -1))
+			{
+				continue;
+			}
+			switch (f.cmd)
+			{
+				case CMD_RECV_MSG:
+				case CMD_RECV_ROOM_MSG:
+				case CMD_RECV_DM:
+				case CMD_ERROR:
+					paste_buf_p = format_message(paste_buf, &f);
+					if (paste_buf_p == NULL) break;
+					/* append message into textview widget */
+					append_text(paste_buf, paste_buf_p - paste_buf);
+					break;
+				case CMD_RECV_BATCH:
+					batch_pos = 0;
+					while (frame_batch_next(&f, &batch_pos, &record) == 1)
+					{
+						paste_buf_p = format_message(paste_buf, &record);
+						if (paste_buf_p != NULL) append_text(paste_buf, paste_buf_p - paste_buf);
+					}
+					break;
+				case CMD_ROSTER:
+					/* u8 flags, u8 name_len, name, ... */
+					if (f.len < 1) break;
+					paste_buf_p = paste_buf;
+					if (f.payload[0] & ROSTER_FIRST) paste_buf_p += sprintf(paste_buf_p, "-- online:");
+					for (roster_pos = 1; roster_pos < f.len; roster_pos += 1 + name_len)
+					{
+						name_len = (unsigned char)f.payload[roster_pos];
+						if (roster_pos + 1 + name_len > f.len) break;
+						/* a long roster takes several lines */
+						if (paste_buf_p - paste_buf + 2 + name_len + 2 > sizeof(paste_buf))
+						{
+							*paste_buf_p++ = '\n';
+							append_text(paste_buf, paste_buf_p - paste_buf);
+							paste_buf_p = paste_buf;
+						}
+						*paste_buf_p++ = ' ';
+						memcpy(paste_buf_p, f.payload + roster_pos + 1, name_len);
+						paste_buf_p += name_len;
+					}
+					if (paste_buf_p > paste_buf)
+					{
+						*paste_buf_p++ = '\n';
+						append_text(paste_buf, paste_buf_p - paste_buf);
+					}
+					break;
+				case CMD_ROSTER_DELTA:
+					/* u8 op, u8 name_len, name, ... */
+					for (roster_pos = 0; roster_pos + 2 <= f.len; roster_pos += 2 + name_len)
+					{
+						name_len = (unsigned char)f.payload[roster_pos + 1];
+						if (roster_pos + 2 + name_len > f.len) break;
+						paste_buf_p = paste_buf + sprintf(paste_buf, "-- ");
+						memcpy(paste_buf_p, f.payload + roster_pos + 2, name_len);
+						paste_buf_p += name_len;
+						paste_buf_p += sprintf(paste_buf_p, f.payload[roster_pos] == ROSTER_JOIN ? " is online\n" : " is offline\n");
+						append_text(paste_buf, paste_buf_p - paste_buf);
+					}
+					break;
+				case CMD_LOG_RECORDS:
+					if (f.len == 0)
+					{
+						range_len = 0;
+						append_text("-- end of log records\n", 22);
+						break;
+					}
+					paste_buf_p = (char *)realloc(range_buf, range_len + f.len);
+					if (paste_buf_p == NULL) break;
+					range_buf = paste_buf_p;
+					memcpy(range_buf + range_len, f.payload, f.len);
+					range_len += f.len;
+					/* record: u32 frame length, u32 crc32, u64 seq,
+					 * u64 time, frame, padded to 8 bytes */
+					range_pos = 0;
+					while (range_len - range_pos >= 24)
+					{
+						record_len = frame_get_u32(range_buf + range_pos);
+						if (range_len - range_pos < ((24 + record_len + 7) & ~(size_t)7)) break;
+						record.cmd = (unsigned char)range_buf[range_pos + 24];
+						record.flags = (unsigned char)range_buf[range_pos + 25];
+						record.len = frame_get_u16(range_buf + range_pos + 26);
+						record.payload = range_buf + range_pos + 24 + FRAME_HEADER_SIZE;
+						if (record_len >= FRAME_HEADER_SIZE && record.len == record_len - FRAME_HEADER_SIZE)
+						{
+							paste_buf_p = paste_buf + sprintf(paste_buf, "#%llu ", frame_get_u64(range_buf + range_pos + 8));
+							paste_buf_p = format_message(paste_buf_p, &record);
+							if (paste_buf_p != NULL) append_text(paste_buf, paste_buf_p - paste_buf);
+						}
+						range_pos += (24 + record_len + 7) & ~(size_t)7;
+					}
+					memmove(range_buf, range_buf + range_pos, range_len - range_pos);
+					range_len -= range_pos;
+					break;
+				default:
+					/* not supported */
+					break;
+			}
 		}
 	}
+	free(range_buf);
+	frame_decoder_free(&decoder);
+	if (inflating) inflateEnd(&z);
 	exit_state = EXIT_STATE_SERVER_DISCONNECTED;
 	gtk_main_quit();
 	return NULL;
@@ -827,9 +1101,19 @@ int main(int argc, const char *argv[])
 		fatal_error("start recv thread failed");
 	}
 #endif
+	/* ask for compressed messages and batches, a version 1 server
+	 * ignores the hello and sends everything as it is */
+	char hello[HELLO_SIZE];
+	hello[0] = PROTOCOL_VERSION;
+	frame_put_u32(hello + 1, CAP_DEFLATE | CAP_BATCH);
+	send_command(CMD_HELLO, NULL, 0, hello, HELLO_SIZE);
+
 	/* register nickname */
 	register_nickname(sockfd, nickname);
 
+	/* who is online now and from now on */
+	send_command(CMD_ROSTER, NULL, 0, "", 0);
+
 	/* enter chat UI */
 	chat();
 
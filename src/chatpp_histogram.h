@@ -0,0 +1,62 @@
+/* Chat++ Latency Histogram
+ * Copyright(C) 2012 y2c2 */
+
+/* HDR style histogram of ns, shared by chatpp_server and chatpp_bench
+ * so both report percentiles from the same buckets
+ * values below 2^HISTOGRAM_SUB_BITS have a bucket each, every power of
+ * two above is split in as many buckets as half that, which keeps every
+ * value within about 3%
+ * the helpers both programs need to hold many connections are here too */
+
+#ifndef CHATPP_HISTOGRAM_H
+#define CHATPP_HISTOGRAM_H
+
+#if defined(UNIX)
+#include <sys/resource.h>
+#endif
+
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_VALUE_BITS 36 /* about 68 s, longer is counted as that */
+#define HISTOGRAM_HALF (1 << (HISTOGRAM_SUB_BITS - 1))
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_VALUE_BITS - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_HALF)
+
+struct histogram
+{
+	unsigned long long counts[HISTOGRAM_BUCKETS];
+	unsigned long long sum;
+	unsigned long long max;
+};
+
+static unsigned int histogram_index(unsigned long long v)
+{
+	unsigned int shift;
+	if (v >> HISTOGRAM_VALUE_BITS) v = (1ULL << HISTOGRAM_VALUE_BITS) - 1;
+	if (v < (1 << HISTOGRAM_SUB_BITS)) return (unsigned int)v;
+	shift = 63 - __builtin_clzll(v) - HISTOGRAM_SUB_BITS + 1;
+	return shift * HISTOGRAM_HALF + (unsigned int)(v >> shift);
+}
+
+/* highest value counted in bucket i */
+static unsigned long long histogram_value(unsigned int i)
+{
+	unsigned int shift;
+	if (i < (1 << HISTOGRAM_SUB_BITS)) return i;
+	shift = i / HISTOGRAM_HALF - 1;
+	return ((unsigned long long)(i - shift * HISTOGRAM_HALF + 1) << shift) - 1;
+}
+
+#if defined(UNIX)
+/* lift the soft open file limit to the hard one,
+ * every client costs one fd in the reactor engines and the bench */
+static void raise_fd_limit(void)
+{
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+#endif
+
+#endif
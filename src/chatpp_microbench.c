@@ -0,0 +1,396 @@
+/* Chat++ Microbenchmarks
+ * Copyright(C) 2012 y2c2 */
+
+/* Times the primitives every message goes through in the server,
+ * without any network: encoding a CMD_RECV_MSG frame and compressing
+ * it, inserting into and deleting from a client list, and broadcasting to the members of
+ * a list whose sockets are one end of a socketpair, one frame per message
+ * or batches of them
+ * the server is compiled in with its main renamed, so what is timed is
+ * exactly what the server runs
+ * every benchmark is run with more and more iterations until it takes
+ * long enough, then ns and allocations per operation are reported */
+
+#if !defined(UNIX)
+#error "chatpp_microbench runs on UNIX only"
+#endif
+
+#define _GNU_SOURCE /* before any header, as in the server */
+#include <stdlib.h>
+
+/* allocations of the server are counted at the call site,
+ * only while the clock runs */
+unsigned long bench_allocs;
+int bench_paused;
+
+static void *bench_malloc(size_t size)
+{
+	if (!bench_paused) bench_allocs++;
+	return malloc(size);
+}
+
+static void *bench_calloc(size_t n, size_t size)
+{
+	if (!bench_paused) bench_allocs++;
+	return calloc(n, size);
+}
+
+static void *bench_realloc(void *p, size_t size)
+{
+	if (!bench_paused) bench_allocs++;
+	return realloc(p, size);
+}
+
+static int bench_posix_memalign(void **p, size_t align, size_t size)
+{
+	if (!bench_paused) bench_allocs++;
+	return posix_memalign(p, align, size);
+}
+
+#define malloc(size) bench_malloc(size)
+#define calloc(n, size) bench_calloc(n, size)
+#define realloc(p, size) bench_realloc(p, size)
+#define posix_memalign(p, align, size) bench_posix_memalign(p, align, size)
+#define main chatpp_server_main
+#include "chatpp_server.c"
+#undef main
+#undef malloc
+#undef calloc
+#undef realloc
+#undef posix_memalign
+
+#define BENCH_TIME_MS_DEFAULT 200 /* least time a benchmark runs */
+#define BENCH_BATCH 32 /* broadcasts between two drains of the sinks */
+
+unsigned int bench_time_ms = BENCH_TIME_MS_DEFAULT;
+
+/* the server's fatal_error would clean up a server that never ran */
+static void bench_error(const char *msg)
+{
+	printf("Error : %s\n", msg);
+	exit(1);
+}
+
+/* clock of the running benchmark, paused around setup work */
+unsigned long long bench_started;
+unsigned long long bench_elapsed;
+
+static void bench_pause(void)
+{
+	bench_elapsed += monotonic_ns() - bench_started;
+	bench_paused = 1;
+}
+
+static void bench_resume(void)
+{
+	bench_paused = 0;
+	bench_started = monotonic_ns();
+}
+
+/* benchmark doing n operations */
+typedef void (*bench_fn)(void *arg, unsigned long n);
+
+/* run fn with more and more operations until it takes bench_time_ms,
+ * report the last run */
+static void bench_run(const char *name, bench_fn fn, void *arg)
+{
+	unsigned long n = 1;
+	for (;;)
+	{
+		bench_allocs = 0;
+		bench_elapsed = 0;
+		bench_resume();
+		fn(arg, n);
+		bench_pause();
+		if (bench_elapsed >= bench_time_ms * 1000000ULL || n >= (1UL << 30)) break;
+		/* aim a bit past the time from the rate so far */
+		if (bench_elapsed > 0 && bench_elapsed * 100 > bench_time_ms * 1000000ULL)
+		{
+			unsigned long long next = bench_time_ms * 1200000ULL / bench_elapsed * n;
+			n = next > n * 100 ? n * 100 : next <= n ? n * 2 : next;
+		}
+		else
+		{
+			n *= 100;
+		}
+	}
+	printf("%-28s %10lu %12.1f ns/op %8.2f allocs/op\n", name, n,
+			(double)bench_elapsed / n, (double)bench_allocs / n);
+	fflush(stdout);
+}
+
+/* frame encoding */
+struct encode_arg
+{
+	const char *msg;
+	size_t msg_len;
+};
+
+/* encode into a buffer of the caller */
+static void bench_encode(void *data, unsigned long n)
+{
+	struct encode_arg *a = (struct encode_arg *)data;
+	static char buf[FRAME_SIZE_MAX];
+	unsigned long i;
+	for (i = 0; i < n; i++)
+	{
+		frame_encode_recv_msg(buf, "nickname", 8, a->msg, a->msg_len);
+		__asm__ __volatile__("" : : "r"(buf) : "memory");
+	}
+}
+
+/* what the server does for every CMD_SEND_MSG: a shared frame */
+static void bench_encode_frame(void *data, unsigned long n)
+{
+	struct encode_arg *a = (struct encode_arg *)data;
+	struct out_frame *frame;
+	unsigned long i;
+	for (i = 0; i < n; i++)
+	{
+		frame = out_frame_new(frame_recv_msg_size(8, a->msg_len));
+		if (frame == NULL) bench_error("out of memory");
+		frame->len = frame_encode_recv_msg(frame->data, "nickname", 8, a->msg, a->msg_len);
+		out_frame_unref(frame);
+	}
+}
+
+/* compressing a broadcast for the clients that agreed to it */
+static void bench_deflate(void *data, unsigned long n)
+{
+	struct encode_arg *a = (struct encode_arg *)data;
+	struct out_frame *frame;
+	unsigned long i;
+	frame = out_frame_new(frame_recv_msg_size(8, a->msg_len));
+	if (frame == NULL) bench_error("out of memory");
+	frame->len = frame_encode_recv_msg(frame->data, "nickname", 8, a->msg, a->msg_len);
+	for (i = 0; i < n; i++)
+	{
+		out_frame_deflate(frame);
+		free(frame->deflated);
+		frame->deflated = NULL;
+	}
+	out_frame_unref(frame);
+}
+
+/* client list with size members */
+struct list_arg
+{
+	struct sub_server_list *list;
+	struct sub_server template;
+};
+
+static struct sub_server_list *bench_list_new(struct sub_server *template, unsigned int size)
+{
+	struct sub_server_list *list = sub_server_list_new();
+	unsigned int i;
+	if (list == NULL) bench_error("out of memory");
+	for (i = 0; i < size; i++)
+	{
+		if (sub_server_list_push_back(list, template) == NULL) bench_error("out of memory");
+	}
+	return list;
+}
+
+/* the members have no socket, deleting one closes -1 */
+static void bench_list_free(struct sub_server_list *list)
+{
+	while (list->size > 0) sub_server_list_delete(list, list->members[list->size - 1]);
+	free(list->members);
+	while (list->chunk_count > 0) free(list->chunks[--list->chunk_count]);
+	free(list->chunks);
+	sub_server_set_free(&list->set);
+	pthread_mutex_destroy(&list->mutex);
+	free(list);
+}
+
+static void bench_list_push_back(void *data, unsigned long n)
+{
+	struct list_arg *a = (struct list_arg *)data;
+	struct sub_server *node;
+	unsigned long i;
+	for (i = 0; i < n; i++)
+	{
+		node = sub_server_list_push_back(a->list, &a->template);
+		bench_pause();
+		if (node == NULL) bench_error("out of memory");
+		sub_server_list_delete(a->list, node);
+		bench_resume();
+	}
+}
+
+static void bench_list_delete(void *data, unsigned long n)
+{
+	struct list_arg *a = (struct list_arg *)data;
+	struct sub_server *node;
+	unsigned long i;
+	for (i = 0; i < n; i++)
+	{
+		bench_pause();
+		node = sub_server_list_push_back(a->list, &a->template);
+		if (node == NULL) bench_error("out of memory");
+		bench_resume();
+		sub_server_list_delete(a->list, node);
+	}
+}
+
+/* broadcast to members writing into socketpairs, the other ends are
+ * drained between batches with the clock paused */
+struct broadcast_arg
+{
+	struct sub_server_list *list;
+	int *sinks;
+	unsigned int size;
+	struct out_frame *frame;
+	int coalescing; /* queued only, written by the flush tick */
+};
+
+static void bench_drain(struct broadcast_arg *a)
+{
+	static char buf[65536];
+	unsigned int i;
+	for (i = 0; i < a->size; i++)
+	{
+		while (read(a->sinks[i], buf, sizeof(buf)) > 0);
+	}
+}
+
+static void bench_broadcast(void *data, unsigned long n)
+{
+	struct broadcast_arg *a = (struct broadcast_arg *)data;
+	unsigned long i;
+	a->list->coalescing = a->coalescing;
+	for (i = 0; i < n; i++)
+	{
+		sub_server_list_sendmsg_to_all(a->list, a->frame);
+		if (i % BENCH_BATCH == BENCH_BATCH - 1 || i == n - 1)
+		{
+			if (a->coalescing) sub_server_list_tick(a->list, 0);
+			bench_pause();
+			bench_drain(a);
+			bench_resume();
+		}
+	}
+}
+
+static void broadcast_setup(struct broadcast_arg *a, unsigned int size)
+{
+	struct sub_server template;
+	int fds[2];
+	unsigned int i;
+	bzero(&template, sizeof(template));
+	a->list = sub_server_list_new();
+	a->sinks = (int *)malloc(size * sizeof(int));
+	if (a->list == NULL || a->sinks == NULL) bench_error("out of memory");
+	a->size = size;
+	for (i = 0; i < size; i++)
+	{
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) bench_error("socketpair failed");
+		set_nonblocking(fds[0]);
+		set_nonblocking(fds[1]);
+		template.client_fd = fds[0];
+		if (sub_server_list_push_back(a->list, &template) == NULL) bench_error("out of memory");
+		a->sinks[i] = fds[1];
+	}
+}
+
+/* every member takes batches from now on, there is no going back */
+static void broadcast_batch(struct broadcast_arg *a)
+{
+	struct sub_server_snapshot *snap = a->list->set.snapshot;
+	unsigned int i;
+	for (i = 0; i < snap->size; i++) sub_server_agree_batch(snap->servers[i]);
+}
+
+static void broadcast_teardown(struct broadcast_arg *a)
+{
+	unsigned int i;
+	bench_drain(a);
+	bench_list_free(a->list);
+	for (i = 0; i < a->size; i++) close(a->sinks[i]);
+	free(a->sinks);
+}
+
+int main(int argc, const char *argv[])
+{
+	static const unsigned int msg_sizes[] = {16, 256, 4096};
+	static const unsigned int list_sizes[] = {10, 1000, 10000};
+	static const unsigned int fanouts[] = {1, 10, 100, 1000};
+	static const char sample[] = "see you tomorrow morning at the station, I think we should be there before nine ";
+	char name[64];
+	char *msg;
+	unsigned int i;
+	int mode;
+	struct encode_arg encode;
+	struct list_arg list;
+	struct broadcast_arg broadcast;
+
+	for (i = 1; i < (unsigned int)argc; i++)
+	{
+		if (!strncmp(argv[i], "--time=", strlen("--time=")))
+		{
+			bench_time_ms = atoi(argv[i] + strlen("--time="));
+		}
+		else
+		{
+			printf("usage: chatpp_microbench [--time=ms]\n");
+			return 1;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+	raise_fd_limit();
+
+	/* frame encoding */
+	msg = (char *)malloc(msg_sizes[sizeof(msg_sizes) / sizeof(msg_sizes[0]) - 1]);
+	if (msg == NULL) bench_error("out of memory");
+	for (i = 0; i < msg_sizes[sizeof(msg_sizes) / sizeof(msg_sizes[0]) - 1]; i++) msg[i] = sample[i % (sizeof(sample) - 1)];
+	encode.msg = msg;
+	for (i = 0; i < sizeof(msg_sizes) / sizeof(msg_sizes[0]); i++)
+	{
+		encode.msg_len = msg_sizes[i];
+		snprintf(name, sizeof(name), "encode/%u", msg_sizes[i]);
+		bench_run(name, bench_encode, &encode);
+		snprintf(name, sizeof(name), "encode_frame/%u", msg_sizes[i]);
+		bench_run(name, bench_encode_frame, &encode);
+		/* shorter messages go out as they are, there is nothing to time */
+		if (frame_recv_msg_size(8, msg_sizes[i]) - FRAME_HEADER_SIZE < DEFLATE_PAYLOAD_MIN) continue;
+		snprintf(name, sizeof(name), "deflate/%u", msg_sizes[i]);
+		bench_run(name, bench_deflate, &encode);
+	}
+
+	/* list insert and delete beside size members */
+	bzero(&list.template, sizeof(list.template));
+	list.template.client_fd = -1;
+	for (i = 0; i < sizeof(list_sizes) / sizeof(list_sizes[0]); i++)
+	{
+		list.list = bench_list_new(&list.template, list_sizes[i]);
+		snprintf(name, sizeof(name), "list_push_back/%u", list_sizes[i]);
+		bench_run(name, bench_list_push_back, &list);
+		snprintf(name, sizeof(name), "list_delete/%u", list_sizes[i]);
+		bench_run(name, bench_list_delete, &list);
+		bench_list_free(list.list);
+	}
+
+	/* broadcast of a 64 byte message, written right away (latency
+	 * mode), by the flush tick (throughput mode) or gathered in a batch
+	 * frame written by the flush tick */
+	encode.msg_len = 64;
+	broadcast.frame = out_frame_new(frame_recv_msg_size(8, encode.msg_len));
+	if (broadcast.frame == NULL) bench_error("out of memory");
+	broadcast.frame->len = frame_encode_recv_msg(broadcast.frame->data, "nickname", 8, encode.msg, encode.msg_len);
+	for (i = 0; i < sizeof(fanouts) / sizeof(fanouts[0]); i++)
+	{
+		broadcast_setup(&broadcast, fanouts[i]);
+		for (mode = 0; mode < 3; mode++)
+		{
+			static const char *names[] = {"broadcast", "broadcast_coalesced", "broadcast_batched"};
+			broadcast.coalescing = mode > 0;
+			if (mode == 2) broadcast_batch(&broadcast);
+			snprintf(name, sizeof(name), "%s/%u", names[mode], fanouts[i]);
+			bench_run(name, bench_broadcast, &broadcast);
+		}
+		broadcast_teardown(&broadcast);
+	}
+	out_frame_unref(broadcast.frame);
+	free(msg);
+	return 0;
+}
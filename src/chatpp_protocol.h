@@ -0,0 +1,373 @@
+/* Chat++ Wire Protocol
+ * Copyright(C) 2012 y2c2 */
+
+/* Every message on the wire is a frame:
+ *   u8 cmd, u8 flags, u16 payload length (network byte order), payload
+ * frame_decoder reassembles a stream of frames however TCP splits or
+ * merges them, payloads are handed out in place without copying
+ * protocol version 1 has no handshake, a version 2 client starts with
+ * CMD_HELLO and only gets what both sides agreed to */
+
+#ifndef CHATPP_PROTOCOL_H
+#define CHATPP_PROTOCOL_H
+
+#include <stdlib.h>
+#include <string.h>
+
+/* server commands
+ * WARNING: first byte of every frame is the command number */
+enum {
+	CMD_NULL = 0,
+	CMD_SET_NICKNAME = 1, /* name */
+	CMD_SEND_MSG = 2, /* msg */
+	CMD_RECV_MSG = 3, /* u8 name_len, name, u16 msg_len, msg */
+	CMD_JOIN_ROOM = 4, /* room */
+	CMD_LEAVE_ROOM = 5, /* room */
+	CMD_SEND_ROOM_MSG = 6, /* u8 room_len, room, msg */
+	CMD_RECV_ROOM_MSG = 7, /* u8 room_len, room, then as CMD_RECV_MSG */
+	CMD_SEND_DM = 8, /* u8 name_len, name, msg */
+	CMD_RECV_DM = 9, /* as CMD_RECV_MSG, name is the sender */
+	CMD_ERROR = 10, /* u8 cmd, reason */
+	CMD_HISTORY = 11, /* room, or nothing for messages to everybody */
+	CMD_LOG_RANGE = 12, /* u8 key (0: seq, 1: ms since the epoch), u64 from, u64 to (excluded, 0: no bound) */
+	CMD_LOG_RECORDS = 13, /* next bytes of the log records of a range, empty at the end */
+	CMD_SEARCH = 14, /* words, found in the log as CMD_LOG_RECORDS */
+	CMD_COMPRESS = 15, /* u8 method asked for, answered with the method agreed (COMPRESS_NONE: refused) */
+	CMD_HELLO = 16, /* u8 version, u32 caps, answered with the version and caps agreed */
+	CMD_RECV_BATCH = 17, /* CMD_RECV_MSG payloads back to back, only with CAP_BATCH */
+	CMD_PEER_HELLO = 18, /* u32 node id, between servers of a cluster */
+	CMD_PEER_RELAY = 19, /* u32 origin node id, u32 boot id, u64 seq, whole CMD_RECV_MSG or CMD_RECV_ROOM_MSG frame */
+	CMD_ROSTER = 20, /* nothing, answered with u8 ROSTER_* flags, then u8 name_len, name of everybody online */
+	CMD_ROSTER_DELTA = 21, /* u8 ROSTER_JOIN or ROSTER_LEAVE, u8 name_len, name, back to back */
+};
+
+#define PROTOCOL_VERSION 2
+
+/* capabilities of CMD_HELLO */
+enum {
+	CAP_DEFLATE = 0x01, /* as CMD_COMPRESS with COMPRESS_DEFLATE */
+	CAP_BATCH = 0x02, /* messages to everybody may come in CMD_RECV_BATCH */
+};
+#define HELLO_SIZE 5
+
+/* servers of a cluster link as peers over the client port, the side
+ * connecting says CMD_PEER_HELLO first and the other side answers it,
+ * then both relay the messages to everybody and to rooms of their own
+ * clients, every node numbers its own messages from 0 on every boot,
+ * so a message reaching a node again on another path is known by its
+ * origin, boot id and seq, a relay is u32 origin, u32 boot, u64 seq
+ * and the whole message frame */
+#define PEER_HELLO_SIZE 4
+#define RELAY_HEADER_SIZE 16
+/* a message frame in a relay is cut to this payload where it is sent */
+#define RELAY_PAYLOAD_MAX (FRAME_PAYLOAD_MAX - RELAY_HEADER_SIZE - FRAME_HEADER_SIZE)
+
+/* a client asking for the roster once gets CMD_ROSTER_DELTA from then
+ * on, changes of a short window come in one delta with only the net
+ * change of every nickname, a snapshot too big for a frame comes in
+ * several ones, the first one replaces whatever the client knew, the
+ * first delta after it may repeat a change the snapshot already holds */
+enum {
+	ROSTER_FIRST = 0x01,
+	ROSTER_LAST = 0x02,
+};
+enum {
+	ROSTER_LEAVE = 0,
+	ROSTER_JOIN = 1,
+};
+
+/* frame flags */
+enum {
+	FRAME_FLAG_DEFLATE = 0x01, /* payload is compressed with COMPRESS_DEFLATE */
+};
+
+/* compression methods */
+enum {
+	COMPRESS_NONE = 0,
+	COMPRESS_DEFLATE = 1,
+};
+
+/* once a client got COMPRESS_DEFLATE agreed, frames to it may carry
+ * FRAME_FLAG_DEFLATE, their payload then is a raw deflate stream (no
+ * zlib header) of the real payload, compressed with deflate_dictionary
+ * preset and nothing carried over from earlier frames, so a broadcast
+ * is compressed once for all clients, the dictionary makes up for the
+ * missing context of short messages */
+#define DEFLATE_WINDOW_BITS 12
+
+/* common words and phrases of chat messages,
+ * the most frequent last, as zlib finds them the cheapest there */
+static const char deflate_dictionary[] =
+	"https://www. http:// .com .org .net :) :( :D ;) xD <3 "
+	"because really think about would could should there their "
+	"people something anything nothing everyone anyone tomorrow "
+	"tonight today yesterday morning night minutes already again "
+	"right now sorry thank you thanks please welcome good morning "
+	"good night see you later how are you doing what's up I'm "
+	"don't can't won't it's that's you're we're they're let's "
+	"going know want need have been will with from this that what "
+	"when where which who why how here just like yeah yes okay ok "
+	"lol haha hey hello hi all any for not but and the you ";
+
+#define FRAME_HEADER_SIZE 4
+#define FRAME_PAYLOAD_MAX 65535
+#define FRAME_SIZE_MAX (FRAME_HEADER_SIZE + FRAME_PAYLOAD_MAX)
+
+/* smallest receive buffer, grown only for frames bigger than it */
+#define FRAME_DECODER_SIZE_MIN 4096
+
+/* decoded frame, payload points into the decoder buffer */
+struct frame
+{
+	unsigned char cmd;
+	unsigned char flags;
+	char *payload;
+	size_t len;
+};
+
+/* receive buffer of one stream */
+struct frame_decoder
+{
+	char *buf;
+	size_t size;
+	size_t start; /* first byte not decoded yet */
+	size_t end; /* first free byte */
+};
+
+static inline void frame_put_u16(char *p, unsigned int v)
+{
+	p[0] = (char)((v >> 8) & 0xff);
+	p[1] = (char)(v & 0xff);
+}
+
+static inline unsigned int frame_get_u16(const char *p)
+{
+	return ((unsigned int)(unsigned char)p[0] << 8) | (unsigned char)p[1];
+}
+
+static inline void frame_put_u32(char *p, unsigned int v)
+{
+	frame_put_u16(p, v >> 16);
+	frame_put_u16(p + 2, v & 0xffff);
+}
+
+static inline unsigned int frame_get_u32(const char *p)
+{
+	return (frame_get_u16(p) << 16) | frame_get_u16(p + 2);
+}
+
+static inline void frame_put_u64(char *p, unsigned long long v)
+{
+	frame_put_u32(p, (unsigned int)(v >> 32));
+	frame_put_u32(p + 4, (unsigned int)v);
+}
+
+static inline unsigned long long frame_get_u64(const char *p)
+{
+	return ((unsigned long long)frame_get_u32(p) << 32) | frame_get_u32(p + 4);
+}
+
+/* write frame header, return header size */
+static inline size_t frame_encode_header(char *buf, unsigned char cmd, unsigned char flags, size_t len)
+{
+	buf[0] = (char)cmd;
+	buf[1] = (char)flags;
+	frame_put_u16(buf + 2, (unsigned int)len);
+	return FRAME_HEADER_SIZE;
+}
+
+/* size of a CMD_RECV_MSG frame,
+ * a message too long for one frame is truncated */
+static inline size_t frame_recv_msg_size(size_t nickname_len, size_t msg_len)
+{
+	size_t size = FRAME_HEADER_SIZE + 1 + nickname_len + 2 + msg_len;
+	return size > FRAME_SIZE_MAX ? FRAME_SIZE_MAX : size;
+}
+
+/* write nickname and message of a received message at p, truncating
+ * the message to fit in room bytes, return end of written data */
+static inline char *frame_put_msg(char *p, size_t room, const char *nickname, size_t nickname_len, const char *msg, size_t msg_len)
+{
+	if (nickname_len > 255) nickname_len = 255;
+	if (msg_len > room - 3 - nickname_len) msg_len = room - 3 - nickname_len;
+	/* nickname length */
+	*p++ = (char)nickname_len;
+	/* nickname */
+	memcpy(p, nickname, nickname_len);
+	p += nickname_len;
+	/* message length */
+	frame_put_u16(p, (unsigned int)msg_len);
+	p += 2;
+	/* message */
+	memcpy(p, msg, msg_len);
+	return p + msg_len;
+}
+
+/* write a whole CMD_RECV_MSG or CMD_RECV_DM frame into buf of
+ * frame_recv_msg_size bytes, return frame size */
+static inline size_t frame_encode_msg(char *buf, unsigned char cmd, const char *nickname, size_t nickname_len, const char *msg, size_t msg_len)
+{
+	char *p = frame_put_msg(buf + FRAME_HEADER_SIZE, FRAME_PAYLOAD_MAX, nickname, nickname_len, msg, msg_len);
+	frame_encode_header(buf, cmd, 0, p - buf - FRAME_HEADER_SIZE);
+	return p - buf;
+}
+
+static inline size_t frame_encode_recv_msg(char *buf, const char *nickname, size_t nickname_len, const char *msg, size_t msg_len)
+{
+	return frame_encode_msg(buf, CMD_RECV_MSG, nickname, nickname_len, msg, msg_len);
+}
+
+/* split a CMD_RECV_MSG payload, return -1 if it is malformed */
+static inline int frame_decode_recv_msg(const struct frame *f, char **nickname, size_t *nickname_len, char **msg, size_t *msg_len)
+{
+	size_t pos = 0;
+	if (f->len < 1) return -1;
+	*nickname_len = (unsigned char)f->payload[pos++];
+	*nickname = f->payload + pos;
+	pos += *nickname_len;
+	if (pos + 2 > f->len) return -1;
+	*msg_len = frame_get_u16(f->payload + pos);
+	pos += 2;
+	*msg = f->payload + pos;
+	if (pos + *msg_len > f->len) return -1;
+	return 0;
+}
+
+/* take the next record of a CMD_RECV_BATCH payload at *pos as a
+ * CMD_RECV_MSG frame, return 0 at the end, -1 if it is malformed */
+static inline int frame_batch_next(const struct frame *batch, size_t *pos, struct frame *record)
+{
+	size_t len;
+	if (*pos >= batch->len) return 0;
+	len = 1 + (unsigned char)batch->payload[*pos];
+	if (*pos + len + 2 > batch->len) return -1;
+	len += 2 + frame_get_u16(batch->payload + *pos + len);
+	if (*pos + len > batch->len) return -1;
+	record->cmd = CMD_RECV_MSG;
+	record->flags = 0;
+	record->payload = batch->payload + *pos;
+	record->len = len;
+	*pos += len;
+	return 1;
+}
+
+/* size of a CMD_RECV_ROOM_MSG frame */
+static inline size_t frame_room_msg_size(size_t room_len, size_t nickname_len, size_t msg_len)
+{
+	size_t size = FRAME_HEADER_SIZE + 1 + room_len + 1 + nickname_len + 2 + msg_len;
+	return size > FRAME_SIZE_MAX ? FRAME_SIZE_MAX : size;
+}
+
+/* write a whole CMD_RECV_ROOM_MSG frame into buf of frame_room_msg_size
+ * bytes, return frame size */
+static inline size_t frame_encode_room_msg(char *buf, const char *room, size_t room_len, const char *nickname, size_t nickname_len, const char *msg, size_t msg_len)
+{
+	char *p = buf + FRAME_HEADER_SIZE;
+	if (room_len > 255) room_len = 255;
+	*p++ = (char)room_len;
+	memcpy(p, room, room_len);
+	p += room_len;
+	p = frame_put_msg(p, FRAME_PAYLOAD_MAX - 1 - room_len, nickname, nickname_len, msg, msg_len);
+	frame_encode_header(buf, CMD_RECV_ROOM_MSG, 0, p - buf - FRAME_HEADER_SIZE);
+	return p - buf;
+}
+
+/* split the leading u8 length prefixed name (room or nickname) off a
+ * payload, rest is what follows it, return -1 if it is malformed */
+static inline int frame_decode_name(const struct frame *f, char **name, size_t *name_len, struct frame *rest)
+{
+	if (f->len < 1) return -1;
+	*name_len = (unsigned char)f->payload[0];
+	*name = f->payload + 1;
+	if (1 + *name_len > f->len) return -1;
+	rest->cmd = f->cmd;
+	rest->flags = f->flags;
+	rest->payload = f->payload + 1 + *name_len;
+	rest->len = f->len - 1 - *name_len;
+	return 0;
+}
+
+static inline void frame_decoder_init(struct frame_decoder *d)
+{
+	d->buf = NULL;
+	d->size = 0;
+	d->start = 0;
+	d->end = 0;
+}
+
+static inline void frame_decoder_free(struct frame_decoder *d)
+{
+	free(d->buf);
+	frame_decoder_init(d);
+}
+
+/* return where the next read should go and how much fits there,
+ * only the undecoded tail of a partial frame is ever moved,
+ * return NULL if out of memory */
+static inline char *frame_decoder_space(struct frame_decoder *d, size_t *room)
+{
+	size_t pending = d->end - d->start;
+	size_t need = FRAME_DECODER_SIZE_MIN;
+	if (d->start > 0)
+	{
+		memmove(d->buf, d->buf + d->start, pending);
+		d->start = 0;
+		d->end = pending;
+	}
+	/* a partial frame bigger than the buffer needs room for all of it */
+	if (pending >= FRAME_HEADER_SIZE)
+	{
+		size_t frame_size = FRAME_HEADER_SIZE + frame_get_u16(d->buf + 2);
+		if (frame_size > need) need = frame_size;
+	}
+	/* a caller holding back complete frames still gets room */
+	if (pending >= need) need = pending + FRAME_DECODER_SIZE_MIN;
+	/* grow for a big frame, shrink back once it is gone */
+	if (d->size < need || (d->size > need && pending == 0))
+	{
+		char *new_buf = (char *)realloc(d->buf, need);
+		if (new_buf == NULL) return NULL;
+		d->buf = new_buf;
+		d->size = need;
+	}
+	*room = d->size - d->end;
+	return d->buf + d->end;
+}
+
+/* n bytes were read into the space */
+static inline void frame_decoder_commit(struct frame_decoder *d, size_t n)
+{
+	d->end += n;
+}
+
+/* look at the next complete frame without taking it,
+ * return 0 if none is buffered */
+static inline int frame_decoder_peek(struct frame_decoder *d, struct frame *f)
+{
+	size_t pending = d->end - d->start;
+	char *p = d->buf + d->start;
+	if (pending < FRAME_HEADER_SIZE) return 0;
+	f->len = frame_get_u16(p + 2);
+	if (pending < FRAME_HEADER_SIZE + f->len) return 0;
+	f->cmd = (unsigned char)p[0];
+	f->flags = (unsigned char)p[1];
+	f->payload = p + FRAME_HEADER_SIZE;
+	return 1;
+}
+
+/* take the frame frame_decoder_peek returned, its payload stays valid
+ * until the next frame_decoder_space */
+static inline void frame_decoder_skip(struct frame_decoder *d, const struct frame *f)
+{
+	d->start += FRAME_HEADER_SIZE + f->len;
+}
+
+/* take the next complete frame, return 0 if none is buffered */
+static inline int frame_decoder_next(struct frame_decoder *d, struct frame *f)
+{
+	if (!frame_decoder_peek(d, f)) return 0;
+	frame_decoder_skip(d, f);
+	return 1;
+}
+
+#endif
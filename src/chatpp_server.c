@@ -5,18 +5,40 @@
  * On multi-threading supporting side, uses pthread for UNIX and
  * Win32 threading for Windows */
 
+#if defined(UNIX)
+#define _GNU_SOURCE /* CPU affinity of reactors */
+#endif
+
 /* base */
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
 #include <signal.h>
+#include <errno.h>
 
 /* network */
 #if defined(UNIX)
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/un.h>
+#include <netdb.h>
 #elif defined(WINDOWS)
 #include <Winsock2.h>
 #define bzero(p, len) memset((p), 0, (len))
@@ -31,10 +53,27 @@
 #include <process.h>
 #endif
 
+/* compression */
+#include <zlib.h>
+
+/* server commands and frames */
+#include "chatpp_protocol.h"
+
+/* latency histogram */
+#include "chatpp_histogram.h"
+
 /* general constants */
 #define BUFFER_SIZE 4096
 #define SERVER_PORT_DEFAULT 8089
 
+/* server engines */
+enum {
+	ENGINE_THREAD = 0, /* one blocking thread per client */
+	ENGINE_EPOLL = 1, /* one edge-triggered epoll loop for all clients */
+	ENGINE_URING = 2, /* completion driven io_uring loops, Linux only */
+};
+int server_engine = ENGINE_THREAD;
+
 /* mini shell thread */
 #if defined(UNIX)
 pthread_t thd_shell;
@@ -43,357 +82,6883 @@ HANDLE thd_shell;
 DWORD thd_shell_id;
 #endif
 
-/* server commands */
+#define NICKNAME_LEN_MAX 50
+
+/* outbound queue */
+#define OUT_QUEUE_SIZE_DEFAULT 256 /* messages per client */
+#define OUT_QUEUE_SIZE_MAX 65536
+#define OUT_RETRY_MS 100 /* thread engine retries a blocked queue this often */
+
+/* output coalescing
+ * a list whose clients get many messages switches from latency mode to
+ * throughput mode, where output is held back for a flush window and
+ * written in one go per client */
+#define FLUSH_WINDOW_MS_DEFAULT 2
+#define FLUSH_WINDOW_MS_MAX 5
+#define COALESCE_RATE_DEFAULT 10000 /* messages per second per list */
+#define RATE_CHECK_MS 100 /* how often a list in latency mode measures its rate */
+int flush_window_ms = FLUSH_WINDOW_MS_DEFAULT; /* 0: latency mode only */
+unsigned long coalesce_rate = COALESCE_RATE_DEFAULT;
+
+/* slow consumer policies, applied when the outbound queue of a client is full */
 enum {
-	CMD_NULL = 0,
-	CMD_SET_NICKNAME = 1,
-	CMD_SEND_MSG = 2,
-	CMD_RECV_MSG = 3,
+	POLICY_DROP_OLDEST = 0,
+	POLICY_DROP_NEWEST = 1,
+	POLICY_DISCONNECT = 2,
+	POLICY_MAX,
 };
+const char *policy_names[POLICY_MAX] = {"drop-oldest", "drop-newest", "disconnect"};
+int slow_consumer_policy = POLICY_DROP_OLDEST;
+/* a full link of the cluster loses relays for every client behind it,
+ * so it is dropped and linked again by default */
+int peer_policy = POLICY_DISCONNECT;
+unsigned int out_queue_size = OUT_QUEUE_SIZE_DEFAULT;
+/* how many times each policy was applied */
+unsigned long slow_consumer_count[POLICY_MAX];
 
-#define NICKNAME_LEN_MAX 50
+/* flood protection, every client has token buckets for the frames and
+ * bytes it sends, refilled at the rate limit and one second deep */
+enum {
+	FLOOD_DELAY = 0, /* stop reading the client until it is within limits */
+	FLOOD_DROP = 1, /* discard frames over the limit */
+	FLOOD_DISCONNECT = 2,
+	FLOOD_MAX,
+};
+const char *flood_names[FLOOD_MAX] = {"delay", "drop", "disconnect"};
+int flood_policy = FLOOD_DELAY;
+unsigned long rate_limit_msgs; /* frames per second, 0: no limit */
+unsigned long rate_limit_bytes; /* bytes per second, 0: no limit */
+/* how many times each flood action was taken */
+unsigned long flood_count[FLOOD_MAX];
 
-/* sub server */
-struct sub_server
-{
-	int client_fd; /* client socket */
+/* frames sent by one writev */
+#define OUT_IOV_MAX 64
+
+/* encoded frame, immutable once built and shared by reference
+ * between every outbound queue it is sent to */
 #if defined(UNIX)
-	pthread_t thd; /* client socket */
-	pthread_t thd_id;
-#elif defined(WINDOWS)
-	HANDLE thd;
-	DWORD thd_id;
-#endif
-	char nickname[NICKNAME_LEN_MAX];
-	unsigned char nickname_len;
-	struct sub_server *next;
-	char client_ip_addr[16];
+/* segment of the message log mapped read only, frames sent straight
+ * out of it keep it mapped */
+struct log_view
+{
+	int refs;
+	unsigned long long first_seq;
+	char *base;
+	size_t size; /* valid records */
+	size_t map_size;
+	char *idx; /* sparse index */
+	unsigned int idx_count;
+	size_t idx_map_size;
 };
 
-/* sub server list */
-struct sub_server_list
+struct log_view *log_view_ref(struct log_view *view)
 {
-	struct sub_server *begin;
-	struct sub_server *final;
-	unsigned int size;
+	__sync_fetch_and_add(&view->refs, 1);
+	return view;
+}
+
+void log_view_unref(struct log_view *view)
+{
+	if (__sync_sub_and_fetch(&view->refs, 1) > 0) return;
+	if (view->base != NULL) munmap(view->base, view->map_size);
+	if (view->idx != NULL) munmap(view->idx, view->idx_map_size);
+	free(view);
+}
+#endif
+
+struct out_frame
+{
+	int refs;
+	size_t len;
+	const char *ext; /* payload mapped from the log, NULL: all in data */
+	struct log_view *view; /* mapping of ext */
+	unsigned long long stamp; /* ns a broadcast was received at, 0: not timed */
+	int pending; /* queues and fan-outs a timed frame is still waiting for */
+	char *deflated; /* whole frame compressed for clients asking for it, NULL: none */
+	size_t deflated_len;
+	struct out_frame **parts; /* messages gathered in a batch */
+	unsigned int part_count;
+	char data[];
 };
 
-struct sub_server_list *sub_server_list_new()
+/* new frame with room for len bytes and one reference */
+struct out_frame *out_frame_new(size_t len)
 {
-	struct sub_server_list *new_list = (struct sub_server_list *)malloc(sizeof(struct sub_server_list));
-	if (new_list == NULL) return NULL;
-	new_list->begin = NULL;
-	new_list->final = NULL;
-	new_list->size = 0;
-	return new_list;
+	struct out_frame *frame = (struct out_frame *)malloc(sizeof(struct out_frame) + len);
+	if (frame == NULL) return NULL;
+	frame->refs = 1;
+	frame->len = len;
+	frame->ext = NULL;
+	frame->view = NULL;
+	frame->stamp = 0;
+	frame->pending = 0;
+	frame->deflated = NULL;
+	frame->deflated_len = 0;
+	frame->parts = NULL;
+	frame->part_count = 0;
+	return frame;
 }
 
-#if defined(UNIX)
-pthread_mutex_t mutex_server_list = PTHREAD_MUTEX_INITIALIZER;
-#elif defined(WINDOWS)
-CRITICAL_SECTION cs_server_list;
-#endif
+struct out_frame *out_frame_ref(struct out_frame *frame)
+{
+	__sync_fetch_and_add(&frame->refs, 1);
+	return frame;
+}
 
-struct sub_server *sub_server_list_push_back(struct sub_server_list *list, struct sub_server *server)
+void out_frame_unref(struct out_frame *frame)
 {
+	unsigned int i;
+	if (__sync_sub_and_fetch(&frame->refs, 1) > 0) return;
 #if defined(UNIX)
-	pthread_mutex_lock(&mutex_server_list);
-#elif defined(WINDOWS)
-	EnterCriticalSection(&cs_server_list);
+	if (frame->view != NULL) log_view_unref(frame->view);
 #endif
-	struct sub_server *new_node = (struct sub_server *)malloc(sizeof(struct sub_server));
-	if (new_node == NULL) goto done;
-	new_node->client_fd = server->client_fd;
-	strncpy(new_node->nickname, server->nickname, NICKNAME_LEN_MAX);
-	new_node->nickname_len = server->nickname_len;
-	new_node->thd = server->thd;
-	new_node->thd_id = server->thd_id;
-	strncpy(new_node->client_ip_addr, server->client_ip_addr, 16);
-	new_node->next = NULL;
-	list->size++;
-	if (list->begin == NULL)
+	for (i = 0; i < frame->part_count; i++) out_frame_unref(frame->parts[i]);
+	free(frame->parts);
+	free(frame->deflated);
+	free(frame);
+}
+
+/* message compression
+ * a frame for many clients is compressed once by the thread that
+ * broadcasts it, before anybody else can see it, and every client that
+ * agreed to COMPRESS_DEFLATE gets the same compressed bytes */
+#define DEFLATE_LEVEL 6
+#define DEFLATE_MEM_LEVEL 5 /* small hash, reset for every frame */
+#define DEFLATE_PAYLOAD_MIN 32 /* shorter payloads don't get smaller */
+
+unsigned int deflate_clients; /* clients compression was agreed with */
+__thread z_stream *deflate_stream; /* of the calling thread */
+
+/* stream of the calling thread, NULL if out of memory */
+static z_stream *deflate_get(void)
+{
+	z_stream *z = deflate_stream;
+	if (z != NULL) return z;
+	if ((z = (z_stream *)calloc(1, sizeof(z_stream))) == NULL) return NULL;
+	if (deflateInit2(z, DEFLATE_LEVEL, Z_DEFLATED, -DEFLATE_WINDOW_BITS, DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
 	{
-		/* no existed node */
-		list->begin = list->final = new_node;
+		free(z);
+		return NULL;
 	}
-	else
+	deflate_stream = z;
+	return z;
+}
+
+/* a thread about to exit frees its stream */
+void deflate_release(void)
+{
+	if (deflate_stream == NULL) return;
+	deflateEnd(deflate_stream);
+	free(deflate_stream);
+	deflate_stream = NULL;
+}
+
+/* add the compressed form to a frame, kept only if it is smaller,
+ * frames sent out of the log are left alone */
+void out_frame_deflate(struct out_frame *frame)
+{
+	size_t len = frame->len - FRAME_HEADER_SIZE;
+	z_stream *z;
+	char *buf, *shrunk;
+	if (frame->ext != NULL || frame->deflated != NULL || len < DEFLATE_PAYLOAD_MIN) return;
+	if ((z = deflate_get()) == NULL) return;
+	if ((buf = (char *)malloc(frame->len)) == NULL) return;
+	deflateReset(z);
+	deflateSetDictionary(z, (const Bytef *)deflate_dictionary, sizeof(deflate_dictionary) - 1);
+	z->next_in = (Bytef *)frame->data + FRAME_HEADER_SIZE;
+	z->avail_in = len;
+	z->next_out = (Bytef *)buf + FRAME_HEADER_SIZE;
+	/* not worth it unless it saves a byte */
+	z->avail_out = len - 1;
+	if (deflate(z, Z_FINISH) != Z_STREAM_END)
 	{
-		list->final->next = new_node;
-		list->final = new_node;
+		free(buf);
+		return;
 	}
-done:
+	len -= 1 + z->avail_out;
+	if ((shrunk = (char *)realloc(buf, FRAME_HEADER_SIZE + len)) != NULL) buf = shrunk;
+	frame_encode_header(buf, (unsigned char)frame->data[0], (unsigned char)frame->data[1] | FRAME_FLAG_DEFLATE, len);
+	frame->deflated = buf;
+	frame->deflated_len = FRAME_HEADER_SIZE + len;
+}
+
+static unsigned long long monotonic_ms(void)
+{
 #if defined(UNIX)
-	pthread_mutex_unlock(&mutex_server_list);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 #elif defined(WINDOWS)
-	LeaveCriticalSection(&cs_server_list);
+	return GetTickCount64();
 #endif
-	return new_node;
 }
 
-int sub_server_list_delete(struct sub_server_list *list, struct sub_server *server)
+#if defined(UNIX)
+static unsigned long long monotonic_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#endif
+
+static unsigned long long monotonic_ns(void)
 {
 #if defined(UNIX)
-	pthread_mutex_lock(&mutex_server_list);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
 #elif defined(WINDOWS)
-	EnterCriticalSection(&cs_server_list);
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (unsigned long long)(count.QuadPart / freq.QuadPart) * 1000000000
+		+ (unsigned long long)(count.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
 #endif
-	struct sub_server *sav, *next;
-	if (list == NULL) goto done;
-	if (list->begin == NULL) goto done;
-	struct sub_server *cur = list->begin, *target;
-	target = NULL;
-	sav = NULL;
-	/* find node to be delete */
-	while (cur != NULL)
+}
+
+/* metrics
+ * every thread counts into a block of its own with plain stores, no
+ * lock and no shared cache line, a reader sums up all the blocks
+ * a block of an exited client thread goes to the next new thread, so
+ * the thread engine does not grow one block per connection ever made */
+
+enum {
+	METRIC_MSGS_IN = 0, /* frames received */
+	METRIC_BYTES_IN = 1,
+	METRIC_MSGS_OUT = 2, /* frames sent whole */
+	METRIC_BYTES_OUT = 3,
+	METRIC_BROADCASTS = 4, /* to everybody or to a room */
+	METRIC_FANOUT = 5, /* clients the broadcasts were queued for */
+	METRIC_MAX,
+};
+
+enum {
+	LATENCY_BROADCAST = 0, /* message received until sent to its last client */
+	LATENCY_LIST_LOCK = 1, /* mutex of a sub server list held */
+	LATENCY_MAX,
+};
+const char *latency_names[LATENCY_MAX] = {"broadcast latency", "list lock hold"};
+const char *latency_keys[LATENCY_MAX] = {"broadcast_latency", "list_lock_hold"}; /* in JSON */
+
+struct metrics
+{
+	unsigned long long counters[METRIC_MAX];
+	struct histogram histograms[LATENCY_MAX];
+	struct metrics *next; /* every block */
+	struct metrics *free_next; /* blocks of exited threads */
+};
+
+struct metrics *metrics_head;
+struct metrics *metrics_free;
+int metrics_latch; /* guards both chains, never taken to count */
+__thread struct metrics *thread_metrics;
+
+static void metrics_lock(void)
+{
+	while (__sync_lock_test_and_set(&metrics_latch, 1))
+	{
+		while (__atomic_load_n(&metrics_latch, __ATOMIC_RELAXED));
+	}
+}
+
+static void metrics_unlock(void)
+{
+	__sync_lock_release(&metrics_latch);
+}
+
+/* block of the calling thread, NULL if out of memory */
+static struct metrics *metrics_get(void)
+{
+	struct metrics *m = thread_metrics;
+	if (m != NULL) return m;
+	metrics_lock();
+	if (metrics_free != NULL)
+	{
+		m = metrics_free;
+		metrics_free = m->free_next;
+	}
+	else if ((m = (struct metrics *)calloc(1, sizeof(struct metrics))) != NULL)
+	{
+		m->next = metrics_head;
+		metrics_head = m;
+	}
+	metrics_unlock();
+	thread_metrics = m;
+	return m;
+}
+
+/* a thread about to exit hands its block over, counts stay in it */
+void metrics_release(void)
+{
+	if (thread_metrics == NULL) return;
+	metrics_lock();
+	thread_metrics->free_next = metrics_free;
+	metrics_free = thread_metrics;
+	metrics_unlock();
+	thread_metrics = NULL;
+}
+
+/* only the owner writes a block, readers may see a count a bit late
+ * but never a torn one */
+static void metric_add(int which, unsigned long long n)
+{
+	struct metrics *m = metrics_get();
+	if (m == NULL) return;
+	__atomic_store_n(&m->counters[which], m->counters[which] + n, __ATOMIC_RELAXED);
+}
+
+static void metric_record(int which, unsigned long long ns)
+{
+	struct metrics *m = metrics_get();
+	struct histogram *h;
+	unsigned int i = histogram_index(ns);
+	if (m == NULL) return;
+	h = &m->histograms[which];
+	__atomic_store_n(&h->counts[i], h->counts[i] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, h->sum + ns, __ATOMIC_RELAXED);
+	if (ns > h->max) __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+/* sum of every block */
+static void metrics_collect(unsigned long long *counters, struct histogram *histograms)
+{
+	struct metrics *m;
+	int i, j;
+	bzero(counters, METRIC_MAX * sizeof(unsigned long long));
+	bzero(histograms, LATENCY_MAX * sizeof(struct histogram));
+	metrics_lock();
+	for (m = metrics_head; m != NULL; m = m->next)
 	{
-		if (cur == server)
+		for (i = 0; i < METRIC_MAX; i++) counters[i] += __atomic_load_n(&m->counters[i], __ATOMIC_RELAXED);
+		for (i = 0; i < LATENCY_MAX; i++)
 		{
-			target = cur;
-			break;
+			struct histogram *h = &m->histograms[i];
+			unsigned long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+			for (j = 0; j < HISTOGRAM_BUCKETS; j++) histograms[i].counts[j] += __atomic_load_n(&h->counts[j], __ATOMIC_RELAXED);
+			histograms[i].sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+			if (max > histograms[i].max) histograms[i].max = max;
 		}
-		sav = cur;
-		cur = cur->next;
 	}
-	/* can't find target */
-	if (target == NULL)
+	metrics_unlock();
+}
+
+#define QUANTILE_COUNT 4
+const double quantiles[QUANTILE_COUNT] = {0.5, 0.9, 0.99, 0.999};
+const char *quantile_names[QUANTILE_COUNT] = {"p50", "p90", "p99", "p99.9"};
+
+/* ns at each of quantiles, the top of the bucket it ends in,
+ * return count of samples */
+static unsigned long long histogram_quantiles(const struct histogram *h, unsigned long long *values)
+{
+	unsigned long long total = 0, seen = 0, v;
+	unsigned int i, q = 0;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) total += h->counts[i];
+	for (i = 0; i < HISTOGRAM_BUCKETS && q < QUANTILE_COUNT && total > 0; i++)
 	{
-		goto done;
+		seen += h->counts[i];
+		/* several quantiles may end in one bucket */
+		while (q < QUANTILE_COUNT && seen >= quantiles[q] * total)
+		{
+			v = histogram_value(i);
+			values[q++] = v < h->max ? v : h->max;
+		}
 	}
-	/* set new begin and final */
-	struct sub_server *next_begin = list->begin, *next_final = list->final;
-	if (target == list->begin) next_begin = list->begin->next;
-	if (target == list->final) next_final = sav;
-	/* delete node */
-	next = cur->next;
-	/* the thread will exit it by itself */
-#if 0
-#if defined(UNIX)
-	pthread_cancel(cur->thd);
-#elif defined(WINDOWS)
-	TerminateThread(&cur->thd, 0);
-#endif
-#endif
-	close(cur->client_fd);
-	free(cur);
-	if (sav != NULL) sav->next = next;
-	/* update begin and final */
-	list->begin = next_begin;
-	list->final = next_final;
-	/* update size */
-	list->size--;
-done:
-#if defined(UNIX)
-	pthread_mutex_unlock(&mutex_server_list);
-#elif defined(WINDOWS)
-	LeaveCriticalSection(&cs_server_list);
-#endif
-	return 0;
+	return total;
 }
 
-int sub_server_list_walk(struct sub_server_list *list)
+/* print a histogram as us */
+static void histogram_print(FILE *out, const char *name, const struct histogram *h)
 {
-#if defined(UNIX)
-	pthread_mutex_lock(&mutex_server_list);
-#elif defined(WINDOWS)
-	EnterCriticalSection(&cs_server_list);
-#endif
-	struct sub_server *cur = list->begin;
-	int idx = 0;
-	while (cur != NULL)
+	unsigned long long values[QUANTILE_COUNT];
+	unsigned long long total = histogram_quantiles(h, values);
+	int q;
+	fprintf(out, "%-18s: %llu sample(s)", name, total);
+	if (total == 0)
 	{
-		idx++;
-		printf("#%4d: address=%s, thread id=%lu, fd=%d\n", idx, cur->client_ip_addr, cur->thd_id, cur->client_fd);
-		cur = cur->next;
+		fprintf(out, "\n");
+		return;
 	}
-#if defined(UNIX)
-	pthread_mutex_unlock(&mutex_server_list);
-#elif defined(WINDOWS)
-	LeaveCriticalSection(&cs_server_list);
-#endif
-	return 0;
+	fprintf(out, ", mean %.2f us", (double)h->sum / total / 1000);
+	for (q = 0; q < QUANTILE_COUNT; q++) fprintf(out, ", %s %.2f", quantile_names[q], (double)values[q] / 1000);
+	fprintf(out, ", max %.2f us\n", (double)h->max / 1000);
 }
 
-int sub_server_list_destroy(struct sub_server_list *list)
+unsigned long long stats_started_ms; /* monotonic ms the server started at */
+
+void stats_print(FILE *out)
+{
+	unsigned long long counters[METRIC_MAX];
+	struct histogram histograms[LATENCY_MAX];
+	int i;
+	metrics_collect(counters, histograms);
+	fprintf(out, "uptime %llu s\n", (monotonic_ms() - stats_started_ms) / 1000);
+	fprintf(out, "%-18s: %llu frame(s), %llu byte(s)\n", "received", counters[METRIC_MSGS_IN], counters[METRIC_BYTES_IN]);
+	fprintf(out, "%-18s: %llu frame(s), %llu byte(s)\n", "sent", counters[METRIC_MSGS_OUT], counters[METRIC_BYTES_OUT]);
+	fprintf(out, "%-18s: %llu, %.1f client(s) each\n", "broadcasts", counters[METRIC_BROADCASTS],
+			counters[METRIC_BROADCASTS] > 0 ? (double)counters[METRIC_FANOUT] / counters[METRIC_BROADCASTS] : 0.0);
+	for (i = 0; i < LATENCY_MAX; i++) histogram_print(out, latency_names[i], &histograms[i]);
+}
+
+/* the same as one JSON object, times in us */
+void stats_json(FILE *out)
 {
+	unsigned long long counters[METRIC_MAX], values[QUANTILE_COUNT], total;
+	struct histogram histograms[LATENCY_MAX];
+	int i, q;
+	metrics_collect(counters, histograms);
+	fprintf(out, "{\"uptime_s\":%llu,\"frames_in\":%llu,\"bytes_in\":%llu,\"frames_out\":%llu,\"bytes_out\":%llu,\"broadcasts\":%llu,\"fanout\":%llu",
+			(monotonic_ms() - stats_started_ms) / 1000, counters[METRIC_MSGS_IN], counters[METRIC_BYTES_IN],
+			counters[METRIC_MSGS_OUT], counters[METRIC_BYTES_OUT], counters[METRIC_BROADCASTS], counters[METRIC_FANOUT]);
+	for (i = 0; i < LATENCY_MAX; i++)
+	{
+		total = histogram_quantiles(&histograms[i], values);
+		fprintf(out, ",\"%s\":{\"samples\":%llu", latency_keys[i], total);
+		if (total > 0)
+		{
+			fprintf(out, ",\"mean\":%.2f", (double)histograms[i].sum / total / 1000);
+			for (q = 0; q < QUANTILE_COUNT; q++) fprintf(out, ",\"%s\":%.2f", quantile_names[q], (double)values[q] / 1000);
+			fprintf(out, ",\"max\":%.2f", (double)histograms[i].max / 1000);
+		}
+		fprintf(out, "}");
+	}
+	fprintf(out, "}");
+}
+
+#define STATS_INTERVAL_DEFAULT 10 /* seconds */
+const char *stats_file; /* NULL: no dump */
+int stats_interval = STATS_INTERVAL_DEFAULT;
+
+/* write the metrics to stats_file every stats_interval seconds, a
+ * reader of the file never sees a half written one */
 #if defined(UNIX)
-	pthread_mutex_lock(&mutex_server_list);
+void *stats_start(void *data)
 #elif defined(WINDOWS)
-	EnterCriticalSection(&cs_server_list);
+DWORD WINAPI stats_start(void *data)
 #endif
-	struct sub_server *sav, *cur = list->begin;
-	while (cur != NULL)
+{
+	char *tmp = (char *)malloc(strlen(stats_file) + 5);
+	FILE *out;
+	if (tmp == NULL)
 	{
-		sav = cur->next;
+		printf("Error : out of memory, stats are not dumped\n");
 #if defined(UNIX)
-		pthread_cancel(cur->thd);
+		return NULL;
 #elif defined(WINDOWS)
-		TerminateThread(&cur->thd, 0);
+		return 0;
 #endif
+	}
+	sprintf(tmp, "%s.tmp", stats_file);
+	while (1)
+	{
 #if defined(UNIX)
-		close(cur->client_fd);
+		sleep(stats_interval);
 #elif defined(WINDOWS)
-		closesocket(cur->client_fd);
-		WSACleanup();
+		Sleep(stats_interval * 1000);
+#endif
+		if ((out = fopen(tmp, "w")) == NULL) continue;
+		stats_print(out);
+		fclose(out);
+#if defined(WINDOWS)
+		remove(stats_file);
 #endif
-		free(cur);
-		cur = sav;
+		rename(tmp, stats_file);
 	}
-	free(list);
 #if defined(UNIX)
-	pthread_mutex_unlock(&mutex_server_list);
+	return NULL;
 #elif defined(WINDOWS)
-	LeaveCriticalSection(&cs_server_list);
+	return 0;
 #endif
+}
+
+/* a broadcast frame got one more queue or fan-out to wait for */
+static void out_frame_hold(struct out_frame *frame)
+{
+	if (__atomic_load_n(&frame->stamp, __ATOMIC_RELAXED) != 0) __sync_fetch_and_add(&frame->pending, 1);
+}
+
+/* a queue or fan-out is done with a frame, sent or not, the last one
+ * times the broadcast
+ * a replay of the history may queue the frame again later, the stamp
+ * is cleared so that does not count */
+static void out_frame_release(struct out_frame *frame)
+{
+	unsigned long long stamp = __atomic_load_n(&frame->stamp, __ATOMIC_RELAXED);
+	unsigned int i;
+	if (stamp == 0 || __sync_sub_and_fetch(&frame->pending, 1) != 0) return;
+	__atomic_store_n(&frame->stamp, 0, __ATOMIC_RELAXED);
+	/* a batch is timed by the messages in it */
+	if (frame->parts != NULL)
+	{
+		for (i = 0; i < frame->part_count; i++) out_frame_release(frame->parts[i]);
+		return;
+	}
+	metric_record(LATENCY_BROADCAST, monotonic_ns() - stamp);
+}
+
+/* token buckets of a client, counted in thousandths of a token so a
+ * refill by the millisecond stays exact */
+struct token_bucket
+{
+	unsigned long long msgs;
+	unsigned long long bytes;
+	unsigned long long last_ms;
+};
+
+/* one second of rate, the byte bucket holds at least one whole frame */
+#define TOKEN_MSGS_DEPTH(rate) ((unsigned long long)(rate) * 1000)
+#define TOKEN_BYTES_DEPTH(rate) ((unsigned long long)((rate) > FRAME_SIZE_MAX ? (rate) : FRAME_SIZE_MAX) * 1000)
+
+void token_bucket_init(struct token_bucket *b, unsigned long long now)
+{
+	b->msgs = TOKEN_MSGS_DEPTH(rate_limit_msgs);
+	b->bytes = TOKEN_BYTES_DEPTH(rate_limit_bytes);
+	b->last_ms = now;
+}
+
+/* take a frame of len bytes out of the buckets, refilled at scale times
+ * the configured limits, return ms until it fits if it is over a
+ * limit, buckets are untouched then */
+int token_bucket_take(struct token_bucket *b, size_t len, unsigned long long now, unsigned int scale)
+{
+	unsigned long long elapsed = now - b->last_ms, need, wait = 0, w;
+	unsigned long long msgs_rate = (unsigned long long)rate_limit_msgs * scale;
+	unsigned long long bytes_rate = (unsigned long long)rate_limit_bytes * scale;
+	b->last_ms = now;
+	b->msgs += elapsed * msgs_rate;
+	if (b->msgs > TOKEN_MSGS_DEPTH(msgs_rate)) b->msgs = TOKEN_MSGS_DEPTH(msgs_rate);
+	b->bytes += elapsed * bytes_rate;
+	if (b->bytes > TOKEN_BYTES_DEPTH(bytes_rate)) b->bytes = TOKEN_BYTES_DEPTH(bytes_rate);
+	if (msgs_rate > 0 && b->msgs < 1000)
+	{
+		wait = (1000 - b->msgs + msgs_rate - 1) / msgs_rate;
+	}
+	need = (unsigned long long)len * 1000;
+	if (bytes_rate > 0 && b->bytes < need)
+	{
+		w = (need - b->bytes + bytes_rate - 1) / bytes_rate;
+		if (w > wait) wait = w;
+	}
+	if (wait > 0) return (int)wait;
+	if (msgs_rate > 0) b->msgs -= 1000;
+	if (bytes_rate > 0) b->bytes -= need;
 	return 0;
 }
 
-int sub_server_list_sendmsg_to_all(struct sub_server_list *list, char *msg, size_t len)
+#define CACHE_LINE_SIZE 64
+#define SLAB_CHUNK_SIZE 256 /* sub servers allocated at once */
+
+#define ROOM_NAME_LEN_MAX 50
+#define ROOMS_PER_CLIENT_MAX 16
+
+/* sub server
+ * fields used by every broadcast come first, fields only used by the
+ * owner of the client start on a cache line of their own */
+struct sub_server
 {
-	char send_buf[BUFFER_SIZE];
-	size_t send_len;
-	strncpy(send_buf, msg, len);
-	send_len = len;
+	/* hot: fan-out */
+	int client_fd; /* client socket */
+	int closing; /* disconnected by the slow consumer policy */
+	unsigned int peer; /* node id of a linked server of the cluster, 0: a client */
+	/* bounded outbound ring, fed by broadcasts without blocking
+	 * and drained whenever the socket is writable */
+	struct out_frame **out_queue;
+	unsigned int out_head; /* oldest message */
+	unsigned int out_count;
+	size_t out_offset; /* bytes of oldest message already sent */
+	int flush_pending; /* held back until the next flush tick */
+	unsigned int out_sending; /* oldest messages owned by an io_uring send */
+	int out_ready; /* on the ready list of its reactor */
+	struct log_cursor *range; /* log range queued as the queue drains */
+	int deflate; /* gets the compressed form of frames which have one */
+	unsigned int out_plain; /* oldest frames, queued before that was agreed */
+	int batch; /* takes batches of messages to everybody */
+	unsigned int batch_from; /* first batch of its list it takes */
+	int roster; /* follows the roster */
+	struct sub_server *ready_next;
+	struct sub_server_list *list; /* list which owns this node */
 #if defined(UNIX)
-	pthread_mutex_lock(&mutex_server_list);
+	pthread_mutex_t mutex_out;
 #elif defined(WINDOWS)
-	EnterCriticalSection(&cs_server_list);
+	CRITICAL_SECTION cs_out;
 #endif
-	struct sub_server *cur = list->begin;
-	while (cur != NULL)
-	{
-		if (send(cur->client_fd, (char *)&send_buf, send_len, 0) == -1)
-		{
-			/* do nothing */
-		}
-		cur = cur->next;
-	}
+	/* cold: owner only */
 #if defined(UNIX)
-	pthread_mutex_unlock(&mutex_server_list);
+	pthread_t thd __attribute__((aligned(CACHE_LINE_SIZE))); /* client socket */
+	pthread_t thd_id;
 #elif defined(WINDOWS)
-	LeaveCriticalSection(&cs_server_list);
+	HANDLE thd __attribute__((aligned(CACHE_LINE_SIZE)));
+	DWORD thd_id;
 #endif
+	char nickname[NICKNAME_LEN_MAX];
+	unsigned char nickname_len;
+	char client_ip_addr[16];
+	struct frame_decoder decoder; /* frames received so far */
+	struct token_bucket bucket; /* receive rate limit */
+	unsigned long long throttled_until; /* ms, frames held back till then */
+	int throttled; /* parked on its reactor */
+	struct sub_server *throttle_next;
+	struct room *rooms[ROOMS_PER_CLIENT_MAX]; /* joined rooms */
+	unsigned int room_count;
+	int nick_indexed; /* nickname was registered */
+	struct sub_server *nick_next; /* nickname index chain */
+	struct reactor *reactor; /* owner of the client, if any */
+	struct peer *peer_out; /* configured peer this server connected to */
+	int uring_inflight; /* submissions not completed yet */
+	struct uring_send *uring_send;
+	unsigned int index; /* position in members of list */
+	unsigned int slot; /* position in slab of list */
+	unsigned int generation; /* bumped whenever the slot is freed */
+	struct sub_server *next; /* free slot chain */
+};
+
+#if defined(UNIX)
+/* log ranges are read with the message log further down */
+struct log_cursor;
+void log_cursor_free(struct log_cursor *c);
+static void log_cursor_fill(struct sub_server *server);
+#endif
+
+/* immutable copy of the members of a sub server list,
+ * broadcasts walk it without taking any lock */
+struct sub_server_snapshot
+{
+	unsigned long version;
+	unsigned int size;
+	unsigned int capacity; /* servers it has room for */
+	struct sub_server *servers[];
+};
+
+/* members published for lock-free readers,
+ * writers are serialized by the lock of the owner of the set
+ * a set changes by one member at a time and the snapshot retired by
+ * the last change is kept, it has room for at least one member less
+ * than the current one, so a removal never needs memory and can't
+ * leave a deleted member in the published snapshot */
+struct sub_server_set
+{
+	struct sub_server_snapshot *snapshot;
+	struct sub_server_snapshot *spare; /* retired, no reader left in it */
+	unsigned long epoch; /* parity tells which reader counter is current */
+	unsigned long readers[2]; /* readers inside the snapshot */
+};
+
+int sub_server_set_init(struct sub_server_set *set)
+{
+	set->snapshot = (struct sub_server_snapshot *)calloc(1, sizeof(struct sub_server_snapshot));
+	if (set->snapshot == NULL) return -1;
+	set->spare = NULL;
+	set->epoch = 0;
+	set->readers[0] = set->readers[1] = 0;
 	return 0;
 }
 
-/* GLOBAL variables */
-int server_fd;
-struct sub_server_list *server_list;
+/* no reader may be left */
+void sub_server_set_free(struct sub_server_set *set)
+{
+	free(set->snapshot);
+	free(set->spare);
+}
 
-/* clean work before exit server program */
-int clean(void)
+/* enter a snapshot read section, return the counter to leave with */
+static unsigned int sub_server_set_read_lock(struct sub_server_set *set)
 {
-	/* close sub servers */
-	sub_server_list_destroy(server_list);
-	/* close mini shell */
+	unsigned int idx = __atomic_load_n(&set->epoch, __ATOMIC_SEQ_CST) & 1;
+	__atomic_fetch_add(&set->readers[idx], 1, __ATOMIC_SEQ_CST);
+	return idx;
+}
+
+static void sub_server_set_read_unlock(struct sub_server_set *set, unsigned int idx)
+{
+	__atomic_fetch_sub(&set->readers[idx], 1, __ATOMIC_SEQ_CST);
+}
+
+/* wait until every read section that might still see an unpublished
+ * snapshot is over, writer lock held
+ * flipping twice also covers a reader that picked the old counter just
+ * before the first flip and entered just after the first wait */
+static void sub_server_set_synchronize(struct sub_server_set *set)
+{
+	int phase;
+	for (phase = 0; phase < 2; phase++)
+	{
+		unsigned int idx = __atomic_fetch_add(&set->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+		while (__atomic_load_n(&set->readers[idx], __ATOMIC_SEQ_CST) != 0)
+		{
 #if defined(UNIX)
-	pthread_cancel(thd_shell);
+			sched_yield();
 #elif defined(WINDOWS)
-	TerminateThread(&thd_shell, 0);
+			Sleep(0);
 #endif
+		}
+	}
+}
+
+/* copy members into the spare or a new snapshot and publish it,
+ * writer lock held, return the previous snapshot to retire after a
+ * grace period or NULL if out of memory */
+static struct sub_server_snapshot *sub_server_set_publish(struct sub_server_set *set, struct sub_server **members, unsigned int size)
+{
+	struct sub_server_snapshot *old = set->snapshot, *snap = set->spare;
+	if (snap == NULL || snap->capacity < size)
+	{
+		snap = (struct sub_server_snapshot *)malloc(sizeof(struct sub_server_snapshot) + size * sizeof(struct sub_server *));
+		if (snap == NULL) return NULL;
+		snap->capacity = size;
+		free(set->spare);
+	}
+	set->spare = NULL;
+	snap->version = old->version + 1;
+	snap->size = size;
+	memcpy(snap->servers, members, size * sizeof(struct sub_server *));
+	__atomic_store_n(&set->snapshot, snap, __ATOMIC_SEQ_CST);
+	return old;
+}
+
+/* publish members and keep the previous snapshot as the spare once no
+ * reader can see it anymore, writer lock held, return -1 if out of
+ * memory, the previous snapshot stays published then */
+static int sub_server_set_update(struct sub_server_set *set, struct sub_server **members, unsigned int size)
+{
+	struct sub_server_snapshot *old = sub_server_set_publish(set, members, size);
+	if (old == NULL) return -1;
+	sub_server_set_synchronize(set);
+	set->spare = old;
 	return 0;
 }
 
-/* fatal error occurred, 
- * print the error message and exit server program */
-void fatal_error(char *msg)
+/* sub server list
+ * the thread engine keeps one list for all clients,
+ * the epoll engine keeps one list (shard) per reactor
+ * nodes live in a slab of cache aligned chunks and members is a dense
+ * array of them, so insert and delete are O(1) without malloc
+ * the mutex only serializes membership changes, every change publishes
+ * a new snapshot of set and waits for a grace period before the old
+ * snapshot and any deleted node are released */
+struct sub_server_list
 {
-	printf("Error : %s\n", msg);
-	clean();
-	exit(1);
+	struct sub_server **members;
+	unsigned int size;
+	unsigned int capacity;
+	struct sub_server **chunks; /* slab */
+	unsigned int chunk_count;
+	struct sub_server *free_slots;
+	struct sub_server_set set; /* broadcasts walk its snapshot */
+	int coalescing; /* throughput mode */
+	int rate_elapsed; /* ms since the message rate was last measured */
+	/* in throughput mode messages to everybody are also gathered in one
+	 * batch frame for the members taking batches, which get it at the
+	 * next flush tick instead of every message on its own */
+	struct out_frame *batch; /* open batch, NULL: none */
+	unsigned int batch_seq; /* id of the open batch */
+	unsigned int batch_clients; /* members taking batches */
+#if defined(UNIX)
+	pthread_mutex_t mutex_batch;
+#elif defined(WINDOWS)
+	CRITICAL_SECTION cs_batch;
+#endif
+	/* messages queued for the members since the last flush tick */
+	unsigned long delivered __attribute__((aligned(CACHE_LINE_SIZE)));
+	unsigned long long locked_at; /* ns the mutex was taken at */
+#if defined(UNIX)
+	pthread_mutex_t mutex;
+#elif defined(WINDOWS)
+	CRITICAL_SECTION cs;
+#endif
+};
+
+struct sub_server_list *sub_server_list_new()
+{
+	struct sub_server_list *new_list = (struct sub_server_list *)calloc(1, sizeof(struct sub_server_list));
+	if (new_list == NULL) return NULL;
+	if (sub_server_set_init(&new_list->set) == -1)
+	{
+		free(new_list);
+		return NULL;
+	}
+#if defined(UNIX)
+	pthread_mutex_init(&new_list->mutex, NULL);
+	pthread_mutex_init(&new_list->mutex_batch, NULL);
+#elif defined(WINDOWS)
+	/* need to initialize critical section for Windows*/
+	if (InitializeCriticalSectionAndSpinCount(&new_list->cs, 4000) != TRUE)
+	{
+		sub_server_set_free(&new_list->set);
+		free(new_list);
+		return NULL;
+	}
+	InitializeCriticalSection(&new_list->cs_batch);
+#endif
+	return new_list;
+}
+
+/* membership changes hold the mutex, how long is measured */
+static void sub_server_list_lock(struct sub_server_list *list)
+{
+#if defined(UNIX)
+	pthread_mutex_lock(&list->mutex);
+#elif defined(WINDOWS)
+	EnterCriticalSection(&list->cs);
+#endif
+	list->locked_at = monotonic_ns();
+}
+
+static void sub_server_list_unlock(struct sub_server_list *list)
+{
+	unsigned long long held = monotonic_ns() - list->locked_at;
+#if defined(UNIX)
+	pthread_mutex_unlock(&list->mutex);
+#elif defined(WINDOWS)
+	LeaveCriticalSection(&list->cs);
+#endif
+	metric_record(LATENCY_LIST_LOCK, held);
+}
+
+/* the open batch is only ever taken after the list mutex */
+static void sub_server_list_batch_lock(struct sub_server_list *list)
+{
+#if defined(UNIX)
+	pthread_mutex_lock(&list->mutex_batch);
+#elif defined(WINDOWS)
+	EnterCriticalSection(&list->cs_batch);
+#endif
+}
+
+static void sub_server_list_batch_unlock(struct sub_server_list *list)
+{
+#if defined(UNIX)
+	pthread_mutex_unlock(&list->mutex_batch);
+#elif defined(WINDOWS)
+	LeaveCriticalSection(&list->cs_batch);
+#endif
+}
+
+/* take a free node from the slab, list mutex held */
+static struct sub_server *sub_server_list_alloc(struct sub_server_list *list)
+{
+	struct sub_server *chunk, *node;
+	unsigned int i;
+	if (list->free_slots == NULL)
+	{
+		struct sub_server **new_chunks = (struct sub_server **)realloc(list->chunks, (list->chunk_count + 1) * sizeof(struct sub_server *));
+		if (new_chunks == NULL) return NULL;
+		list->chunks = new_chunks;
+#if defined(UNIX)
+		if (posix_memalign((void **)&chunk, CACHE_LINE_SIZE, SLAB_CHUNK_SIZE * sizeof(struct sub_server)) != 0) return NULL;
+#elif defined(WINDOWS)
+		chunk = (struct sub_server *)_aligned_malloc(SLAB_CHUNK_SIZE * sizeof(struct sub_server), CACHE_LINE_SIZE);
+		if (chunk == NULL) return NULL;
+#endif
+		bzero(chunk, SLAB_CHUNK_SIZE * sizeof(struct sub_server));
+		/* chain new slots so the lowest is used first */
+		for (i = SLAB_CHUNK_SIZE; i > 0; i--)
+		{
+			node = &chunk[i - 1];
+			node->slot = list->chunk_count * SLAB_CHUNK_SIZE + i - 1;
+			node->next = list->free_slots;
+			list->free_slots = node;
+		}
+		list->chunks[list->chunk_count++] = chunk;
+	}
+	node = list->free_slots;
+	list->free_slots = node->next;
+	node->next = NULL;
+	return node;
+}
+
+/* give a node back to the slab, list mutex held */
+static void sub_server_list_release(struct sub_server_list *list, struct sub_server *node)
+{
+	node->generation++;
+	node->next = list->free_slots;
+	list->free_slots = node;
+}
+
+/* handle stays unique while the client is alive and turns stale once
+ * its slot is reused */
+unsigned long long sub_server_handle(struct sub_server *server)
+{
+	return ((unsigned long long)server->generation << 32) | server->slot;
+}
+
+/* find a member by handle, NULL if it is gone,
+ * list mutex or a snapshot read section held */
+struct sub_server *sub_server_list_get(struct sub_server_list *list, unsigned long long handle)
+{
+	unsigned int slot = (unsigned int)(handle & 0xffffffff);
+	struct sub_server *node;
+	if (slot / SLAB_CHUNK_SIZE >= list->chunk_count) return NULL;
+	node = &list->chunks[slot / SLAB_CHUNK_SIZE][slot % SLAB_CHUNK_SIZE];
+	if (node->generation != (unsigned int)(handle >> 32) || node->list != list) return NULL;
+	return node;
+}
+
+/* release every queued message of a client */
+void sub_server_out_free(struct sub_server *server)
+{
+	while (server->out_count > 0)
+	{
+		out_frame_release(server->out_queue[server->out_head]);
+		out_frame_unref(server->out_queue[server->out_head]);
+		server->out_head = (server->out_head + 1) % out_queue_size;
+		server->out_count--;
+	}
+	free(server->out_queue);
+	free(server->uring_send);
+#if defined(UNIX)
+	if (server->range != NULL) log_cursor_free(server->range);
+#endif
+#if defined(UNIX)
+	pthread_mutex_destroy(&server->mutex_out);
+#elif defined(WINDOWS)
+	DeleteCriticalSection(&server->cs_out);
+#endif
+}
+
+struct sub_server *sub_server_list_push_back(struct sub_server_list *list, struct sub_server *server)
+{
+	sub_server_list_lock(list);
+	struct sub_server *new_node = NULL;
+	struct out_frame **out_queue = NULL;
+	/* room for one more member */
+	if (list->size == list->capacity)
+	{
+		unsigned int new_capacity = list->capacity == 0 ? SLAB_CHUNK_SIZE : list->capacity * 2;
+		struct sub_server **new_members = (struct sub_server **)realloc(list->members, new_capacity * sizeof(struct sub_server *));
+		if (new_members == NULL) goto done;
+		list->members = new_members;
+		list->capacity = new_capacity;
+	}
+	out_queue = (struct out_frame **)calloc(out_queue_size, sizeof(struct out_frame *));
+	if (out_queue == NULL) goto done;
+	new_node = sub_server_list_alloc(list);
+	if (new_node == NULL)
+	{
+		free(out_queue);
+		goto done;
+	}
+	new_node->client_fd = server->client_fd;
+	new_node->closing = 0;
+	new_node->peer = 0;
+	new_node->out_queue = out_queue;
+	new_node->out_head = 0;
+	new_node->out_count = 0;
+	new_node->out_offset = 0;
+	new_node->flush_pending = 0;
+	new_node->out_sending = 0;
+	new_node->range = NULL;
+	new_node->deflate = 0;
+	new_node->out_plain = 0;
+	new_node->batch = 0;
+	new_node->batch_from = 0;
+	new_node->roster = 0;
+	new_node->out_ready = 0;
+	new_node->ready_next = NULL;
+#if defined(UNIX)
+	pthread_mutex_init(&new_node->mutex_out, NULL);
+#elif defined(WINDOWS)
+	InitializeCriticalSection(&new_node->cs_out);
+#endif
+	new_node->thd = server->thd;
+	new_node->thd_id = server->thd_id;
+	strncpy(new_node->nickname, server->nickname, NICKNAME_LEN_MAX);
+	new_node->nickname_len = server->nickname_len;
+	strncpy(new_node->client_ip_addr, server->client_ip_addr, 16);
+	frame_decoder_init(&new_node->decoder);
+	new_node->room_count = 0;
+	new_node->nick_indexed = 0;
+	new_node->nick_next = NULL;
+	token_bucket_init(&new_node->bucket, monotonic_ms());
+	new_node->throttled_until = 0;
+	new_node->throttled = 0;
+	new_node->throttle_next = NULL;
+	new_node->reactor = NULL;
+	new_node->peer_out = NULL;
+	new_node->uring_inflight = 0;
+	new_node->uring_send = NULL;
+	new_node->list = list;
+	new_node->index = list->size;
+	list->members[list->size++] = new_node;
+	/* broadcasts see the new node from now on */
+	if (sub_server_set_update(&list->set, list->members, list->size) == -1)
+	{
+		/* no snapshot ever had it, it goes right away */
+		list->size--;
+		sub_server_out_free(new_node);
+		frame_decoder_free(&new_node->decoder);
+		new_node->list = NULL;
+		sub_server_list_release(list, new_node);
+		new_node = NULL;
+	}
+done:
+	sub_server_list_unlock(list);
+	return new_node;
+}
+
+int sub_server_list_delete(struct sub_server_list *list, struct sub_server *server)
+{
+	int ret = 0;
+	if (list == NULL) return 0;
+	sub_server_list_lock(list);
+	/* can't find target */
+	if (server->list != list || server->index >= list->size || list->members[server->index] != server)
+	{
+		goto done;
+	}
+	/* move the last member into the hole */
+	struct sub_server *last = list->members[--list->size];
+	list->members[server->index] = last;
+	last->index = server->index;
+	/* a broadcast may still hold the node through the old snapshot,
+	 * so neither the node nor its fd go away before the grace period */
+	if (sub_server_set_update(&list->set, list->members, list->size) == -1)
+	{
+		/* can't happen with the spare, but if the old snapshot
+		 * stays published the node must stay too, it is only shut */
+		list->members[server->index] = server;
+		list->members[list->size++] = last;
+		last->index = list->size - 1;
+		server->closing = 1;
+#if defined(UNIX)
+		shutdown(server->client_fd, SHUT_RDWR);
+#elif defined(WINDOWS)
+		shutdown(server->client_fd, SD_BOTH);
+#endif
+		ret = -1;
+		goto done;
+	}
+	/* delete node */
+	/* the thread will exit it by itself */
+#if 0
+#if defined(UNIX)
+	pthread_cancel(server->thd);
+#elif defined(WINDOWS)
+	TerminateThread(&server->thd, 0);
+#endif
+#endif
+	close(server->client_fd);
+	if (server->deflate) __sync_fetch_and_sub(&deflate_clients, 1);
+	if (server->batch)
+	{
+		sub_server_list_batch_lock(list);
+		__atomic_store_n(&list->batch_clients, list->batch_clients - 1, __ATOMIC_RELAXED);
+		sub_server_list_batch_unlock(list);
+	}
+	sub_server_out_free(server);
+	frame_decoder_free(&server->decoder);
+	server->list = NULL;
+	sub_server_list_release(list, server);
+done:
+	sub_server_list_unlock(list);
+	return ret;
+}
+
+/* copy of a client for listings */
+struct job
+{
+	unsigned long long handle;
+	unsigned long thd_id;
+	int client_fd;
+	char client_ip_addr[16];
+	char nickname[NICKNAME_LEN_MAX];
+	unsigned char nickname_len;
+	unsigned int queued;
+};
+
+/* copy every member out of the current snapshot, nothing is printed or
+ * written inside the read section, so however slow the listing goes
+ * out it never holds up joins, leaves or broadcasts
+ * the owner may be renaming a client meanwhile, its nickname is only
+ * as good as a listing needs, return count of jobs, -1 if out of memory */
+int sub_server_list_jobs(struct sub_server_list *list, struct job **jobs)
+{
+	unsigned int i, idx;
+	struct sub_server *cur;
+	struct job *job;
+	idx = sub_server_set_read_lock(&list->set);
+	struct sub_server_snapshot *snap = __atomic_load_n(&list->set.snapshot, __ATOMIC_SEQ_CST);
+	*jobs = (struct job *)malloc((snap->size > 0 ? snap->size : 1) * sizeof(struct job));
+	if (*jobs == NULL)
+	{
+		sub_server_set_read_unlock(&list->set, idx);
+		return -1;
+	}
+	for (i = 0; i < snap->size; i++)
+	{
+		cur = snap->servers[i];
+		job = &(*jobs)[i];
+		job->handle = sub_server_handle(cur);
+		job->thd_id = (unsigned long)cur->thd_id;
+		job->client_fd = cur->client_fd;
+		memcpy(job->client_ip_addr, cur->client_ip_addr, sizeof(job->client_ip_addr));
+		job->client_ip_addr[sizeof(job->client_ip_addr) - 1] = '\0';
+		job->nickname_len = cur->nickname_len > NICKNAME_LEN_MAX ? NICKNAME_LEN_MAX : cur->nickname_len;
+		memcpy(job->nickname, cur->nickname, job->nickname_len);
+		job->queued = cur->out_count;
+	}
+	sub_server_set_read_unlock(&list->set, idx);
+	return (int)i;
+}
+
+int sub_server_list_walk(struct sub_server_list *list)
+{
+	struct job *jobs;
+	int i, n = sub_server_list_jobs(list, &jobs);
+	for (i = 0; i < n; i++)
+	{
+		printf("#%4d: address=%s, thread id=%lu, fd=%d, queued=%u\n", i + 1, jobs[i].client_ip_addr, jobs[i].thd_id, jobs[i].client_fd, jobs[i].queued);
+	}
+	if (n >= 0) free(jobs);
+	return 0;
+}
+
+int sub_server_list_destroy(struct sub_server_list *list)
+{
+	sub_server_list_lock(list);
+	unsigned int idx;
+	struct sub_server *cur;
+	for (idx = 0; idx < list->size; idx++)
+	{
+		cur = list->members[idx];
+		/* reactors of the epoll engine are not owned by a client */
+		if (server_engine == ENGINE_THREAD)
+		{
+#if defined(UNIX)
+			pthread_cancel(cur->thd);
+#elif defined(WINDOWS)
+			TerminateThread(&cur->thd, 0);
+#endif
+		}
+#if defined(UNIX)
+		close(cur->client_fd);
+#elif defined(WINDOWS)
+		closesocket(cur->client_fd);
+		WSACleanup();
+#endif
+		sub_server_out_free(cur);
+		frame_decoder_free(&cur->decoder);
+	}
+	for (idx = 0; idx < list->chunk_count; idx++)
+	{
+#if defined(UNIX)
+		free(list->chunks[idx]);
+#elif defined(WINDOWS)
+		_aligned_free(list->chunks[idx]);
+#endif
+	}
+	free(list->chunks);
+	free(list->members);
+	sub_server_set_free(&list->set);
+	if (list->batch != NULL) out_frame_unref(list->batch);
+	sub_server_list_unlock(list);
+#if defined(UNIX)
+	pthread_mutex_destroy(&list->mutex);
+	pthread_mutex_destroy(&list->mutex_batch);
+#elif defined(WINDOWS)
+	/* need to delete critical section for Windows*/
+	DeleteCriticalSection(&list->cs);
+	DeleteCriticalSection(&list->cs_batch);
+#endif
+	free(list);
+	return 0;
+}
+
+#if defined(UNIX)
+/* sockets of the io_uring engine are blocking */
+#define SEND_FLAGS (MSG_NOSIGNAL | MSG_DONTWAIT)
+#define SEND_MORE MSG_MORE
+#define socket_would_block() (errno == EAGAIN || errno == EWOULDBLOCK)
+#elif defined(WINDOWS)
+#define SEND_FLAGS 0
+#define SEND_MORE 0
+#define socket_would_block() (WSAGetLastError() == WSAEWOULDBLOCK)
+#endif
+
+int set_nonblocking(int fd)
+{
+#if defined(UNIX)
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1) return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#elif defined(WINDOWS)
+	unsigned long ul = 1;
+	return ioctlsocket(fd, FIONBIO, &ul) == 0 ? 0 : -1;
+#endif
+}
+
+int set_blocking(int fd)
+{
+#if defined(UNIX)
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1) return -1;
+	return fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+#elif defined(WINDOWS)
+	unsigned long ul = 0;
+	return ioctlsocket(fd, FIONBIO, &ul) == 0 ? 0 : -1;
+#endif
+}
+
+static void sub_server_out_lock(struct sub_server *server)
+{
+#if defined(UNIX)
+	pthread_mutex_lock(&server->mutex_out);
+#elif defined(WINDOWS)
+	EnterCriticalSection(&server->cs_out);
+#endif
+}
+
+static void sub_server_out_unlock(struct sub_server *server)
+{
+#if defined(UNIX)
+	pthread_mutex_unlock(&server->mutex_out);
+#elif defined(WINDOWS)
+	LeaveCriticalSection(&server->cs_out);
+#endif
+}
+
+/* disconnect a client without touching the list it belongs to,
+ * the owner of the socket notices the shutdown and deletes it */
+void sub_server_kick(struct sub_server *server)
+{
+	if (server->closing) return;
+	server->closing = 1;
+#if defined(UNIX)
+	shutdown(server->client_fd, SHUT_RDWR);
+#elif defined(WINDOWS)
+	shutdown(server->client_fd, SD_BOTH);
+#endif
+}
+
+#if defined(UNIX)
+/* iovecs of a frame from byte skip on, of its compressed form if
+ * deflated, return how many, 1 or 2 */
+static unsigned int out_frame_iov(struct out_frame *frame, int deflated, size_t skip, struct iovec *iov)
+{
+	size_t head = frame->ext != NULL ? FRAME_HEADER_SIZE : frame->len;
+	unsigned int n = 0;
+	if (deflated)
+	{
+		iov[0].iov_base = frame->deflated + skip;
+		iov[0].iov_len = frame->deflated_len - skip;
+		return 1;
+	}
+	if (skip < head)
+	{
+		iov[n].iov_base = frame->data + skip;
+		iov[n++].iov_len = head - skip;
+		skip = 0;
+	}
+	else
+	{
+		skip -= head;
+	}
+	if (frame->ext != NULL)
+	{
+		iov[n].iov_base = (char *)frame->ext + skip;
+		iov[n++].iov_len = frame->len - head - skip;
+	}
+	return n;
+}
+#endif
+
+/* whether the frame n places after the oldest queued one goes out
+ * compressed, out lock held */
+static int sub_server_deflated(struct sub_server *server, struct out_frame *frame, unsigned int n)
+{
+	return server->deflate && n >= server->out_plain && frame->deflated != NULL;
+}
+
+/* release every queued frame covered by sent bytes, a frame sent in
+ * part is remembered in out_offset, return count of frames released */
+static unsigned int sub_server_out_consume(struct sub_server *server, size_t sent)
+{
+	unsigned int released = 0;
+	struct out_frame *frame;
+	size_t len;
+	metric_add(METRIC_BYTES_OUT, sent);
+	while (sent > 0 && server->out_count > 0)
+	{
+		frame = server->out_queue[server->out_head];
+		len = sub_server_deflated(server, frame, 0) ? frame->deflated_len : frame->len;
+		size_t left = len - server->out_offset;
+		if (sent < left)
+		{
+			server->out_offset += sent;
+			break;
+		}
+		sent -= left;
+		out_frame_release(frame);
+		out_frame_unref(frame);
+		server->out_head = (server->out_head + 1) % out_queue_size;
+		server->out_count--;
+		server->out_offset = 0;
+		if (server->out_plain > 0) server->out_plain--;
+		released++;
+	}
+	if (released > 0) metric_add(METRIC_MSGS_OUT, released);
+#if defined(UNIX)
+	if (released > 0 && server->range != NULL) log_cursor_fill(server);
+#endif
+	return released;
+}
+
+/* send as much queued output as the socket takes, up to OUT_IOV_MAX
+ * frames per system call, return -1 if the connection is broken */
+static int sub_server_flush_locked(struct sub_server *server)
+{
+	long ret;
+	unsigned int n, iov_count;
+	struct out_frame *frame;
+#if defined(UNIX)
+	struct iovec iov[OUT_IOV_MAX];
+	struct msghdr mh;
+#elif defined(WINDOWS)
+	WSABUF iov[OUT_IOV_MAX];
+	DWORD sent;
+#endif
+	int deflated;
+	while (server->out_count > 0)
+	{
+		/* gather queued frames, the oldest may be partially sent,
+		 * a frame mapped from the log takes two iovecs */
+		for (n = 0, iov_count = 0; n < server->out_count && iov_count + 2 <= OUT_IOV_MAX; n++)
+		{
+			frame = server->out_queue[(server->out_head + n) % out_queue_size];
+			size_t skip = n == 0 ? server->out_offset : 0;
+			deflated = sub_server_deflated(server, frame, n);
+#if defined(UNIX)
+			iov_count += out_frame_iov(frame, deflated, skip, iov + iov_count);
+#elif defined(WINDOWS)
+			iov[iov_count].buf = (deflated ? frame->deflated : frame->data) + skip;
+			iov[iov_count++].len = (deflated ? frame->deflated_len : frame->len) - skip;
+#endif
+		}
+#if defined(UNIX)
+		bzero(&mh, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = iov_count;
+		/* more frames follow, don't push a partial segment */
+		ret = sendmsg(server->client_fd, &mh, SEND_FLAGS | (server->out_count > n ? SEND_MORE : 0));
+#elif defined(WINDOWS)
+		ret = WSASend(server->client_fd, iov, iov_count, &sent, 0, NULL, NULL) == 0 ? (long)sent : -1;
+#endif
+		if (ret == -1)
+		{
+			if (errno == EINTR) continue;
+			if (socket_would_block()) break;
+			return -1;
+		}
+		sub_server_out_consume(server, ret);
+		/* the socket took less than offered, it is full */
+		if (server->out_count > 0 && server->out_offset > 0) break;
+	}
+	return 0;
+}
+
+int sub_server_flush(struct sub_server *server)
+{
+	int ret;
+	sub_server_out_lock(server);
+	ret = sub_server_flush_locked(server);
+	sub_server_out_unlock(server);
+	return ret;
+}
+
+#if defined(UNIX)
+/* frame posted to a reactor by another reactor */
+struct reactor_msg
+{
+	struct reactor_msg *next;
+	struct out_frame *frame; /* NULL: a socket to take over */
+	int fd;
+	struct peer *peer; /* the socket is a link to it */
+};
+
+/* io_uring instance of a reactor */
+struct uring
+{
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	unsigned int sq_local_tail; /* prepared, published on submit */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *bufs; /* provided receive buffers */
+	char *buf_pool;
+	unsigned short buf_tail;
+};
+
+/* reactor of the epoll and io_uring engines */
+struct reactor
+{
+	int id;
+	pthread_t thd;
+	int epfd;
+	struct uring ring;
+	int listen_fd; /* own SO_REUSEPORT listening socket */
+	int event_fd; /* wakes the reactor up when inbox is filled */
+	uint64_t last_tick; /* monotonic ms of the previous flush tick */
+	uint64_t next_tick;
+	struct sub_server_list *list; /* shard of clients owned by this reactor */
+	pthread_mutex_t mutex_inbox;
+	struct reactor_msg *inbox_head;
+	struct reactor_msg *inbox_tail;
+	struct sub_server *ready_head; /* clients to write, io_uring only */
+	struct sub_server *throttled_head; /* clients over their rate limit */
+	int accepting; /* multishot accept armed, io_uring only */
+	int quiescing; /* nothing is armed until thawed, io_uring only */
+};
+
+struct reactor *reactors;
+int reactor_count;
+__thread struct reactor *current_reactor; /* reactor of this thread */
+
+/* post a frame to the inbox of another reactor */
+int reactor_post(struct reactor *r, struct out_frame *frame)
+{
+	struct reactor_msg *node = (struct reactor_msg *)malloc(sizeof(struct reactor_msg));
+	if (node == NULL) return -1;
+	node->next = NULL;
+	node->frame = out_frame_ref(frame);
+	node->fd = -1;
+	node->peer = NULL;
+	out_frame_hold(frame);
+	pthread_mutex_lock(&r->mutex_inbox);
+	int was_empty = r->inbox_head == NULL && r->ready_head == NULL;
+	if (r->inbox_head == NULL) r->inbox_head = node;
+	else r->inbox_tail->next = node;
+	r->inbox_tail = node;
+	pthread_mutex_unlock(&r->mutex_inbox);
+	/* the reactor is woken once per batch of posts */
+	if (was_empty)
+	{
+		uint64_t one = 1;
+		while (write(r->event_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+	}
+	return 0;
+}
+
+/* post a socket connected elsewhere to another reactor,
+ * return -1 and close it if out of memory */
+int reactor_post_socket(struct reactor *r, int fd, struct peer *peer)
+{
+	struct reactor_msg *node = (struct reactor_msg *)malloc(sizeof(struct reactor_msg));
+	uint64_t one = 1;
+	if (node == NULL)
+	{
+		close(fd);
+		return -1;
+	}
+	node->next = NULL;
+	node->frame = NULL;
+	node->fd = fd;
+	node->peer = peer;
+	pthread_mutex_lock(&r->mutex_inbox);
+	if (r->inbox_head == NULL) r->inbox_head = node;
+	else r->inbox_tail->next = node;
+	r->inbox_tail = node;
+	pthread_mutex_unlock(&r->mutex_inbox);
+	while (write(r->event_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+	return 0;
+}
+
+/* have the reactor owning a client write its queue, out lock held
+ * only the thread of a reactor submits to its ring, everybody else
+ * leaves the client on its ready list */
+static void reactor_want_flush(struct sub_server *server)
+{
+	struct reactor *r = server->reactor;
+	if (server->out_ready) return;
+	server->out_ready = 1;
+	pthread_mutex_lock(&r->mutex_inbox);
+	int was_empty = r->inbox_head == NULL && r->ready_head == NULL;
+	server->ready_next = r->ready_head;
+	r->ready_head = server;
+	pthread_mutex_unlock(&r->mutex_inbox);
+	/* the reactor itself looks at the list before it sleeps */
+	if (was_empty && current_reactor != r)
+	{
+		uint64_t one = 1;
+		while (write(r->event_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+	}
+}
+#endif
+
+/* write queued output of a client now or have it written soon,
+ * out lock held, return -1 if the connection is broken */
+static int sub_server_output(struct sub_server *server)
+{
+#if defined(UNIX)
+	if (server_engine == ENGINE_URING)
+	{
+		/* the ring is submitted only after all completions at hand are
+		 * handled, a reactor filling up a queue writes it right away */
+		if (server->reactor == current_reactor && server->out_sending == 0
+				&& server->out_count >= out_queue_size / 2
+				&& sub_server_flush_locked(server) == -1)
+		{
+			return -1;
+		}
+		if (server->out_count > 0) reactor_want_flush(server);
+		return 0;
+	}
+#endif
+	return sub_server_flush_locked(server);
+}
+
+/* queue a reference to frame for a client and try to send it right
+ * away, never blocks, a full queue is handled by the slow consumer policy,
+ * the frame may overtake the open batch of the list */
+static int sub_server_queue(struct sub_server *server, struct out_frame *frame)
+{
+	int ret = 0;
+	unsigned int busy;
+	sub_server_out_lock(server);
+	if (server->closing)
+	{
+		ret = -1;
+		goto done;
+	}
+	if (server->out_count == out_queue_size)
+	{
+		switch (server->peer ? peer_policy : slow_consumer_policy)
+		{
+			case POLICY_DROP_OLDEST:
+				/* messages being sent can't be dropped,
+				 * drop the oldest one queued after them instead */
+				busy = server->out_sending > 0 ? server->out_sending : server->out_offset > 0;
+				/* a log range must arrive whole */
+				if (busy >= out_queue_size || server->out_queue[(server->out_head + busy) % out_queue_size]->ext != NULL)
+				{
+					__sync_fetch_and_add(&slow_consumer_count[POLICY_DROP_NEWEST], 1);
+					goto done;
+				}
+				out_frame_release(server->out_queue[(server->out_head + busy) % out_queue_size]);
+				out_frame_unref(server->out_queue[(server->out_head + busy) % out_queue_size]);
+				if (busy < server->out_plain) server->out_plain--;
+				for (; busy > 0; busy--)
+				{
+					server->out_queue[(server->out_head + busy) % out_queue_size] = server->out_queue[(server->out_head + busy - 1) % out_queue_size];
+				}
+				server->out_head = (server->out_head + 1) % out_queue_size;
+				server->out_count--;
+				__sync_fetch_and_add(&slow_consumer_count[POLICY_DROP_OLDEST], 1);
+				break;
+			case POLICY_DROP_NEWEST:
+				__sync_fetch_and_add(&slow_consumer_count[POLICY_DROP_NEWEST], 1);
+				goto done;
+			case POLICY_DISCONNECT:
+				__sync_fetch_and_add(&slow_consumer_count[POLICY_DISCONNECT], 1);
+				sub_server_kick(server);
+				ret = -1;
+				goto done;
+		}
+	}
+	out_frame_hold(frame);
+	server->out_queue[(server->out_head + server->out_count) % out_queue_size] = out_frame_ref(frame);
+	server->out_count++;
+	__atomic_fetch_add(&server->list->delivered, 1, __ATOMIC_RELAXED);
+	if (server->list->coalescing && server->out_count < out_queue_size / 2)
+	{
+		/* the next flush tick writes everything gathered until then,
+		 * unless holding back more would risk the slow consumer policy */
+		server->flush_pending = 1;
+	}
+	/* older messages are still waiting for the socket to be writable,
+	 * unless the engine has not even tried to write them yet */
+	else if (server->out_count == 1 || server->flush_pending || server->out_count == out_queue_size / 2)
+	{
+		server->flush_pending = 0;
+		if (sub_server_output(server) == -1)
+		{
+			sub_server_kick(server);
+			ret = -1;
+		}
+	}
+done:
+	sub_server_out_unlock(server);
+	return ret;
+}
+
+/* send the open batch to the members taking it, batch lock held, so
+ * batches of a list go out in order */
+static void sub_server_list_batch_send(struct sub_server_list *list)
+{
+	struct out_frame *batch = list->batch, *shrunk;
+	unsigned int i, idx;
+	if (batch == NULL) return;
+	__atomic_store_n(&list->batch, NULL, __ATOMIC_RELAXED);
+	/* room was made for a whole frame */
+	if ((shrunk = (struct out_frame *)realloc(batch, sizeof(struct out_frame) + batch->len)) != NULL) batch = shrunk;
+	frame_encode_header(batch->data, CMD_RECV_BATCH, 0, batch->len - FRAME_HEADER_SIZE);
+	if (__atomic_load_n(&deflate_clients, __ATOMIC_RELAXED) > 0) out_frame_deflate(batch);
+	/* held like a broadcast until every queue is done with it */
+	batch->stamp = monotonic_ns();
+	batch->pending = 1;
+	idx = sub_server_set_read_lock(&list->set);
+	struct sub_server_snapshot *snap = __atomic_load_n(&list->set.snapshot, __ATOMIC_SEQ_CST);
+	for (i = 0; i < snap->size; i++)
+	{
+		if (snap->servers[i]->batch && snap->servers[i]->batch_from <= list->batch_seq) sub_server_queue(snap->servers[i], batch);
+	}
+	sub_server_set_read_unlock(&list->set, idx);
+	list->batch_seq++;
+	out_frame_release(batch);
+	out_frame_unref(batch);
+}
+
+/* a frame for a client taking batches must not overtake the open batch
+ * of its list, so that goes out first */
+static void sub_server_batch_before(struct sub_server *server)
+{
+	struct sub_server_list *list = server->list;
+	if (!__atomic_load_n(&server->batch, __ATOMIC_ACQUIRE) || __atomic_load_n(&list->batch, __ATOMIC_RELAXED) == NULL) return;
+	sub_server_list_batch_lock(list);
+	sub_server_list_batch_send(list);
+	sub_server_list_batch_unlock(list);
+}
+
+int sub_server_enqueue(struct sub_server *server, struct out_frame *frame)
+{
+	sub_server_batch_before(server);
+	return sub_server_queue(server, frame);
+}
+
+/* CMD_ERROR telling why a command failed, NULL if out of memory */
+static struct out_frame *sub_server_error_frame(unsigned char cmd, const char *reason)
+{
+	size_t reason_len = strlen(reason);
+	struct out_frame *frame = out_frame_new(FRAME_HEADER_SIZE + 1 + reason_len);
+	if (frame == NULL) return NULL;
+	frame_encode_header(frame->data, CMD_ERROR, 0, 1 + reason_len);
+	frame->data[FRAME_HEADER_SIZE] = (char)cmd;
+	memcpy(frame->data + FRAME_HEADER_SIZE + 1, reason, reason_len);
+	return frame;
+}
+
+/* gather a message to everybody into the open batch, batch lock held,
+ * return 0 if it can't go in one */
+static int sub_server_list_batch_add(struct sub_server_list *list, struct out_frame *frame)
+{
+	struct out_frame *batch = list->batch, **parts;
+	size_t len = frame->len - FRAME_HEADER_SIZE;
+	if ((unsigned char)frame->data[0] != CMD_RECV_MSG || frame->ext != NULL) return 0;
+	if (batch != NULL && batch->len + len > FRAME_SIZE_MAX)
+	{
+		sub_server_list_batch_send(list);
+		batch = NULL;
+	}
+	if (batch == NULL)
+	{
+		if ((batch = out_frame_new(FRAME_SIZE_MAX)) == NULL) return 0;
+		batch->len = FRAME_HEADER_SIZE;
+		__atomic_store_n(&list->batch, batch, __ATOMIC_RELAXED);
+	}
+	/* parts grow by doubling */
+	if ((batch->part_count & (batch->part_count - 1)) == 0)
+	{
+		parts = (struct out_frame **)realloc(batch->parts, (batch->part_count == 0 ? 8 : batch->part_count * 2) * sizeof(struct out_frame *));
+		if (parts == NULL) return 0;
+		batch->parts = parts;
+	}
+	memcpy(batch->data + batch->len, frame->data + FRAME_HEADER_SIZE, len);
+	batch->len += len;
+	out_frame_hold(frame);
+	batch->parts[batch->part_count++] = out_frame_ref(frame);
+	return 1;
+}
+
+/* a client takes batches from the next one of its list on */
+void sub_server_agree_batch(struct sub_server *server)
+{
+	struct sub_server_list *list = server->list;
+	if (server->batch) return;
+	sub_server_list_batch_lock(list);
+	/* read without the lock by the fan-out, which must not see the
+	 * flag before the first batch */
+	__atomic_store_n(&server->batch_from, list->batch_seq + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&server->batch, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&list->batch_clients, list->batch_clients + 1, __ATOMIC_RELAXED);
+	sub_server_list_batch_unlock(list);
+}
+
+int sub_server_list_sendmsg_to_all(struct sub_server_list *list, struct out_frame *frame)
+{
+	unsigned int i, idx, seq = 0, batched = 0;
+	struct sub_server *server;
+	/* a message not gathered in the open batch must not overtake it */
+	if (__atomic_load_n(&list->batch_clients, __ATOMIC_RELAXED) > 0 || __atomic_load_n(&list->batch, __ATOMIC_RELAXED) != NULL)
+	{
+		sub_server_list_batch_lock(list);
+		if (!list->coalescing || list->batch_clients == 0 || !(batched = sub_server_list_batch_add(list, frame)))
+		{
+			sub_server_list_batch_send(list);
+		}
+		seq = list->batch_seq;
+		sub_server_list_batch_unlock(list);
+	}
+	/* no lock, joins and leaves publish a new snapshot meanwhile */
+	idx = sub_server_set_read_lock(&list->set);
+	struct sub_server_snapshot *snap = __atomic_load_n(&list->set.snapshot, __ATOMIC_SEQ_CST);
+	for (i = 0; i < snap->size; i++)
+	{
+		server = snap->servers[i];
+		/* servers of the cluster only take relays */
+		if (server->peer) continue;
+		/* gets it in the batch, counted for the message rate anyway */
+		if (batched && __atomic_load_n(&server->batch, __ATOMIC_ACQUIRE) && __atomic_load_n(&server->batch_from, __ATOMIC_RELAXED) <= seq)
+		{
+			__atomic_fetch_add(&list->delivered, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		/* never blocks, a broken or too slow client is
+		 * deleted later by the owner of its socket, the open batch
+		 * was sent before if the message is not in it */
+		sub_server_queue(server, frame);
+	}
+	metric_add(METRIC_FANOUT, snap->size);
+	sub_server_set_read_unlock(&list->set, idx);
+	return 0;
+}
+
+/* flush tick of a list, elapsed_ms after the previous one
+ * write out what was held back and pick the mode from the message rate,
+ * return ms until the next tick */
+int sub_server_list_tick(struct sub_server_list *list, int elapsed_ms)
+{
+	unsigned int i, idx;
+	/* gathered messages go out with everything else held back */
+	if (__atomic_load_n(&list->batch, __ATOMIC_RELAXED) != NULL)
+	{
+		sub_server_list_batch_lock(list);
+		sub_server_list_batch_send(list);
+		sub_server_list_batch_unlock(list);
+	}
+	/* the rate is measured over RATE_CHECK_MS whatever the tick is,
+	 * a few flush windows are too short to tell a burst from a lull */
+	list->rate_elapsed += elapsed_ms;
+	if (list->rate_elapsed >= RATE_CHECK_MS)
+	{
+		unsigned long rate = __atomic_exchange_n(&list->delivered, 0, __ATOMIC_RELAXED) * 1000 / list->rate_elapsed;
+		list->rate_elapsed = 0;
+		/* leave throughput mode at half the rate it was entered at,
+		 * so a rate around the limit does not flap */
+		if (!list->coalescing && rate >= coalesce_rate) list->coalescing = 1;
+		else if (list->coalescing && rate < coalesce_rate / 2) list->coalescing = 0;
+	}
+	idx = sub_server_set_read_lock(&list->set);
+	struct sub_server_snapshot *snap = __atomic_load_n(&list->set.snapshot, __ATOMIC_SEQ_CST);
+	for (i = 0; i < snap->size; i++)
+	{
+		struct sub_server *server = snap->servers[i];
+		if (!server->flush_pending) continue;
+		sub_server_out_lock(server);
+		server->flush_pending = 0;
+		if (sub_server_output(server) == -1) sub_server_kick(server);
+		sub_server_out_unlock(server);
+	}
+	sub_server_set_read_unlock(&list->set, idx);
+	return list->coalescing ? flush_window_ms : RATE_CHECK_MS;
+}
+
+/* queue several frames for a client and write them in one go, the
+ * oldest are skipped if they don't all fit, out lock held, return -1
+ * if the client is closing or was kicked */
+static int sub_server_queue_batch(struct sub_server *server, struct out_frame **frames, unsigned int n)
+{
+	unsigned int i, room;
+	if (server->closing) return -1;
+	room = out_queue_size - server->out_count;
+	for (i = n > room ? n - room : 0; i < n; i++)
+	{
+		out_frame_hold(frames[i]);
+		server->out_queue[(server->out_head + server->out_count) % out_queue_size] = out_frame_ref(frames[i]);
+		server->out_count++;
+	}
+	server->flush_pending = 0;
+	if (server->out_count > 0 && sub_server_output(server) == -1)
+	{
+		sub_server_kick(server);
+		return -1;
+	}
+	return 0;
+}
+
+int sub_server_enqueue_batch(struct sub_server *server, struct out_frame **frames, unsigned int n)
+{
+	int ret;
+	sub_server_batch_before(server);
+	sub_server_out_lock(server);
+	ret = sub_server_queue_batch(server, frames, n);
+	sub_server_out_unlock(server);
+	return ret;
+}
+
+/* message history
+ * the last frames sent to everybody or to a room are kept encoded, by
+ * reference, in a ring, so replaying them to a new client costs no
+ * encoding and one write
+ * the ring has no lock, a sender takes a sequence number and only
+ * latches the slot it lands on for a pointer swap, a replay latches one
+ * slot at a time for a reference */
+
+#define HISTORY_SIZE_DEFAULT 32
+#define HISTORY_SIZE_MAX 65536
+unsigned int history_size = HISTORY_SIZE_DEFAULT; /* 0: no history */
+
+struct history_slot
+{
+	int latch;
+	unsigned long seq; /* of the frame in it */
+	struct out_frame *frame;
+};
+
+struct history
+{
+	unsigned long head; /* sequence number of the next frame */
+	struct history_slot *slots;
+};
+
+int history_init(struct history *h)
+{
+	h->head = 0;
+	h->slots = NULL;
+	if (history_size == 0) return 0;
+	h->slots = (struct history_slot *)calloc(history_size, sizeof(struct history_slot));
+	return h->slots == NULL ? -1 : 0;
+}
+
+void history_free(struct history *h)
+{
+	unsigned int i;
+	if (h->slots == NULL) return;
+	for (i = 0; i < history_size; i++)
+	{
+		if (h->slots[i].frame != NULL) out_frame_unref(h->slots[i].frame);
+	}
+	free(h->slots);
+	h->slots = NULL;
+}
+
+static void history_latch(struct history_slot *slot)
+{
+	while (__sync_lock_test_and_set(&slot->latch, 1))
+	{
+		while (__atomic_load_n(&slot->latch, __ATOMIC_RELAXED));
+	}
+}
+
+static void history_unlatch(struct history_slot *slot)
+{
+	__sync_lock_release(&slot->latch);
+}
+
+/* remember a frame, the oldest one is forgotten */
+void history_push(struct history *h, struct out_frame *frame)
+{
+	unsigned long seq;
+	struct history_slot *slot;
+	struct out_frame *old;
+	if (h->slots == NULL) return;
+	seq = __sync_fetch_and_add(&h->head, 1);
+	slot = &h->slots[seq % history_size];
+	history_latch(slot);
+	/* a sender a whole lap behind must not overwrite a newer frame */
+	if (slot->frame != NULL && slot->seq > seq)
+	{
+		history_unlatch(slot);
+		return;
+	}
+	old = slot->frame;
+	slot->frame = out_frame_ref(frame);
+	slot->seq = seq;
+	history_unlatch(slot);
+	if (old != NULL) out_frame_unref(old);
+}
+
+/* queue the history for a client, oldest first, in one batch,
+ * frames whose sender has not stored them yet are left out */
+int history_replay(struct history *h, struct sub_server *server)
+{
+	unsigned long head, seq;
+	unsigned int i, n = 0;
+	struct history_slot *slot;
+	struct out_frame **frames;
+	int ret;
+	if (h->slots == NULL) return 0;
+	head = __atomic_load_n(&h->head, __ATOMIC_SEQ_CST);
+	if (head == 0) return 0;
+	frames = (struct out_frame **)malloc(history_size * sizeof(struct out_frame *));
+	if (frames == NULL) return -1;
+	for (seq = head > history_size ? head - history_size : 0; seq < head; seq++)
+	{
+		slot = &h->slots[seq % history_size];
+		history_latch(slot);
+		if (slot->frame != NULL && slot->seq == seq) frames[n++] = out_frame_ref(slot->frame);
+		history_unlatch(slot);
+	}
+	ret = n > 0 ? sub_server_enqueue_batch(server, frames, n) : 0;
+	for (i = 0; i < n; i++) out_frame_unref(frames[i]);
+	free(frames);
+	return ret;
+}
+
+/* history of the messages to everybody */
+struct history server_history;
+
+#if defined(UNIX)
+/* durable message log
+ * every frame sent to everybody or to a room is appended to segment
+ * files mapped into memory, an append is a copy under a mutex and the
+ * log thread makes a whole batch durable with one msync per sync
+ * interval (group commit), segments rotate by size or age
+ * record: u32 frame length, u32 crc32, u64 seq, u64 wall clock ms,
+ * frame, padded to 8 bytes, all in network byte order, a zero length
+ * ends a segment
+ * next to every segment a sparse index maps seq and time to offsets,
+ * entry: u64 seq, u64 wall clock ms, u64 offset of the first record
+ * starting at least LOG_INDEX_INTERVAL bytes after the previous one */
+
+#define LOG_SEGMENT_SIZE_DEFAULT (64 << 20)
+#define LOG_SEGMENT_AGE_DEFAULT 3600 /* seconds */
+#define LOG_SYNC_MS_DEFAULT 10
+#define LOG_RECORD_HEADER_SIZE 24
+#define LOG_RECORD_SIZE(len) ((LOG_RECORD_HEADER_SIZE + (len) + 7) & ~(size_t)7)
+#define LOG_INDEX_INTERVAL 4096
+#define LOG_INDEX_ENTRY_SIZE 24
+
+const char *log_dir; /* NULL: no log */
+size_t log_segment_size = LOG_SEGMENT_SIZE_DEFAULT;
+int log_segment_age = LOG_SEGMENT_AGE_DEFAULT;
+int log_sync_ms = LOG_SYNC_MS_DEFAULT; /* 0: left to the kernel */
+
+struct log_segment
+{
+	struct log_segment *next; /* retired chain */
+	int fd;
+	char *base;
+	size_t size; /* mapped */
+	size_t end; /* bytes appended */
+	size_t synced; /* bytes made durable, log thread only */
+	unsigned long long first_seq;
+	unsigned long long created_ms; /* wall clock of the first record */
+	int idx_fd;
+	char *idx_base;
+	size_t idx_size; /* mapped */
+	unsigned int idx_count; /* entries written */
+	unsigned int idx_synced; /* entries made durable, log thread only */
+	size_t idx_next; /* offset due for the next entry */
+};
+
+struct message_log
+{
+	struct log_segment *segment; /* appended to */
+	struct log_segment *retired; /* full, to be synced and closed */
+	unsigned long long next_seq;
+	int closed;
+	unsigned long appended;
+	unsigned long failed;
+	/* first seq of every segment, oldest first, readers find segments
+	 * here and not in the directory */
+	unsigned long long *segment_seqs;
+	unsigned int segment_count;
+	unsigned int segment_capacity;
+	pthread_mutex_t mutex;
+	pthread_t thd;
+};
+
+struct message_log *message_log;
+
+/* called for every record appended, in seq order, under the log mutex */
+void (*log_listener)(unsigned long long seq, struct out_frame *frame);
+
+static unsigned int crc32_table[256];
+
+static void crc32_init(void)
+{
+	unsigned int i, j, c;
+	for (i = 0; i < 256; i++)
+	{
+		for (c = i, j = 0; j < 8; j++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		crc32_table[i] = c;
+	}
+}
+
+static unsigned int crc32_update(unsigned int crc, const char *p, size_t len)
+{
+	crc = ~crc;
+	while (len-- > 0) crc = crc32_table[(crc ^ (unsigned char)*p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static unsigned long long wall_clock_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* file of a segment, suffix is .log or .idx */
+static void log_segment_path(char *path, size_t size, unsigned long long first_seq, const char *suffix)
+{
+	snprintf(path, size, "%s/%020llu%s", log_dir, first_seq, suffix);
+}
+
+/* map size bytes of a file opened read and write, space is allocated up
+ * front so a full disk fails here and not as a fault on append, a file
+ * bigger than size is mapped whole, return NULL on error */
+static char *log_file_map(int fd, size_t *size, int *created)
+{
+	struct stat st;
+	char *base;
+	if (fstat(fd, &st) == -1) return NULL;
+	if ((size_t)st.st_size < *size && posix_fallocate(fd, 0, *size) != 0) return NULL;
+	if ((size_t)st.st_size > *size) *size = st.st_size;
+	base = (char *)mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) return NULL;
+	*created = st.st_size == 0;
+	return base;
+}
+
+/* open a segment and its index, return NULL on error */
+static struct log_segment *log_segment_open(unsigned long long first_seq, size_t size)
+{
+	char path[PATH_MAX];
+	struct log_segment *seg;
+	int dir_fd, created, idx_created;
+	seg = (struct log_segment *)calloc(1, sizeof(struct log_segment));
+	if (seg == NULL) return NULL;
+	seg->fd = seg->idx_fd = -1;
+	log_segment_path(path, sizeof(path), first_seq, ".log");
+	if ((seg->fd = open(path, O_RDWR | O_CREAT, 0644)) == -1) goto fail;
+	if ((seg->base = log_file_map(seg->fd, &size, &created)) == NULL) goto fail;
+	seg->size = size;
+	/* every entry is at least an interval past the previous one */
+	seg->idx_size = (size / LOG_INDEX_INTERVAL + 1) * LOG_INDEX_ENTRY_SIZE;
+	log_segment_path(path, sizeof(path), first_seq, ".idx");
+	if ((seg->idx_fd = open(path, O_RDWR | O_CREAT, 0644)) == -1) goto fail;
+	if ((seg->idx_base = log_file_map(seg->idx_fd, &seg->idx_size, &idx_created)) == NULL) goto fail;
+	seg->first_seq = first_seq;
+	seg->created_ms = wall_clock_ms();
+	/* the new names themselves must be durable */
+	if ((created || idx_created) && (dir_fd = open(log_dir, O_RDONLY)) != -1)
+	{
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+	return seg;
+fail:
+	if (seg->base != NULL) munmap(seg->base, seg->size);
+	if (seg->fd != -1) close(seg->fd);
+	if (seg->idx_fd != -1) close(seg->idx_fd);
+	free(seg);
+	return NULL;
+}
+
+/* index the record at offset if it is far enough from the last entry */
+static void log_index_add(struct log_segment *seg, const char *record, size_t offset)
+{
+	char *p;
+	if (offset < seg->idx_next) return;
+	p = seg->idx_base + (size_t)seg->idx_count * LOG_INDEX_ENTRY_SIZE;
+	memcpy(p, record + 8, 16);
+	frame_put_u64(p + 16, offset);
+	__atomic_store_n(&seg->idx_count, seg->idx_count + 1, __ATOMIC_RELEASE);
+	seg->idx_next = offset + LOG_INDEX_INTERVAL;
+}
+
+/* make what was appended to a segment durable */
+static void log_segment_sync(struct log_segment *seg)
+{
+	size_t end = __atomic_load_n(&seg->end, __ATOMIC_ACQUIRE);
+	unsigned int count = __atomic_load_n(&seg->idx_count, __ATOMIC_ACQUIRE);
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start = seg->synced & ~(page - 1);
+	if (end > seg->synced)
+	{
+		msync(seg->base + start, end - start, MS_SYNC);
+		seg->synced = end;
+	}
+	/* the index may lag behind, a lost entry only costs a longer scan */
+	if (count > seg->idx_synced)
+	{
+		start = ((size_t)seg->idx_synced * LOG_INDEX_ENTRY_SIZE) & ~(page - 1);
+		msync(seg->idx_base + start, (size_t)count * LOG_INDEX_ENTRY_SIZE - start, MS_ASYNC);
+		seg->idx_synced = count;
+	}
+}
+
+/* sync a segment for the last time and cut its file to what it holds,
+ * the caller frees it */
+static void log_segment_close(struct log_segment *seg)
+{
+	log_segment_sync(seg);
+	munmap(seg->base, seg->size);
+	munmap(seg->idx_base, seg->idx_size);
+	if (ftruncate(seg->fd, seg->end) == 0) fsync(seg->fd);
+	if (ftruncate(seg->idx_fd, (size_t)seg->idx_count * LOG_INDEX_ENTRY_SIZE) == 0) fsync(seg->idx_fd);
+	close(seg->fd);
+	close(seg->idx_fd);
+}
+
+/* walk the valid records of a segment from its start, the first record
+ * with a bad length, checksum or seq is the tail a crash left behind,
+ * the newest messages to everybody are kept in the ring frames,
+ * return the number of records, their end is stored in seg->end */
+static unsigned long log_segment_recover(struct log_segment *seg, struct out_frame **frames, unsigned int frame_max, unsigned long *kept)
+{
+	unsigned long count = 0;
+	unsigned int len;
+	size_t pos = 0;
+	char *p;
+	*kept = 0;
+	while (pos + LOG_RECORD_HEADER_SIZE <= seg->size)
+	{
+		p = seg->base + pos;
+		len = frame_get_u32(p);
+		if (len < FRAME_HEADER_SIZE || len > FRAME_SIZE_MAX || pos + LOG_RECORD_SIZE(len) > seg->size) break;
+		if (crc32_update(crc32_update(0, p + LOG_RECORD_HEADER_SIZE, len), p + 8, 16) != frame_get_u32(p + 4)) break;
+		if (frame_get_u64(p + 8) != seg->first_seq + count) break;
+		if (count == 0) seg->created_ms = frame_get_u64(p + 16);
+		log_index_add(seg, p, pos);
+		if (frame_max > 0 && p[LOG_RECORD_HEADER_SIZE] == CMD_RECV_MSG)
+		{
+			struct out_frame *frame = out_frame_new(len);
+			if (frame != NULL)
+			{
+				memcpy(frame->data, p + LOG_RECORD_HEADER_SIZE, len);
+				if (frames[*kept % frame_max] != NULL) out_frame_unref(frames[*kept % frame_max]);
+				frames[(*kept)++ % frame_max] = frame;
+			}
+		}
+		pos += LOG_RECORD_SIZE(len);
+		count++;
+	}
+	seg->end = seg->synced = pos;
+	/* drop whatever lies past the tail so it cannot pass for records
+	 * once new ones are appended over it */
+	if (pos < seg->size && ftruncate(seg->fd, pos) == 0) posix_fallocate(seg->fd, 0, seg->size);
+	if (ftruncate(seg->idx_fd, (size_t)seg->idx_count * LOG_INDEX_ENTRY_SIZE) == 0) posix_fallocate(seg->idx_fd, 0, seg->idx_size);
+	seg->idx_synced = seg->idx_count;
+	return count;
+}
+
+/* start a new segment at the next seq, the full one is left to the log
+ * thread, called with the log mutex held, return -1 on error */
+static int log_rotate(struct message_log *log)
+{
+	struct log_segment *seg;
+	unsigned long long *seqs;
+	if (log->segment_count == log->segment_capacity)
+	{
+		seqs = (unsigned long long *)realloc(log->segment_seqs, log->segment_capacity * 2 * sizeof(unsigned long long));
+		if (seqs == NULL) return -1;
+		log->segment_seqs = seqs;
+		log->segment_capacity *= 2;
+	}
+	if ((seg = log_segment_open(log->next_seq, log_segment_size)) == NULL) return -1;
+	log->segment_seqs[log->segment_count++] = log->next_seq;
+	log->segment->next = log->retired;
+	log->retired = log->segment;
+	log->segment = seg;
+	return 0;
+}
+
+/* append a frame to the log, it is durable after the next sync */
+void log_append(struct out_frame *frame)
+{
+	struct message_log *log = message_log;
+	struct log_segment *seg;
+	size_t size = LOG_RECORD_SIZE(frame->len);
+	unsigned int crc;
+	char *p;
+	if (log == NULL) return;
+	crc = crc32_update(0, frame->data, frame->len);
+	pthread_mutex_lock(&log->mutex);
+	if (log->closed) goto out;
+	seg = log->segment;
+	if (seg->end + size > seg->size)
+	{
+		if (log_rotate(log) == -1)
+		{
+			log->failed++;
+			goto out;
+		}
+		seg = log->segment;
+	}
+	p = seg->base + seg->end;
+	frame_put_u32(p, (unsigned int)frame->len);
+	frame_put_u64(p + 8, log->next_seq++);
+	frame_put_u64(p + 16, wall_clock_ms());
+	memcpy(p + LOG_RECORD_HEADER_SIZE, frame->data, frame->len);
+	frame_put_u32(p + 4, crc32_update(crc, p + 8, 16));
+	if (seg->end == 0) seg->created_ms = frame_get_u64(p + 16);
+	log_index_add(seg, p, seg->end);
+	__atomic_store_n(&seg->end, seg->end + size, __ATOMIC_RELEASE);
+	log->appended++;
+	if (log_listener != NULL) log_listener(log->next_seq - 1, frame);
+out:
+	pthread_mutex_unlock(&log->mutex);
+}
+
+/* log thread, one msync per interval covers every append since the
+ * last one, segments old enough are rotated here too */
+void *log_start(void *data)
+{
+	struct message_log *log = (struct message_log *)data;
+	struct log_segment *seg, *retired, *next, **p;
+	int interval = log_sync_ms > 0 ? log_sync_ms : 1000;
+	while (1)
+	{
+		usleep(interval * 1000);
+		pthread_mutex_lock(&log->mutex);
+		if (log->closed)
+		{
+			pthread_mutex_unlock(&log->mutex);
+			break;
+		}
+		seg = log->segment;
+		if (seg->end > 0 && wall_clock_ms() - seg->created_ms >= (unsigned long long)log_segment_age * 1000)
+		{
+			if (log_rotate(log) == -1) log->failed++;
+		}
+		/* readers take a retired segment for one still written to until
+		 * its file is cut, so they never map past its end */
+		retired = log->retired;
+		seg = log->segment;
+		pthread_mutex_unlock(&log->mutex);
+		/* only this thread frees segments, seg stays mapped */
+		if (retired != NULL)
+		{
+			for (next = retired; next != NULL; next = next->next) log_segment_close(next);
+			/* newer ones may have been retired meanwhile */
+			pthread_mutex_lock(&log->mutex);
+			for (p = &log->retired; *p != retired; p = &(*p)->next);
+			*p = NULL;
+			pthread_mutex_unlock(&log->mutex);
+			while (retired != NULL)
+			{
+				next = retired->next;
+				free(retired);
+				retired = next;
+			}
+		}
+		if (log_sync_ms > 0) log_segment_sync(seg);
+	}
+	return NULL;
+}
+
+/* sync and close every segment, no append gets in after this */
+void log_close(void)
+{
+	struct message_log *log = message_log;
+	struct log_segment *seg;
+	if (log == NULL) return;
+	pthread_mutex_lock(&log->mutex);
+	log->closed = 1;
+	pthread_mutex_unlock(&log->mutex);
+	pthread_join(log->thd, NULL);
+	while ((seg = log->retired) != NULL)
+	{
+		log->retired = seg->next;
+		log_segment_close(seg);
+		free(seg);
+	}
+	log_segment_close(log->segment);
+	free(log->segment);
+	log->segment = NULL;
+	printf("log closed, %lu record(s) appended, next seq %llu\n", log->appended, log->next_seq);
+}
+
+/* range reads
+ * a range of seq or time is streamed out of read only mappings of the
+ * segments, the index of a segment narrows the search for both ends to
+ * one interval, the records go out as they are on disk, in chunks of
+ * CMD_LOG_RECORDS frames whose payload is never copied */
+
+/* where a key is in a record, 8 bytes further than in an index entry */
+#define LOG_KEY_SEQ 8
+#define LOG_KEY_TIME 16
+
+/* offset of the first record whose key is at least key, or the end of
+ * the records */
+static size_t log_view_seek(struct log_view *view, int key_at, unsigned long long key)
+{
+	unsigned int lo = 0, hi = view->idx_count, mid, len;
+	size_t pos = 0;
+	const char *p;
+	/* last index entry below key */
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (frame_get_u64(view->idx + (size_t)mid * LOG_INDEX_ENTRY_SIZE + key_at - 8) < key) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo > 0) pos = frame_get_u64(view->idx + (size_t)(lo - 1) * LOG_INDEX_ENTRY_SIZE + 16);
+	if (pos > view->size) pos = 0;
+	while (pos + LOG_RECORD_HEADER_SIZE <= view->size)
+	{
+		p = view->base + pos;
+		len = frame_get_u32(p);
+		if (len < FRAME_HEADER_SIZE || len > FRAME_SIZE_MAX || pos + LOG_RECORD_SIZE(len) > view->size) break;
+		if (frame_get_u64(p + key_at) >= key) break;
+		pos += LOG_RECORD_SIZE(len);
+	}
+	return pos;
+}
+
+/* map a segment and its index for reading, a segment still written to
+ * is cut at what was appended so far, return NULL on error */
+struct log_view *log_view_open(unsigned long long first_seq)
+{
+	struct message_log *log = message_log;
+	struct log_segment *seg;
+	struct log_view *view;
+	char path[PATH_MAX];
+	struct stat st;
+	size_t end = 0;
+	unsigned int count = 0, lo, hi, mid;
+	int fd, idx_fd, live = 0;
+	view = (struct log_view *)calloc(1, sizeof(struct log_view));
+	if (view == NULL) return NULL;
+	view->refs = 1;
+	view->first_seq = first_seq;
+	/* the file of a segment no longer listed is cut already */
+	pthread_mutex_lock(&log->mutex);
+	for (seg = log->retired; seg != NULL && seg->first_seq != first_seq; seg = seg->next);
+	if (seg == NULL && log->segment != NULL && log->segment->first_seq == first_seq) seg = log->segment;
+	if (seg != NULL)
+	{
+		end = seg->end;
+		count = seg->idx_count;
+		live = 1;
+	}
+	pthread_mutex_unlock(&log->mutex);
+	log_segment_path(path, sizeof(path), first_seq, ".log");
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) goto fail;
+	if (!live) end = st.st_size;
+	if (end > 0)
+	{
+		view->base = (char *)mmap(NULL, end, PROT_READ, MAP_SHARED, fd, 0);
+		if (view->base == MAP_FAILED) goto fail;
+		view->map_size = view->size = end;
+	}
+	close(fd);
+	/* without its index a segment is scanned from the start */
+	log_segment_path(path, sizeof(path), first_seq, ".idx");
+	if ((idx_fd = open(path, O_RDONLY)) != -1 && fstat(idx_fd, &st) == 0)
+	{
+		if (!live) count = st.st_size / LOG_INDEX_ENTRY_SIZE;
+		view->idx_map_size = (size_t)count * LOG_INDEX_ENTRY_SIZE;
+		if (count > 0)
+		{
+			view->idx = (char *)mmap(NULL, view->idx_map_size, PROT_READ, MAP_SHARED, idx_fd, 0);
+			if (view->idx == MAP_FAILED) view->idx = NULL;
+			else view->idx_count = count;
+		}
+	}
+	if (idx_fd != -1) close(idx_fd);
+	if (!live && view->idx != NULL)
+	{
+		/* a crash leaves zeroed entries after the last one written */
+		lo = 1;
+		hi = view->idx_count;
+		while (lo < hi)
+		{
+			mid = (lo + hi) / 2;
+			if (frame_get_u64(view->idx + (size_t)mid * LOG_INDEX_ENTRY_SIZE + 16) > 0) lo = mid + 1;
+			else hi = mid;
+		}
+		view->idx_count = lo;
+	}
+	/* and zeros after the last record */
+	if (!live) view->size = log_view_seek(view, LOG_KEY_SEQ, ~0ULL);
+	return view;
+fail:
+	if (fd != -1) close(fd);
+	view->base = NULL;
+	log_view_unref(view);
+	return NULL;
+}
+
+static int log_seq_compare(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* first seqs of the segments in the log directory, sorted, return how
+ * many, -1 on error, only read on start */
+static int log_segment_scan(unsigned long long **seqs)
+{
+	DIR *dir;
+	struct dirent *entry;
+	unsigned long long seq, *p;
+	int n = 0, size = 0;
+	char tail[8];
+	*seqs = NULL;
+	if ((dir = opendir(log_dir)) == NULL) return -1;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (sscanf(entry->d_name, "%20llu%7s", &seq, tail) != 2 || strcmp(tail, ".log")) continue;
+		if (n == size)
+		{
+			size = size > 0 ? size * 2 : 16;
+			if ((p = (unsigned long long *)realloc(*seqs, size * sizeof(unsigned long long))) == NULL)
+			{
+				closedir(dir);
+				free(*seqs);
+				*seqs = NULL;
+				return -1;
+			}
+			*seqs = p;
+		}
+		(*seqs)[n++] = seq;
+	}
+	closedir(dir);
+	qsort(*seqs, n, sizeof(unsigned long long), log_seq_compare);
+	return n;
+}
+
+/* copy of the first seqs of every segment, return how many, -1 if out
+ * of memory */
+static int log_segment_list(unsigned long long **seqs)
+{
+	struct message_log *log = message_log;
+	int n;
+	pthread_mutex_lock(&log->mutex);
+	n = log->segment_count;
+	if ((*seqs = (unsigned long long *)malloc(n * sizeof(unsigned long long))) == NULL) n = -1;
+	else memcpy(*seqs, log->segment_seqs, n * sizeof(unsigned long long));
+	pthread_mutex_unlock(&log->mutex);
+	return n;
+}
+
+/* first seq of segment i, return -1 past the newest */
+static int log_segment_at(unsigned int i, unsigned long long *seq)
+{
+	struct message_log *log = message_log;
+	int ret = -1;
+	pthread_mutex_lock(&log->mutex);
+	if (i < log->segment_count)
+	{
+		*seq = log->segment_seqs[i];
+		ret = 0;
+	}
+	pthread_mutex_unlock(&log->mutex);
+	return ret;
+}
+
+/* the last segment starting at or before seq, the first if none */
+static unsigned int log_segment_find(unsigned long long seq)
+{
+	struct message_log *log = message_log;
+	unsigned int lo = 1, hi, mid;
+	pthread_mutex_lock(&log->mutex);
+	hi = log->segment_count;
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (log->segment_seqs[mid] <= seq) lo = mid + 1;
+		else hi = mid;
+	}
+	pthread_mutex_unlock(&log->mutex);
+	return lo - 1;
+}
+
+/* range of the log being streamed to a client */
+struct log_cursor
+{
+	int key_at; /* LOG_KEY_SEQ or LOG_KEY_TIME */
+	unsigned long long from;
+	unsigned long long to; /* not included, 0: no bound */
+	int started;
+	unsigned int segment; /* last segment opened */
+	struct log_view *view; /* NULL: between segments */
+	size_t pos;
+	size_t end;
+};
+
+struct log_cursor *log_cursor_new(int key_at, unsigned long long from, unsigned long long to)
+{
+	struct log_cursor *c = (struct log_cursor *)calloc(1, sizeof(struct log_cursor));
+	if (c == NULL) return NULL;
+	c->key_at = key_at;
+	c->from = from;
+	c->to = to;
+	return c;
+}
+
+void log_cursor_free(struct log_cursor *c)
+{
+	if (c->view != NULL) log_view_unref(c->view);
+	free(c);
+}
+
+/* move to the next segment holding records of the range,
+ * return -1 once there is none */
+static int log_cursor_next(struct log_cursor *c)
+{
+	struct log_view *view;
+	unsigned long long seq;
+	unsigned int i;
+	int past;
+	/* a seq range starts in the last segment not after it */
+	if (!c->started) i = c->key_at == LOG_KEY_SEQ ? log_segment_find(c->from) : 0;
+	else i = c->segment + 1;
+	for (; log_segment_at(i, &seq) == 0; i++)
+	{
+		if (c->key_at == LOG_KEY_SEQ && c->to > 0 && seq >= c->to) break;
+		c->started = 1;
+		c->segment = i;
+		if ((view = log_view_open(seq)) == NULL) continue;
+		c->pos = log_view_seek(view, c->key_at, c->from);
+		c->end = c->to > 0 ? log_view_seek(view, c->key_at, c->to) : view->size;
+		if (c->pos < c->end)
+		{
+			c->view = view;
+			return 0;
+		}
+		/* the range ends in this segment */
+		past = c->end < view->size;
+		log_view_unref(view);
+		if (past) break;
+	}
+	return -1;
+}
+
+/* queue the next chunks of the log range of a client, out lock held,
+ * the range never takes more than half of the queue so broadcasts
+ * still fit */
+static void log_cursor_fill(struct sub_server *server)
+{
+	struct log_cursor *c = server->range;
+	struct out_frame *frame;
+	size_t len;
+	while (server->out_count < (out_queue_size + 1) / 2)
+	{
+		if (c->view == NULL && log_cursor_next(c) == -1)
+		{
+			if ((frame = out_frame_new(FRAME_HEADER_SIZE)) == NULL) return;
+			frame_encode_header(frame->data, CMD_LOG_RECORDS, 0, 0);
+			server->out_queue[(server->out_head + server->out_count++) % out_queue_size] = frame;
+			log_cursor_free(c);
+			server->range = NULL;
+			return;
+		}
+		len = c->end - c->pos < FRAME_PAYLOAD_MAX ? c->end - c->pos : FRAME_PAYLOAD_MAX;
+		if ((frame = out_frame_new(FRAME_HEADER_SIZE)) == NULL) return;
+		frame_encode_header(frame->data, CMD_LOG_RECORDS, 0, len);
+		frame->len = FRAME_HEADER_SIZE + len;
+		frame->ext = c->view->base + c->pos;
+		frame->view = log_view_ref(c->view);
+		server->out_queue[(server->out_head + server->out_count++) % out_queue_size] = frame;
+		c->pos += len;
+		if (c->pos == c->end)
+		{
+			log_view_unref(c->view);
+			c->view = NULL;
+		}
+	}
+}
+
+/* open the log and start its thread, appends go on after the last
+ * valid record of the newest segment, only that one is read,
+ * return -1 on error */
+int log_open(void)
+{
+	unsigned long long *seqs, newest = 0;
+	unsigned long count = 0, kept, i;
+	int found;
+	struct out_frame **frames;
+	struct message_log *log;
+	crc32_init();
+	if (mkdir(log_dir, 0755) == -1 && errno != EEXIST) return -1;
+	if ((found = log_segment_scan(&seqs)) == -1) return -1;
+	log = (struct message_log *)calloc(1, sizeof(struct message_log));
+	if (log == NULL) return -1;
+	pthread_mutex_init(&log->mutex, NULL);
+	log->segment_capacity = found + 16;
+	if ((log->segment_seqs = (unsigned long long *)realloc(seqs, log->segment_capacity * sizeof(unsigned long long))) == NULL) return -1;
+	/* the newest segment is appended to, an empty log starts at 0 */
+	if (found > 0) newest = log->segment_seqs[found - 1];
+	else log->segment_seqs[0] = 0;
+	log->segment_count = found > 0 ? found : 1;
+	if ((log->segment = log_segment_open(newest, log_segment_size)) == NULL) return -1;
+	log->next_seq = newest;
+	if (found)
+	{
+		frames = (struct out_frame **)calloc(history_size + 1, sizeof(struct out_frame *));
+		if (frames == NULL) return -1;
+		count = log_segment_recover(log->segment, frames, history_size, &kept);
+		log->next_seq = newest + count;
+		/* the history picks up where the last run stopped, oldest first */
+		for (i = kept > history_size ? kept - history_size : 0; i < kept; i++)
+		{
+			history_push(&server_history, frames[i % history_size]);
+		}
+		for (i = 0; i < history_size; i++) if (frames[i] != NULL) out_frame_unref(frames[i]);
+		free(frames);
+	}
+	if (pthread_create(&log->thd, NULL, log_start, log) != 0) return -1;
+	printf("log segment %llu, %lu record(s) recovered, next seq %llu\n", newest, count, log->next_seq);
+	message_log = log;
+	atexit(log_close);
+	return 0;
+}
+#endif
+
+#if defined(UNIX)
+/* full-text search
+ * the words of every message to everybody are indexed by the log seq
+ * of the message, senders only queue a reference to the frame and a
+ * background thread updates the index, what doesn't fit the queue is
+ * read back from the log
+ * searches of clients are served by a thread of their own too
+ * a posting list keeps the seqs of a word in blocks, the first seq of
+ * a block as it is and the others as varint deltas, about a byte per
+ * message, a search decodes only the blocks it needs, newest first */
+
+#define SEARCH_TERMS_MAX 8 /* words of a query */
+#define SEARCH_TOKEN_LEN_MAX 32 /* longer words are cut */
+#define SEARCH_RESULTS_MAX 50
+#define POSTING_BLOCK_SIZE 128 /* seqs per block */
+#define SEARCH_QUEUE_MAX 4096 /* messages waiting to be indexed */
+#define SEARCH_REQUESTS_MAX 64 /* searches waiting to be served */
+
+int search_enabled;
+
+struct posting_block
+{
+	unsigned long long first; /* seq */
+	size_t offset; /* deltas of the other seqs */
+};
+
+struct posting_list
+{
+	unsigned long long last; /* seq */
+	unsigned int count;
+	unsigned char *bytes;
+	size_t len;
+	size_t size;
+	struct posting_block *blocks;
+	unsigned int block_count;
+	unsigned int block_size;
+};
+
+struct search_term
+{
+	struct search_term *next; /* hash chain */
+	struct posting_list list;
+	unsigned char len;
+	char token[];
+};
+
+/* message waiting for the index thread */
+struct search_job
+{
+	unsigned long long seq;
+	struct out_frame *frame;
+};
+
+/* search of a client waiting for the search thread, the client is found
+ * again by handle as it may be gone by then */
+struct search_request
+{
+	struct search_request *next;
+	struct sub_server_list *list;
+	unsigned long long handle;
+	size_t len;
+	char query[];
+};
+
+struct search_index
+{
+	struct search_term **buckets;
+	unsigned int bucket_count; /* power of 2 */
+	unsigned long term_count;
+	unsigned long posting_count;
+	size_t posting_bytes;
+	unsigned long long indexed; /* messages */
+	unsigned long long backfill_end; /* seqs logged before the start */
+	pthread_rwlock_t lock;
+	struct search_job *jobs; /* ring */
+	struct search_job *taken; /* by the index thread */
+	unsigned int job_head;
+	unsigned int job_count;
+	/* seqs logged while the ring was full, read back from the log */
+	unsigned long long gap_from;
+	unsigned long long gap_to;
+	struct search_request *requests;
+	struct search_request **requests_tail;
+	unsigned int request_count;
+	pthread_mutex_t mutex; /* both queues */
+	pthread_cond_t cond;
+	pthread_cond_t request_cond;
+	pthread_t thd;
+	pthread_t request_thd;
+};
+
+struct search_index search_index;
+
+static unsigned int search_hash(const char *token, size_t len)
+{
+	unsigned int h = 2166136261u; /* FNV-1a */
+	while (len-- > 0) h = (h ^ (unsigned char)*token++) * 16777619u;
+	return h;
+}
+
+static int search_word_char(unsigned char c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+/* next word of text from *pos on, lowercase, return its length,
+ * 0 at the end of text */
+static size_t search_token(const char *text, size_t len, size_t *pos, char *token)
+{
+	size_t n = 0;
+	unsigned char c;
+	while (*pos < len && !search_word_char(text[*pos])) (*pos)++;
+	while (*pos < len && search_word_char(c = text[*pos]))
+	{
+		if (n < SEARCH_TOKEN_LEN_MAX) token[n++] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+		(*pos)++;
+	}
+	return n;
+}
+
+static struct search_term *search_lookup(const char *token, size_t len)
+{
+	struct search_term *term = search_index.buckets[search_hash(token, len) & (search_index.bucket_count - 1)];
+	while (term != NULL && (term->len != len || memcmp(term->token, token, len))) term = term->next;
+	return term;
+}
+
+/* find or add the term of a word, write lock held,
+ * return NULL if out of memory */
+static struct search_term *search_term_get(const char *token, size_t len)
+{
+	struct search_index *idx = &search_index;
+	struct search_term *term, **buckets;
+	unsigned int i, h;
+	if ((term = search_lookup(token, len)) != NULL) return term;
+	/* one term per bucket on average */
+	if (idx->term_count >= idx->bucket_count)
+	{
+		buckets = (struct search_term **)calloc(idx->bucket_count * 2, sizeof(struct search_term *));
+		if (buckets == NULL) return NULL;
+		for (i = 0; i < idx->bucket_count; i++)
+		{
+			while ((term = idx->buckets[i]) != NULL)
+			{
+				idx->buckets[i] = term->next;
+				h = search_hash(term->token, term->len) & (idx->bucket_count * 2 - 1);
+				term->next = buckets[h];
+				buckets[h] = term;
+			}
+		}
+		free(idx->buckets);
+		idx->buckets = buckets;
+		idx->bucket_count *= 2;
+	}
+	term = (struct search_term *)calloc(1, sizeof(struct search_term) + len);
+	if (term == NULL) return NULL;
+	term->len = (unsigned char)len;
+	memcpy(term->token, token, len);
+	h = search_hash(token, len) & (idx->bucket_count - 1);
+	term->next = idx->buckets[h];
+	idx->buckets[h] = term;
+	idx->term_count++;
+	return term;
+}
+
+/* append a seq bigger than every one in the list, a word repeated in a
+ * message is only kept once, return -1 if out of memory */
+static int posting_list_add(struct posting_list *list, unsigned long long seq)
+{
+	unsigned long long delta;
+	void *p;
+	if (list->count > 0 && seq <= list->last) return 0;
+	if (list->count % POSTING_BLOCK_SIZE == 0)
+	{
+		if (list->block_count == list->block_size)
+		{
+			unsigned int size = list->block_size > 0 ? list->block_size * 2 : 1;
+			if ((p = realloc(list->blocks, size * sizeof(struct posting_block))) == NULL) return -1;
+			list->blocks = (struct posting_block *)p;
+			list->block_size = size;
+		}
+		list->blocks[list->block_count].first = seq;
+		list->blocks[list->block_count++].offset = list->len;
+	}
+	else
+	{
+		/* room for the longest varint */
+		if (list->len + 10 > list->size)
+		{
+			size_t size = list->size > 0 ? list->size * 2 : 16;
+			if ((p = realloc(list->bytes, size)) == NULL) return -1;
+			list->bytes = (unsigned char *)p;
+			list->size = size;
+		}
+		/* 7 bits a byte, low bits first */
+		for (delta = seq - list->last; delta >= 0x80; delta >>= 7) list->bytes[list->len++] = (unsigned char)(delta | 0x80);
+		list->bytes[list->len++] = (unsigned char)delta;
+	}
+	list->last = seq;
+	list->count++;
+	return 0;
+}
+
+/* seqs of block i of a list, return how many */
+static unsigned int posting_block_decode(const struct posting_list *list, unsigned int i, unsigned long long *seqs)
+{
+	size_t pos = list->blocks[i].offset;
+	size_t end = i + 1 < list->block_count ? list->blocks[i + 1].offset : list->len;
+	unsigned long long seq = list->blocks[i].first, delta;
+	unsigned int n = 0, shift;
+	seqs[n++] = seq;
+	while (pos < end)
+	{
+		for (delta = 0, shift = 0; ; shift += 7)
+		{
+			delta |= (unsigned long long)(list->bytes[pos] & 0x7f) << shift;
+			if (!(list->bytes[pos++] & 0x80)) break;
+		}
+		seq += delta;
+		seqs[n++] = seq;
+	}
+	return n;
+}
+
+/* last decoded block of a list, membership tests go down the seqs so
+ * most of them hit the same block */
+struct posting_cursor
+{
+	const struct posting_list *list;
+	int block; /* -1: none */
+	unsigned int count;
+	unsigned long long seqs[POSTING_BLOCK_SIZE];
+};
+
+static int posting_contains(struct posting_cursor *c, unsigned long long seq)
+{
+	unsigned int lo = 0, hi = c->list->block_count, mid;
+	/* last block starting at or before seq */
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (c->list->blocks[mid].first <= seq) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == 0) return 0;
+	if ((int)lo - 1 != c->block)
+	{
+		c->block = lo - 1;
+		c->count = posting_block_decode(c->list, c->block, c->seqs);
+	}
+	lo = 0;
+	hi = c->count;
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (c->seqs[mid] < seq) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo < c->count && c->seqs[lo] == seq;
+}
+
+/* index the words of a message to everybody, write lock held */
+static void search_index_frame(unsigned long long seq, const char *data, size_t len)
+{
+	struct search_index *idx = &search_index;
+	struct search_term *term;
+	struct frame f;
+	char *nickname, *msg;
+	size_t nickname_len, msg_len, pos = 0, n, bytes;
+	unsigned int count, blocks;
+	char token[SEARCH_TOKEN_LEN_MAX];
+	if (len < FRAME_HEADER_SIZE || (unsigned char)data[0] != CMD_RECV_MSG) return;
+	f.cmd = CMD_RECV_MSG;
+	f.len = len - FRAME_HEADER_SIZE;
+	f.payload = (char *)data + FRAME_HEADER_SIZE;
+	if (frame_decode_recv_msg(&f, &nickname, &nickname_len, &msg, &msg_len) == -1) return;
+	while ((n = search_token(msg, msg_len, &pos, token)) > 0)
+	{
+		if ((term = search_term_get(token, n)) == NULL) continue;
+		count = term->list.count;
+		bytes = term->list.len;
+		blocks = term->list.block_count;
+		if (posting_list_add(&term->list, seq) == -1) continue;
+		idx->posting_count += term->list.count - count;
+		idx->posting_bytes += term->list.len - bytes + (term->list.block_count - blocks) * sizeof(struct posting_block);
+	}
+	idx->indexed++;
+}
+
+/* log listener, queues messages to everybody in seq order, once the
+ * queue is full the seqs only widen a gap so the index stays in order */
+static void search_queue(unsigned long long seq, struct out_frame *frame)
+{
+	struct search_index *idx = &search_index;
+	struct search_job *job;
+	if ((unsigned char)frame->data[0] != CMD_RECV_MSG) return;
+	pthread_mutex_lock(&idx->mutex);
+	if (idx->job_count == 0 && idx->gap_to == 0) pthread_cond_signal(&idx->cond);
+	if (idx->gap_to != 0 || idx->job_count == SEARCH_QUEUE_MAX)
+	{
+		if (idx->gap_to == 0) idx->gap_from = seq;
+		idx->gap_to = seq + 1;
+	}
+	else
+	{
+		job = &idx->jobs[(idx->job_head + idx->job_count++) % SEARCH_QUEUE_MAX];
+		job->seq = seq;
+		job->frame = out_frame_ref(frame);
+	}
+	pthread_mutex_unlock(&idx->mutex);
+}
+
+/* index what the log holds from seq from up to to */
+static void search_backfill(unsigned long long from, unsigned long long to)
+{
+	struct search_index *idx = &search_index;
+	struct log_view *view;
+	unsigned long long *seqs, seq;
+	unsigned long done = 0;
+	size_t pos;
+	unsigned int len;
+	int i, n;
+	const char *p;
+	n = log_segment_list(&seqs);
+	for (i = 0; i < n && seqs[i] < to; i++)
+	{
+		if (i + 1 < n && seqs[i + 1] <= from) continue;
+		if ((view = log_view_open(seqs[i])) == NULL) continue;
+		pthread_rwlock_wrlock(&idx->lock);
+		for (pos = log_view_seek(view, LOG_KEY_SEQ, from); pos + LOG_RECORD_HEADER_SIZE <= view->size; pos += LOG_RECORD_SIZE(len))
+		{
+			p = view->base + pos;
+			len = frame_get_u32(p);
+			if (len < FRAME_HEADER_SIZE || pos + LOG_RECORD_SIZE(len) > view->size) break;
+			if ((seq = frame_get_u64(p + 8)) >= to) break;
+			search_index_frame(seq, p + LOG_RECORD_HEADER_SIZE, len);
+			/* searches get in now and then */
+			if (++done % 4096 == 0)
+			{
+				pthread_rwlock_unlock(&idx->lock);
+				pthread_rwlock_wrlock(&idx->lock);
+			}
+		}
+		pthread_rwlock_unlock(&idx->lock);
+		log_view_unref(view);
+	}
+	free(seqs);
+}
+
+/* index thread, catches up with what was logged before the start, then
+ * takes the queue a batch at a time, a gap comes after the batch */
+void *search_start(void *data)
+{
+	struct search_index *idx = &search_index;
+	struct search_job *jobs, *job;
+	unsigned long long gap_from, gap_to;
+	unsigned int i, n;
+	jobs = idx->taken;
+	search_backfill(0, idx->backfill_end);
+	while (1)
+	{
+		pthread_mutex_lock(&idx->mutex);
+		while (idx->job_count == 0 && idx->gap_to == 0) pthread_cond_wait(&idx->cond, &idx->mutex);
+		for (n = 0; n < idx->job_count; n++) jobs[n] = idx->jobs[(idx->job_head + n) % SEARCH_QUEUE_MAX];
+		idx->job_head = (idx->job_head + n) % SEARCH_QUEUE_MAX;
+		idx->job_count = 0;
+		gap_from = idx->gap_from;
+		gap_to = idx->gap_to;
+		idx->gap_to = 0;
+		pthread_mutex_unlock(&idx->mutex);
+		pthread_rwlock_wrlock(&idx->lock);
+		for (i = 0; i < n; i++)
+		{
+			job = &jobs[i];
+			search_index_frame(job->seq, job->frame->data, job->frame->len);
+		}
+		pthread_rwlock_unlock(&idx->lock);
+		for (i = 0; i < n; i++) out_frame_unref(jobs[i].frame);
+		if (gap_to != 0) search_backfill(gap_from, gap_to);
+	}
+	return NULL;
+}
+
+/* seqs of the newest messages holding every word of query, newest
+ * first, return how many, -1 if the query has no word */
+int search_query(const char *query, size_t len, unsigned long long *seqs, int max)
+{
+	char tokens[SEARCH_TERMS_MAX][SEARCH_TOKEN_LEN_MAX];
+	size_t lens[SEARCH_TERMS_MAX];
+	struct search_term *terms[SEARCH_TERMS_MAX], *term;
+	struct posting_cursor cursors[SEARCH_TERMS_MAX];
+	unsigned long long block[POSTING_BLOCK_SIZE];
+	size_t pos = 0, n;
+	int count = 0, found = 0, i, j, b, k;
+	while (count < SEARCH_TERMS_MAX && (n = search_token(query, len, &pos, tokens[count])) > 0)
+	{
+		lens[count++] = n;
+	}
+	if (count == 0) return -1;
+	pthread_rwlock_rdlock(&search_index.lock);
+	for (i = 0; i < count; i++)
+	{
+		if ((term = search_lookup(tokens[i], lens[i])) == NULL) goto done;
+		/* the rarest word leads */
+		for (j = i; j > 0 && term->list.count < terms[j - 1]->list.count; j--) terms[j] = terms[j - 1];
+		terms[j] = term;
+	}
+	for (i = 1; i < count; i++)
+	{
+		cursors[i].list = &terms[i]->list;
+		cursors[i].block = -1;
+	}
+	for (b = (int)terms[0]->list.block_count - 1; b >= 0 && found < max; b--)
+	{
+		n = posting_block_decode(&terms[0]->list, b, block);
+		for (k = (int)n - 1; k >= 0 && found < max; k--)
+		{
+			for (i = 1; i < count && posting_contains(&cursors[i], block[k]); i++);
+			if (i == count) seqs[found++] = block[k];
+		}
+	}
+done:
+	pthread_rwlock_unlock(&search_index.lock);
+	return found;
+}
+
+/* the log records of seqs, given newest first, copied oldest first into
+ * one buffer, return its length, *buf is NULL if nothing was found */
+size_t search_records(const unsigned long long *seqs, int n, char **buf)
+{
+	struct log_view *view = NULL;
+	unsigned long long *segments;
+	size_t len = 0, size = 0, pos, record_size;
+	int segment_count, s, i;
+	char *p;
+	*buf = NULL;
+	segment_count = log_segment_list(&segments);
+	for (i = n - 1; i >= 0 && segment_count > 0; i--)
+	{
+		/* last segment starting at or before the seq */
+		for (s = segment_count - 1; s > 0 && segments[s] > seqs[i]; s--);
+		if (view == NULL || view->first_seq != segments[s])
+		{
+			if (view != NULL) log_view_unref(view);
+			if ((view = log_view_open(segments[s])) == NULL) continue;
+		}
+		pos = log_view_seek(view, LOG_KEY_SEQ, seqs[i]);
+		if (pos + LOG_RECORD_HEADER_SIZE > view->size || frame_get_u64(view->base + pos + 8) != seqs[i]) continue;
+		record_size = LOG_RECORD_SIZE(frame_get_u32(view->base + pos));
+		if (len + record_size > size)
+		{
+			size = len + record_size > size * 2 ? len + record_size : size * 2;
+			if ((p = (char *)realloc(*buf, size)) == NULL) break;
+			*buf = p;
+		}
+		memcpy(*buf + len, view->base + pos, record_size);
+		len += record_size;
+	}
+	if (view != NULL) log_view_unref(view);
+	free(segments);
+	return len;
+}
+
+/* answer a search with the records found, then an empty
+ * CMD_LOG_RECORDS, or with why it failed, search thread */
+static void search_reply(struct search_request *req)
+{
+	unsigned long long seqs[SEARCH_RESULTS_MAX];
+	struct out_frame **frames = NULL, *frame;
+	struct sub_server *server;
+	const char *reason = NULL;
+	char *buf = NULL;
+	size_t len, pos, chunk;
+	unsigned int i = 0, n = 0;
+	int found;
+	if ((found = search_query(req->query, req->len, seqs, SEARCH_RESULTS_MAX)) == -1)
+	{
+		reason = "no word to search";
+	}
+	else
+	{
+		len = search_records(seqs, found, &buf);
+		n = len / FRAME_PAYLOAD_MAX + 2;
+		if ((frames = (struct out_frame **)calloc(n, sizeof(struct out_frame *))) == NULL) n = 0;
+		for (i = 0, pos = 0; frames != NULL && pos < len; i++, pos += chunk)
+		{
+			chunk = len - pos < FRAME_PAYLOAD_MAX ? len - pos : FRAME_PAYLOAD_MAX;
+			if ((frames[i] = out_frame_new(FRAME_HEADER_SIZE + chunk)) == NULL) break;
+			frame_encode_header(frames[i]->data, CMD_LOG_RECORDS, 0, chunk);
+			memcpy(frames[i]->data + FRAME_HEADER_SIZE, buf + pos, chunk);
+		}
+		if (frames == NULL || pos < len || (frames[i] = out_frame_new(FRAME_HEADER_SIZE)) == NULL)
+		{
+			reason = "out of memory";
+		}
+		else frame_encode_header(frames[i]->data, CMD_LOG_RECORDS, 0, 0);
+		free(buf);
+	}
+	/* the list mutex keeps the client from being deleted meanwhile */
+	sub_server_list_lock(req->list);
+	if ((server = sub_server_list_get(req->list, req->handle)) != NULL)
+	{
+		sub_server_batch_before(server);
+		sub_server_out_lock(server);
+		/* records of a range going out can't be interleaved, once
+		 * queued a range only starts after them */
+		if (reason == NULL && server->range != NULL) reason = "a range is being sent";
+		if (reason == NULL) sub_server_queue_batch(server, frames, i + 1);
+		else if ((frame = sub_server_error_frame(CMD_SEARCH, reason)) != NULL)
+		{
+			sub_server_queue_batch(server, &frame, 1);
+			out_frame_unref(frame);
+		}
+		sub_server_out_unlock(server);
+	}
+	sub_server_list_unlock(req->list);
+	for (i = 0; i < n; i++) if (frames[i] != NULL) out_frame_unref(frames[i]);
+	free(frames);
+}
+
+/* queue a search of a client for the search thread, so the scan of the
+ * log is off the reactor, return why it failed, NULL on success */
+const char *search_submit(struct sub_server *server, const char *query, size_t query_len)
+{
+	struct search_index *idx = &search_index;
+	struct search_request *req;
+	if ((req = (struct search_request *)malloc(sizeof(struct search_request) + query_len)) == NULL) return "out of memory";
+	req->next = NULL;
+	req->list = server->list;
+	req->handle = sub_server_handle(server);
+	req->len = query_len;
+	memcpy(req->query, query, query_len);
+	pthread_mutex_lock(&idx->mutex);
+	if (idx->request_count == SEARCH_REQUESTS_MAX)
+	{
+		pthread_mutex_unlock(&idx->mutex);
+		free(req);
+		return "too many searches";
+	}
+	if (idx->requests == NULL) pthread_cond_signal(&idx->request_cond);
+	*idx->requests_tail = req;
+	idx->requests_tail = &req->next;
+	idx->request_count++;
+	pthread_mutex_unlock(&idx->mutex);
+	return NULL;
+}
+
+/* search thread, serves searches one at a time in the order queued */
+void *search_serve(void *data)
+{
+	struct search_index *idx = &search_index;
+	struct search_request *req;
+	while (1)
+	{
+		pthread_mutex_lock(&idx->mutex);
+		while (idx->requests == NULL) pthread_cond_wait(&idx->request_cond, &idx->mutex);
+		req = idx->requests;
+		if ((idx->requests = req->next) == NULL) idx->requests_tail = &idx->requests;
+		idx->request_count--;
+		pthread_mutex_unlock(&idx->mutex);
+		search_reply(req);
+		free(req);
+	}
+	return NULL;
+}
+
+/* start indexing and serving searches, the log must be open, return -1
+ * on error */
+int search_init(void)
+{
+	struct search_index *idx = &search_index;
+	idx->bucket_count = 1024;
+	idx->buckets = (struct search_term **)calloc(idx->bucket_count, sizeof(struct search_term *));
+	idx->jobs = (struct search_job *)malloc(SEARCH_QUEUE_MAX * sizeof(struct search_job));
+	idx->taken = (struct search_job *)malloc(SEARCH_QUEUE_MAX * sizeof(struct search_job));
+	if (idx->buckets == NULL || idx->jobs == NULL || idx->taken == NULL) return -1;
+	pthread_rwlock_init(&idx->lock, NULL);
+	pthread_mutex_init(&idx->mutex, NULL);
+	pthread_cond_init(&idx->cond, NULL);
+	pthread_cond_init(&idx->request_cond, NULL);
+	idx->requests = NULL;
+	idx->requests_tail = &idx->requests;
+	idx->backfill_end = message_log->next_seq;
+	log_listener = search_queue;
+	if (pthread_create(&idx->thd, NULL, search_start, NULL) != 0) return -1;
+	pthread_detach(idx->thd);
+	if (pthread_create(&idx->request_thd, NULL, search_serve, NULL) != 0) return -1;
+	pthread_detach(idx->request_thd);
+	return 0;
+}
+#endif
+
+/* rooms
+ * every room keeps its own member set, so a message to a room costs as
+ * much as the room is big, not as the whole server
+ * rooms are spread over shards by name hash, joining or leaving takes
+ * the lock of one shard only and sending takes no lock at all */
+
+#define ROOM_SHARDS 64
+#define ROOM_BUCKETS 64 /* hash chains per shard */
+
+struct room
+{
+	struct room *next; /* hash chain */
+	unsigned int hash;
+	char name[ROOM_NAME_LEN_MAX];
+	unsigned char name_len;
+	struct sub_server **members;
+	unsigned int size;
+	unsigned int capacity;
+	struct sub_server_set set; /* messages to the room walk its snapshot */
+	struct history history; /* last messages to the room */
+};
+
+struct room_shard
+{
+	struct room *buckets[ROOM_BUCKETS];
+	unsigned int count;
+#if defined(UNIX)
+	pthread_mutex_t mutex;
+#elif defined(WINDOWS)
+	CRITICAL_SECTION cs;
+#endif
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct room_shard room_shards[ROOM_SHARDS];
+
+void rooms_init(void)
+{
+	int i;
+	for (i = 0; i < ROOM_SHARDS; i++)
+	{
+#if defined(UNIX)
+		pthread_mutex_init(&room_shards[i].mutex, NULL);
+#elif defined(WINDOWS)
+		InitializeCriticalSectionAndSpinCount(&room_shards[i].cs, 4000);
+#endif
+	}
+}
+
+static void room_shard_lock(struct room_shard *shard)
+{
+#if defined(UNIX)
+	pthread_mutex_lock(&shard->mutex);
+#elif defined(WINDOWS)
+	EnterCriticalSection(&shard->cs);
+#endif
+}
+
+static void room_shard_unlock(struct room_shard *shard)
+{
+#if defined(UNIX)
+	pthread_mutex_unlock(&shard->mutex);
+#elif defined(WINDOWS)
+	LeaveCriticalSection(&shard->cs);
+#endif
+}
+
+/* FNV-1a of a room name or nickname */
+static unsigned int name_hash(const char *name, size_t name_len)
+{
+	unsigned int hash = 2166136261u;
+	size_t i;
+	for (i = 0; i < name_len; i++)
+	{
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* joined room of a client by name, NULL if not joined,
+ * only the owner of the client calls it */
+static struct room *sub_server_room(struct sub_server *server, const char *name, size_t name_len)
+{
+	unsigned int i;
+	for (i = 0; i < server->room_count; i++)
+	{
+		struct room *room = server->rooms[i];
+		if (room->name_len == name_len && !memcmp(room->name, name, name_len)) return room;
+	}
+	return NULL;
+}
+
+/* add a client to a room, the room is created by its first member */
+int room_join(struct sub_server *server, const char *name, size_t name_len)
+{
+	unsigned int hash;
+	struct room_shard *shard;
+	struct room **bucket, *room;
+	int ret = -1;
+	if (name_len == 0 || name_len > ROOM_NAME_LEN_MAX) return -1;
+	if (sub_server_room(server, name, name_len) != NULL) return 0;
+	if (server->room_count == ROOMS_PER_CLIENT_MAX) return -1;
+	hash = name_hash(name, name_len);
+	shard = &room_shards[hash % ROOM_SHARDS];
+	bucket = &shard->buckets[(hash / ROOM_SHARDS) % ROOM_BUCKETS];
+	room_shard_lock(shard);
+	for (room = *bucket; room != NULL; room = room->next)
+	{
+		if (room->hash == hash && room->name_len == name_len && !memcmp(room->name, name, name_len)) break;
+	}
+	if (room == NULL)
+	{
+		room = (struct room *)calloc(1, sizeof(struct room));
+		if (room == NULL) goto done;
+		if (sub_server_set_init(&room->set) == -1)
+		{
+			/* never linked, nothing for done to unlink */
+			free(room);
+			room = NULL;
+			goto done;
+		}
+		if (history_init(&room->history) == -1)
+		{
+			sub_server_set_free(&room->set);
+			free(room);
+			room = NULL;
+			goto done;
+		}
+		room->hash = hash;
+		memcpy(room->name, name, name_len);
+		room->name_len = (unsigned char)name_len;
+		room->next = *bucket;
+		*bucket = room;
+		shard->count++;
+	}
+	if (room->size == room->capacity)
+	{
+		unsigned int new_capacity = room->capacity == 0 ? 8 : room->capacity * 2;
+		struct sub_server **new_members = (struct sub_server **)realloc(room->members, new_capacity * sizeof(struct sub_server *));
+		if (new_members == NULL) goto done;
+		room->members = new_members;
+		room->capacity = new_capacity;
+	}
+	room->members[room->size++] = server;
+	if (sub_server_set_update(&room->set, room->members, room->size) == -1)
+	{
+		room->size--;
+		goto done;
+	}
+	server->rooms[server->room_count++] = room;
+	ret = 0;
+done:
+	/* a room created for nobody is not kept */
+	if (room != NULL && room->size == 0)
+	{
+		struct room **p;
+		for (p = bucket; *p != room; p = &(*p)->next);
+		*p = room->next;
+		shard->count--;
+		free(room->members);
+		sub_server_set_free(&room->set);
+		history_free(&room->history);
+		free(room);
+	}
+	room_shard_unlock(shard);
+	return ret;
+}
+
+/* remove a client from a joined room, the room goes with its last member */
+/* return -1 if out of memory, the client is still a member then */
+int room_leave(struct sub_server *server, struct room *room)
+{
+	unsigned int i;
+	int found = -1;
+	unsigned int hash = room->hash;
+	struct room_shard *shard = &room_shards[hash % ROOM_SHARDS];
+	room_shard_lock(shard);
+	for (i = 0; i < room->size; i++)
+	{
+		if (room->members[i] == server)
+		{
+			room->members[i] = room->members[--room->size];
+			found = (int)i;
+			break;
+		}
+	}
+	/* once the grace period is over no message to the room
+	 * refers to the client anymore, until then neither the room nor
+	 * the client may go */
+	if (sub_server_set_update(&room->set, room->members, room->size) == -1)
+	{
+		if (found != -1)
+		{
+			room->members[room->size++] = room->members[found];
+			room->members[found] = server;
+		}
+		room_shard_unlock(shard);
+		return -1;
+	}
+	if (room->size == 0)
+	{
+		struct room **p = &shard->buckets[(hash / ROOM_SHARDS) % ROOM_BUCKETS];
+		while (*p != room) p = &(*p)->next;
+		*p = room->next;
+		shard->count--;
+		free(room->members);
+		sub_server_set_free(&room->set);
+		history_free(&room->history);
+		free(room);
+	}
+	room_shard_unlock(shard);
+	for (i = 0; i < server->room_count; i++)
+	{
+		if (server->rooms[i] == room)
+		{
+			server->rooms[i] = server->rooms[--server->room_count];
+			break;
+		}
+	}
+	return 0;
+}
+
+/* leave every room, must be done before the client is deleted, so a
+ * leave that ran out of memory is tried again */
+void room_leave_all(struct sub_server *server)
+{
+	while (server->room_count > 0)
+	{
+		if (room_leave(server, server->rooms[server->room_count - 1]) == -1)
+		{
+#if defined(UNIX)
+			usleep(OUT_RETRY_MS * 1000);
+#elif defined(WINDOWS)
+			Sleep(OUT_RETRY_MS);
+#endif
+		}
+	}
+}
+
+/* send a frame to every member of a room, the sender must be a member
+ * itself, members of other reactors are queued directly */
+int room_sendmsg(struct room *room, struct out_frame *frame)
+{
+	unsigned int i, idx;
+	metric_add(METRIC_BROADCASTS, 1);
+	if (__atomic_load_n(&deflate_clients, __ATOMIC_RELAXED) > 0) out_frame_deflate(frame);
+	history_push(&room->history, frame);
+#if defined(UNIX)
+	log_append(frame);
+#endif
+	/* no lock, the sender is a member so the room can't go away */
+	idx = sub_server_set_read_lock(&room->set);
+	struct sub_server_snapshot *snap = __atomic_load_n(&room->set.snapshot, __ATOMIC_SEQ_CST);
+	for (i = 0; i < snap->size; i++)
+	{
+		sub_server_enqueue(snap->servers[i], frame);
+	}
+	metric_add(METRIC_FANOUT, snap->size);
+	sub_server_set_read_unlock(&room->set, idx);
+	return 0;
+}
+
+/* send a frame relayed by a peer to a room by name, the shard lock
+ * keeps the room meanwhile, return -1 if there is no such room here */
+int room_relay(const char *name, size_t name_len, struct out_frame *frame)
+{
+	unsigned int hash = name_hash(name, name_len);
+	struct room_shard *shard = &room_shards[hash % ROOM_SHARDS];
+	struct room *room;
+	room_shard_lock(shard);
+	for (room = shard->buckets[(hash / ROOM_SHARDS) % ROOM_BUCKETS]; room != NULL; room = room->next)
+	{
+		if (room->hash == hash && room->name_len == name_len && !memcmp(room->name, name, name_len)) break;
+	}
+	if (room != NULL) room_sendmsg(room, frame);
+	room_shard_unlock(shard);
+	return room != NULL ? 0 : -1;
+}
+
+/* copy of a room for listings */
+struct room_info
+{
+	char name[ROOM_NAME_LEN_MAX];
+	unsigned char name_len;
+	unsigned int size;
+};
+
+/* copy every room out, one shard lock at a time and without any
+ * output under it, return count of rooms, -1 if out of memory */
+int rooms_collect(struct room_info **rooms)
+{
+	int i, j;
+	unsigned int n = 0, capacity = 0;
+	struct room *room;
+	struct room_info *new_rooms;
+	*rooms = NULL;
+	for (i = 0; i < ROOM_SHARDS; i++)
+	{
+		room_shard_lock(&room_shards[i]);
+		if (n + room_shards[i].count > capacity)
+		{
+			capacity = (n + room_shards[i].count) * 2;
+			new_rooms = (struct room_info *)realloc(*rooms, capacity * sizeof(struct room_info));
+			if (new_rooms == NULL)
+			{
+				room_shard_unlock(&room_shards[i]);
+				free(*rooms);
+				return -1;
+			}
+			*rooms = new_rooms;
+		}
+		for (j = 0; j < ROOM_BUCKETS; j++)
+		{
+			for (room = room_shards[i].buckets[j]; room != NULL; room = room->next)
+			{
+				memcpy((*rooms)[n].name, room->name, room->name_len);
+				(*rooms)[n].name_len = room->name_len;
+				(*rooms)[n++].size = room->size;
+			}
+		}
+		room_shard_unlock(&room_shards[i]);
+	}
+	return (int)n;
+}
+
+/* print every room and its size */
+int rooms_walk(void)
+{
+	struct room_info *rooms;
+	int i, n = rooms_collect(&rooms);
+	for (i = 0; i < n; i++)
+	{
+		printf("room %.*s: %u member(s)\n", rooms[i].name_len, rooms[i].name, rooms[i].size);
+	}
+	if (n == 0) printf("no room\n");
+	free(rooms);
+	return 0;
+}
+
+/* nickname index
+ * registered nicknames are unique, a direct message finds its recipient
+ * with one lookup in a sharded hash table instead of walking all clients
+ * a client stays in the index until it leaves, and a recipient is only
+ * used with the lock of its shard held */
+
+/* roster
+ * clients registered with a nickname are online, changes are logged
+ * as they are made to the nickname index, under the lock of its
+ * shard, and the roster thread sends the net changes of every window
+ * in one delta, encoded once for all the clients following the roster,
+ * so a storm of joins costs every follower one frame per window */
+
+#define ROSTER_WINDOW_MS_DEFAULT 250
+#define ROSTER_WINDOW_MS_MAX 5000
+int roster_window_ms = ROSTER_WINDOW_MS_DEFAULT;
+
+/* changes of the current window, u8 op, u8 name_len, name each */
+char *roster_ops;
+size_t roster_ops_len;
+size_t roster_ops_size;
+unsigned int roster_count; /* clients following the roster */
+#if defined(UNIX)
+pthread_mutex_t mutex_roster_ops;
+#elif defined(WINDOWS)
+CRITICAL_SECTION cs_roster_ops;
+#endif
+
+static void roster_ops_lock(void)
+{
+#if defined(UNIX)
+	pthread_mutex_lock(&mutex_roster_ops);
+#elif defined(WINDOWS)
+	EnterCriticalSection(&cs_roster_ops);
+#endif
+}
+
+static void roster_ops_unlock(void)
+{
+#if defined(UNIX)
+	pthread_mutex_unlock(&mutex_roster_ops);
+#elif defined(WINDOWS)
+	LeaveCriticalSection(&cs_roster_ops);
+#endif
+}
+
+/* log a change, lock of the nickname shard held, nothing is logged
+ * while nobody follows the roster, a follower gets it in its snapshot */
+static void roster_change(unsigned char op, const char *nickname, unsigned char nickname_len)
+{
+	char *p;
+	if (__atomic_load_n(&roster_count, __ATOMIC_SEQ_CST) == 0) return;
+	roster_ops_lock();
+	if (roster_ops_len + 2 + nickname_len > roster_ops_size)
+	{
+		size_t new_size = roster_ops_size == 0 ? BUFFER_SIZE : roster_ops_size * 2;
+		p = (char *)realloc(roster_ops, new_size);
+		if (p == NULL) goto done;
+		roster_ops = p;
+		roster_ops_size = new_size;
+	}
+	p = roster_ops + roster_ops_len;
+	p[0] = (char)op;
+	p[1] = (char)nickname_len;
+	memcpy(p + 2, nickname, nickname_len);
+	roster_ops_len += 2 + nickname_len;
+done:
+	roster_ops_unlock();
+}
+
+#define NICK_SHARDS 64
+#define NICK_BUCKETS 64 /* hash chains per shard */
+
+struct nick_shard
+{
+	struct sub_server *buckets[NICK_BUCKETS];
+#if defined(UNIX)
+	pthread_mutex_t mutex;
+#elif defined(WINDOWS)
+	CRITICAL_SECTION cs;
+#endif
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct nick_shard nick_shards[NICK_SHARDS];
+
+void nick_index_init(void)
+{
+	int i;
+	for (i = 0; i < NICK_SHARDS; i++)
+	{
+#if defined(UNIX)
+		pthread_mutex_init(&nick_shards[i].mutex, NULL);
+#elif defined(WINDOWS)
+		InitializeCriticalSectionAndSpinCount(&nick_shards[i].cs, 4000);
+#endif
+	}
+}
+
+static void nick_shard_lock(unsigned int shard)
+{
+#if defined(UNIX)
+	pthread_mutex_lock(&nick_shards[shard].mutex);
+#elif defined(WINDOWS)
+	EnterCriticalSection(&nick_shards[shard].cs);
+#endif
+}
+
+static void nick_shard_unlock(unsigned int shard)
+{
+#if defined(UNIX)
+	pthread_mutex_unlock(&nick_shards[shard].mutex);
+#elif defined(WINDOWS)
+	LeaveCriticalSection(&nick_shards[shard].cs);
+#endif
+}
+
+/* bucket of a nickname, lock of its shard held */
+static struct sub_server **nick_bucket(unsigned int hash)
+{
+	return &nick_shards[hash % NICK_SHARDS].buckets[(hash / NICK_SHARDS) % NICK_BUCKETS];
+}
+
+/* client registered with a nickname, lock of its shard held */
+static struct sub_server *nick_index_find(unsigned int hash, const char *nickname, size_t nickname_len)
+{
+	struct sub_server *cur;
+	for (cur = *nick_bucket(hash); cur != NULL; cur = cur->nick_next)
+	{
+		if (cur->nickname_len == nickname_len && !memcmp(cur->nickname, nickname, nickname_len)) return cur;
+	}
+	return NULL;
+}
+
+static void nick_index_unlink(struct sub_server *server, unsigned int hash)
+{
+	struct sub_server **p = nick_bucket(hash);
+	while (*p != server) p = &(*p)->nick_next;
+	*p = server->nick_next;
+	server->nick_next = NULL;
+}
+
+/* register a client under a new nickname, unregistering the old one,
+ * return -1 if somebody else has it */
+int nick_index_rename(struct sub_server *server, const char *nickname, unsigned char nickname_len)
+{
+	unsigned int new_hash = name_hash(nickname, nickname_len);
+	unsigned int old_hash = name_hash(server->nickname, server->nickname_len);
+	unsigned int new_shard = new_hash % NICK_SHARDS, old_shard = old_hash % NICK_SHARDS;
+	int indexed = server->nick_indexed;
+	struct sub_server *owner;
+	int ret = 0;
+	/* both shards, in order */
+	if (indexed && old_shard < new_shard) nick_shard_lock(old_shard);
+	nick_shard_lock(new_shard);
+	if (indexed && old_shard > new_shard) nick_shard_lock(old_shard);
+	owner = nick_index_find(new_hash, nickname, nickname_len);
+	if (owner != NULL && owner != server)
+	{
+		ret = -1;
+	}
+	else if (owner == NULL)
+	{
+		if (indexed)
+		{
+			nick_index_unlink(server, old_hash);
+			roster_change(ROSTER_LEAVE, server->nickname, server->nickname_len);
+		}
+		roster_change(ROSTER_JOIN, nickname, nickname_len);
+		server->nickname_len = nickname_len;
+		memcpy(server->nickname, nickname, nickname_len);
+		server->nick_next = *nick_bucket(new_hash);
+		*nick_bucket(new_hash) = server;
+		server->nick_indexed = 1;
+	}
+	if (indexed && old_shard != new_shard) nick_shard_unlock(old_shard);
+	nick_shard_unlock(new_shard);
+	return ret;
+}
+
+/* unregister the nickname of a client, must be done before it is deleted */
+void nick_index_remove(struct sub_server *server)
+{
+	unsigned int hash, shard;
+	if (!server->nick_indexed) return;
+	hash = name_hash(server->nickname, server->nickname_len);
+	shard = hash % NICK_SHARDS;
+	nick_shard_lock(shard);
+	nick_index_unlink(server, hash);
+	roster_change(ROSTER_LEAVE, server->nickname, server->nickname_len);
+	server->nick_indexed = 0;
+	nick_shard_unlock(shard);
+}
+
+/* queue a frame for the client registered with a nickname,
+ * return -1 if there is none */
+int nick_index_sendmsg(const char *nickname, size_t nickname_len, struct out_frame *frame)
+{
+	unsigned int hash = name_hash(nickname, nickname_len);
+	unsigned int shard = hash % NICK_SHARDS;
+	struct sub_server *target;
+	int ret = -1;
+	nick_shard_lock(shard);
+	/* the recipient can't leave while its shard is locked */
+	target = nick_index_find(hash, nickname, nickname_len);
+	if (target != NULL)
+	{
+		sub_server_enqueue(target, frame);
+		ret = 0;
+	}
+	nick_shard_unlock(shard);
+	return ret;
+}
+
+/* followers of the roster, a snapshot and the deltas are sent under
+ * the roster lock, so a delta older than a snapshot never follows it */
+struct sub_server **roster_members;
+unsigned int roster_capacity;
+#if defined(UNIX)
+pthread_mutex_t mutex_roster;
+#elif defined(WINDOWS)
+CRITICAL_SECTION cs_roster;
+#endif
+
+void roster_init(void)
+{
+#if defined(UNIX)
+	pthread_mutex_init(&mutex_roster_ops, NULL);
+	pthread_mutex_init(&mutex_roster, NULL);
+#elif defined(WINDOWS)
+	InitializeCriticalSection(&cs_roster_ops);
+	InitializeCriticalSection(&cs_roster);
+#endif
+}
+
+static void roster_lock(void)
+{
+#if defined(UNIX)
+	pthread_mutex_lock(&mutex_roster);
+#elif defined(WINDOWS)
+	EnterCriticalSection(&cs_roster);
+#endif
+}
+
+static void roster_unlock(void)
+{
+#if defined(UNIX)
+	pthread_mutex_unlock(&mutex_roster);
+#elif defined(WINDOWS)
+	LeaveCriticalSection(&cs_roster);
+#endif
+}
+
+/* frames of records, each one filled up to the biggest frame */
+struct roster_frames
+{
+	struct out_frame **frames;
+	unsigned int count;
+	unsigned int capacity;
+	size_t size; /* room of the last frame */
+	size_t head; /* bytes before the records */
+};
+
+/* append a record, return -1 if out of memory */
+static int roster_frames_put(struct roster_frames *rf, const char *record, size_t len)
+{
+	struct out_frame *last = rf->count > 0 ? rf->frames[rf->count - 1] : NULL;
+	if (last == NULL || last->len + len > FRAME_SIZE_MAX)
+	{
+		if (rf->count == rf->capacity)
+		{
+			unsigned int new_capacity = rf->capacity == 0 ? 4 : rf->capacity * 2;
+			struct out_frame **new_frames = (struct out_frame **)realloc(rf->frames, new_capacity * sizeof(struct out_frame *));
+			if (new_frames == NULL) return -1;
+			rf->frames = new_frames;
+			rf->capacity = new_capacity;
+		}
+		rf->size = BUFFER_SIZE;
+		if ((last = out_frame_new(rf->size)) == NULL) return -1;
+		last->len = FRAME_HEADER_SIZE + rf->head;
+		rf->frames[rf->count++] = last;
+	}
+	/* grown by doubling up to the biggest frame */
+	if (last->len + len > rf->size)
+	{
+		size_t new_size = rf->size * 2 > FRAME_SIZE_MAX ? FRAME_SIZE_MAX : rf->size * 2;
+		struct out_frame *grown = (struct out_frame *)realloc(last, sizeof(struct out_frame) + new_size);
+		if (grown == NULL) return -1;
+		rf->frames[rf->count - 1] = last = grown;
+		rf->size = new_size;
+	}
+	memcpy(last->data + last->len, record, len);
+	last->len += len;
+	return 0;
+}
+
+/* queue the frames for a client and drop them */
+static void roster_frames_send(struct roster_frames *rf, unsigned char cmd, struct sub_server **servers, unsigned int n)
+{
+	unsigned int i, j;
+	for (i = 0; i < rf->count; i++)
+	{
+		struct out_frame *frame = rf->frames[i];
+		frame_encode_header(frame->data, cmd, 0, frame->len - FRAME_HEADER_SIZE);
+		if (rf->head > 0) frame->data[FRAME_HEADER_SIZE] = (i == 0 ? ROSTER_FIRST : 0) | (i == rf->count - 1 ? ROSTER_LAST : 0);
+		if (n > 1 && __atomic_load_n(&deflate_clients, __ATOMIC_RELAXED) > 0) out_frame_deflate(frame);
+		for (j = 0; j < n; j++) sub_server_enqueue(servers[j], frame);
+		out_frame_unref(frame);
+	}
+	free(rf->frames);
+}
+
+/* send everybody online to a client, roster lock and every nickname
+ * shard held */
+static void roster_snapshot(struct sub_server *server)
+{
+	struct roster_frames rf;
+	struct sub_server *cur;
+	char record[1 + NICKNAME_LEN_MAX];
+	unsigned int shard, bucket;
+	bzero(&rf, sizeof(rf));
+	rf.head = 1;
+	/* an empty roster is one frame too */
+	if (roster_frames_put(&rf, NULL, 0) == -1) goto done;
+	for (shard = 0; shard < NICK_SHARDS; shard++)
+	{
+		for (bucket = 0; bucket < NICK_BUCKETS; bucket++)
+		{
+			for (cur = nick_shards[shard].buckets[bucket]; cur != NULL; cur = cur->nick_next)
+			{
+				record[0] = (char)cur->nickname_len;
+				memcpy(record + 1, cur->nickname, cur->nickname_len);
+				if (roster_frames_put(&rf, record, 1 + cur->nickname_len) == -1) break;
+			}
+		}
+	}
+done:
+	roster_frames_send(&rf, CMD_ROSTER, &server, 1);
+}
+
+/* add a follower, roster lock held, return -1 if out of memory */
+static int roster_add(struct sub_server *server)
+{
+	if (server->roster) return 0;
+	if (roster_count == roster_capacity)
+	{
+		unsigned int new_capacity = roster_capacity == 0 ? SLAB_CHUNK_SIZE : roster_capacity * 2;
+		struct sub_server **new_members = (struct sub_server **)realloc(roster_members, new_capacity * sizeof(struct sub_server *));
+		if (new_members == NULL) return -1;
+		roster_members = new_members;
+		roster_capacity = new_capacity;
+	}
+	roster_members[roster_count] = server;
+	/* changes are logged from now on */
+	__atomic_store_n(&roster_count, roster_count + 1, __ATOMIC_SEQ_CST);
+	server->roster = 1;
+	return 0;
+}
+
+/* stop following, must be done before the client is deleted */
+void roster_unfollow(struct sub_server *server)
+{
+	unsigned int i;
+	if (!server->roster) return;
+	roster_lock();
+	for (i = 0; i < roster_count; i++)
+	{
+		if (roster_members[i] == server)
+		{
+			roster_members[i] = roster_members[roster_count - 1];
+			__atomic_store_n(&roster_count, roster_count - 1, __ATOMIC_SEQ_CST);
+			break;
+		}
+	}
+	server->roster = 0;
+	roster_unlock();
+}
+
+/* one logged change */
+struct roster_op
+{
+	const char *nickname;
+	unsigned char nickname_len;
+	unsigned char op;
+	unsigned int order; /* in the log */
+};
+
+static int roster_op_compare(const void *a, const void *b)
+{
+	const struct roster_op *x = (const struct roster_op *)a, *y = (const struct roster_op *)b;
+	int c = memcmp(x->nickname, y->nickname, x->nickname_len < y->nickname_len ? x->nickname_len : y->nickname_len);
+	if (c != 0) return c;
+	if (x->nickname_len != y->nickname_len) return x->nickname_len < y->nickname_len ? -1 : 1;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/* send the net changes of the window to the followers: a nickname
+ * whose first change was a join was offline before, one whose last
+ * change was a join is online now, only a difference goes out,
+ * roster lock held */
+static void roster_flush_locked(void)
+{
+	struct roster_frames rf;
+	struct roster_op *ops = NULL;
+	char *log;
+	size_t len, pos;
+	unsigned int n = 0, i, j;
+	int before, after;
+	char record[2 + NICKNAME_LEN_MAX];
+	roster_ops_lock();
+	log = roster_ops;
+	len = roster_ops_len;
+	roster_ops = NULL;
+	roster_ops_len = roster_ops_size = 0;
+	roster_ops_unlock();
+	if (len == 0 || roster_count == 0) goto done;
+	ops = (struct roster_op *)malloc(len / 2 * sizeof(struct roster_op));
+	if (ops == NULL) goto done;
+	for (pos = 0; pos < len; pos += 2 + (unsigned char)log[pos + 1])
+	{
+		ops[n].op = (unsigned char)log[pos];
+		ops[n].nickname_len = (unsigned char)log[pos + 1];
+		ops[n].nickname = log + pos + 2;
+		ops[n].order = n;
+		n++;
+	}
+	qsort(ops, n, sizeof(struct roster_op), roster_op_compare);
+	bzero(&rf, sizeof(rf));
+	for (i = 0; i < n; i = j)
+	{
+		for (j = i + 1; j < n && ops[j].nickname_len == ops[i].nickname_len && !memcmp(ops[j].nickname, ops[i].nickname, ops[i].nickname_len); j++);
+		before = ops[i].op == ROSTER_LEAVE;
+		after = ops[j - 1].op == ROSTER_JOIN;
+		if (before == after) continue;
+		record[0] = (char)(after ? ROSTER_JOIN : ROSTER_LEAVE);
+		record[1] = (char)ops[i].nickname_len;
+		memcpy(record + 2, ops[i].nickname, ops[i].nickname_len);
+		if (roster_frames_put(&rf, record, 2 + ops[i].nickname_len) == -1) break;
+	}
+	roster_frames_send(&rf, CMD_ROSTER_DELTA, roster_members, roster_count);
+done:
+	free(ops);
+	free(log);
+}
+
+void roster_flush(void)
+{
+	roster_lock();
+	roster_flush_locked();
+	roster_unlock();
+}
+
+/* a client follows the roster from its snapshot on, asking again
+ * only gets a new snapshot */
+void roster_follow(struct sub_server *server)
+{
+	unsigned int shard;
+	roster_lock();
+	/* no change is logged meanwhile, the followers get the changes
+	 * logged so far and the next window starts from the snapshot for
+	 * everybody, else a change the snapshot shows could cancel out
+	 * with a later one */
+	for (shard = 0; shard < NICK_SHARDS; shard++) nick_shard_lock(shard);
+	roster_flush_locked();
+	if (roster_add(server) == 0) roster_snapshot(server);
+	for (shard = 0; shard < NICK_SHARDS; shard++) nick_shard_unlock(shard);
+	roster_unlock();
+}
+
+/* roster thread, sends the changes of every window */
+#if defined(UNIX)
+void *roster_start(void *data)
+#elif defined(WINDOWS)
+DWORD WINAPI roster_start(void *data)
+#endif
+{
+	while (1)
+	{
+#if defined(UNIX)
+		usleep(roster_window_ms * 1000);
+#elif defined(WINDOWS)
+		Sleep(roster_window_ms);
+#endif
+		roster_flush();
+	}
+#if defined(UNIX)
+	return NULL;
+#elif defined(WINDOWS)
+	return 0;
+#endif
+}
+
+#if defined(UNIX)
+/* cluster
+ * servers started with a node id link as peers, a message to everybody
+ * or to a room from a client of a node is relayed once to each of its
+ * peers, a peer fans it out to its own clients and passes it on to its
+ * other peers, so any connected graph of links works and a tree relays
+ * every message once per link, the origin and seq of a relay tell a
+ * message taken before on another path or come back around a cycle */
+
+#define PEERS_MAX 16 /* --peer options */
+#define PEER_RETRY_S 1 /* a lost link is connected again this often */
+#define PEER_CONNECT_TIMEOUT_S 5
+#define RELAY_WINDOW 4096 /* seqs of an origin told apart behind its newest */
+#define ORIGINS_MAX 256 /* nodes of a cluster */
+#define PEER_ALLOWS_MAX 64 /* addresses hellos are taken from */
+#define PEER_RATE_SCALE 100 /* a link may send this many times the rate limit of a client */
+
+/* configured peer, its link is kept up by a connector thread */
+struct peer
+{
+	char host[256];
+	char port[8];
+	int linked; /* a link is up or being set up */
+	pthread_t thd;
+};
+
+/* seqs lately taken from one node */
+struct relay_origin
+{
+	unsigned int node;
+	unsigned int boot; /* seqs of another boot of the node start over */
+	unsigned long long top; /* newest seq */
+	unsigned long long seen[RELAY_WINDOW / 64]; /* bit of seq % RELAY_WINDOW */
+};
+
+enum {
+	RELAY_SENT = 0, /* own messages relayed */
+	RELAY_TAKEN, /* relays fanned out here */
+	RELAY_SEEN, /* relays taken before */
+	RELAY_MAX,
+};
+
+unsigned int node_id; /* 0: no cluster */
+struct peer peers[PEERS_MAX];
+int peer_count;
+unsigned int relay_boot; /* told apart from the seqs of an earlier run */
+unsigned long long relay_seq; /* of the next own message */
+unsigned long relay_count[RELAY_MAX];
+/* linked peers, relays walk the snapshot like messages to a room */
+struct sub_server **peer_links;
+unsigned int peer_link_count;
+unsigned int peer_link_capacity;
+struct sub_server_set peer_set;
+pthread_mutex_t mutex_peers = PTHREAD_MUTEX_INITIALIZER;
+struct relay_origin relay_origins[ORIGINS_MAX];
+unsigned int relay_origin_count;
+pthread_mutex_t mutex_origins = PTHREAD_MUTEX_INITIALIZER;
+/* --peer-allow hosts, resolved with those of --peer on start */
+char peer_allow_hosts[PEERS_MAX][256];
+int peer_allow_count;
+struct in_addr peer_allows[PEER_ALLOWS_MAX];
+unsigned int peer_allow_addr_count;
+
+/* add the IPv4 addresses of host to those hellos are taken from,
+ * return -1 if it does not resolve */
+static int peer_allow_resolve(const char *host)
+{
+	struct addrinfo hints, *res, *ai;
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, NULL, &hints, &res) != 0) return -1;
+	for (ai = res; ai != NULL && peer_allow_addr_count < PEER_ALLOWS_MAX; ai = ai->ai_next)
+	{
+		peer_allows[peer_allow_addr_count++] = ((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+	}
+	freeaddrinfo(res);
+	return 0;
+}
+
+/* whether a client may say hello as a peer, any other client could
+ * relay messages in the name of anybody */
+static int peer_allowed(struct sub_server *server)
+{
+	struct in_addr addr;
+	unsigned int i;
+	/* a link this node connected itself */
+	if (server->peer_out != NULL) return 1;
+	if (inet_aton(server->client_ip_addr, &addr) == 0) return 0;
+	for (i = 0; i < peer_allow_addr_count; i++)
+	{
+		if (peer_allows[i].s_addr == addr.s_addr) return 1;
+	}
+	return 0;
+}
+
+int peer_init(void)
+{
+	int i, fd;
+	if (sub_server_set_init(&peer_set) == -1) return -1;
+	/* a peer that does not resolve yet is only connected to, it may
+	 * still be allowed with --peer-allow */
+	for (i = 0; i < peer_count; i++) peer_allow_resolve(peers[i].host);
+	for (i = 0; i < peer_allow_count; i++)
+	{
+		if (peer_allow_resolve(peer_allow_hosts[i]) == -1) return -1;
+	}
+	/* own seqs count from 0 under a boot id of their own, so a restart
+	 * or a clock set back never looks like old seqs to the peers */
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd == -1 || read(fd, &relay_boot, sizeof(relay_boot)) != sizeof(relay_boot))
+	{
+		relay_boot = (unsigned int)(wall_clock_ms() ^ ((unsigned long long)getpid() << 16));
+	}
+	if (fd != -1) close(fd);
+	relay_seq = 0;
+	return 0;
+}
+
+/* the connector of a configured peer may connect again */
+static void peer_lost(struct peer *peer)
+{
+	if (peer != NULL) __atomic_store_n(&peer->linked, 0, __ATOMIC_RELEASE);
+}
+
+/* a link said its hello, relays go to it from now on */
+int peer_link(struct sub_server *server, unsigned int id)
+{
+	int ret = -1;
+	pthread_mutex_lock(&mutex_peers);
+	if (peer_link_count == peer_link_capacity)
+	{
+		unsigned int new_capacity = peer_link_capacity == 0 ? PEERS_MAX : peer_link_capacity * 2;
+		struct sub_server **new_links = (struct sub_server **)realloc(peer_links, new_capacity * sizeof(struct sub_server *));
+		if (new_links == NULL) goto done;
+		peer_links = new_links;
+		peer_link_capacity = new_capacity;
+	}
+	peer_links[peer_link_count++] = server;
+	if (sub_server_set_update(&peer_set, peer_links, peer_link_count) == -1)
+	{
+		peer_link_count--;
+		goto done;
+	}
+	server->peer = id;
+	ret = 0;
+done:
+	pthread_mutex_unlock(&mutex_peers);
+	return ret;
+}
+
+/* drop a link, must be done before it is deleted */
+void peer_unlink(struct sub_server *server)
+{
+	unsigned int i;
+	peer_lost(server->peer_out);
+	if (!server->peer) return;
+	for (;;)
+	{
+		pthread_mutex_lock(&mutex_peers);
+		for (i = 0; i < peer_link_count && peer_links[i] != server; i++);
+		if (i == peer_link_count) break;
+		peer_links[i] = peer_links[--peer_link_count];
+		/* no relay refers to the link after the grace period, so one
+		 * that ran out of memory keeps the link and is tried again */
+		if (sub_server_set_update(&peer_set, peer_links, peer_link_count) == 0) break;
+		peer_links[peer_link_count++] = peer_links[i];
+		peer_links[i] = server;
+		pthread_mutex_unlock(&mutex_peers);
+		usleep(OUT_RETRY_MS * 1000);
+	}
+	pthread_mutex_unlock(&mutex_peers);
+}
+
+/* wrap a whole message frame into a relay, NULL if the message is too
+ * long for it or out of memory */
+static struct out_frame *relay_frame_new(unsigned int origin, unsigned int boot, unsigned long long seq, const char *data, size_t len)
+{
+	struct out_frame *relay;
+	if (len > FRAME_HEADER_SIZE + RELAY_PAYLOAD_MAX) return NULL;
+	relay = out_frame_new(FRAME_HEADER_SIZE + RELAY_HEADER_SIZE + len);
+	if (relay == NULL) return NULL;
+	frame_encode_header(relay->data, CMD_PEER_RELAY, 0, RELAY_HEADER_SIZE + len);
+	frame_put_u32(relay->data + FRAME_HEADER_SIZE, origin);
+	frame_put_u32(relay->data + FRAME_HEADER_SIZE + 4, boot);
+	frame_put_u64(relay->data + FRAME_HEADER_SIZE + 8, seq);
+	memcpy(relay->data + FRAME_HEADER_SIZE + RELAY_HEADER_SIZE, data, len);
+	return relay;
+}
+
+/* cut a message of a client of this node so that its frame, head bytes
+ * before the message, fits into a relay, the clients of every node see
+ * the same message then */
+static size_t peer_msg_len(size_t head, size_t len)
+{
+	if (node_id == 0 || head + len <= RELAY_PAYLOAD_MAX) return len;
+	return RELAY_PAYLOAD_MAX - head;
+}
+
+/* queue a relay for every linked peer but the one it came from */
+static void peer_relay(struct sub_server *from, struct out_frame *relay)
+{
+	unsigned int i, idx;
+	idx = sub_server_set_read_lock(&peer_set);
+	struct sub_server_snapshot *snap = __atomic_load_n(&peer_set.snapshot, __ATOMIC_SEQ_CST);
+	for (i = 0; i < snap->size; i++)
+	{
+		if (snap->servers[i] != from) sub_server_enqueue(snap->servers[i], relay);
+	}
+	sub_server_set_read_unlock(&peer_set, idx);
+}
+
+/* relay a message of a client of this node to the cluster */
+void peer_publish(struct out_frame *frame)
+{
+	struct out_frame *relay;
+	if (__atomic_load_n(&peer_link_count, __ATOMIC_RELAXED) == 0) return;
+	relay = relay_frame_new(node_id, relay_boot, __sync_fetch_and_add(&relay_seq, 1), frame->data, frame->len);
+	if (relay == NULL) return;
+	peer_relay(NULL, relay);
+	out_frame_unref(relay);
+	__sync_fetch_and_add(&relay_count[RELAY_SENT], 1);
+}
+
+/* tell whether a relay was taken before and remember it if not,
+ * one too old to tell is taken as seen */
+static int relay_seen(unsigned int origin, unsigned int boot, unsigned long long seq)
+{
+	struct relay_origin *o;
+	unsigned long long s;
+	unsigned int i;
+	int seen = 1;
+	pthread_mutex_lock(&mutex_origins);
+	for (i = 0; i < relay_origin_count && relay_origins[i].node != origin; i++);
+	o = &relay_origins[i];
+	if (i == relay_origin_count)
+	{
+		if (i == ORIGINS_MAX) goto done;
+		relay_origin_count++;
+		o->node = origin;
+		o->boot = boot - 1;
+	}
+	/* the node started again, only relays of its last boot are told
+	 * apart, one of an earlier boot still on its way may come twice */
+	if (o->boot != boot)
+	{
+		o->boot = boot;
+		o->top = seq;
+		bzero(o->seen, sizeof(o->seen));
+	}
+	if (seq > o->top)
+	{
+		/* the window slides up to the new seq */
+		if (seq - o->top >= RELAY_WINDOW) bzero(o->seen, sizeof(o->seen));
+		else for (s = o->top + 1; s < seq; s++) o->seen[(s % RELAY_WINDOW) / 64] &= ~(1ULL << (s % 64));
+		o->top = seq;
+		o->seen[(seq % RELAY_WINDOW) / 64] &= ~(1ULL << (seq % 64));
+	}
+	else if (o->top - seq >= RELAY_WINDOW) goto done;
+	if (o->seen[(seq % RELAY_WINDOW) / 64] & (1ULL << (seq % 64))) goto done;
+	o->seen[(seq % RELAY_WINDOW) / 64] |= 1ULL << (seq % 64);
+	seen = 0;
+done:
+	pthread_mutex_unlock(&mutex_origins);
+	return seen;
+}
+#endif
+
+/* drop a client from every index, must be done before it is deleted */
+void sub_server_leave(struct sub_server *server)
+{
+	room_leave_all(server);
+	nick_index_remove(server);
+	roster_unfollow(server);
+#if defined(UNIX)
+	peer_unlink(server);
+#endif
+}
+
+/* GLOBAL variables */
+int server_fd;
+struct sub_server_list *server_list;
+
+/* send a frame to every client of the server */
+int server_broadcast(struct sub_server *from, struct out_frame *frame)
+{
+	metric_add(METRIC_BROADCASTS, 1);
+	if (__atomic_load_n(&deflate_clients, __ATOMIC_RELAXED) > 0) out_frame_deflate(frame);
+	history_push(&server_history, frame);
+#if defined(UNIX)
+	log_append(frame);
+	if (server_engine != ENGINE_THREAD)
+	{
+		/* the own shard directly, the other shards through their inbox */
+		int i;
+		for (i = 0; i < reactor_count; i++)
+		{
+			if (reactors[i].list == from->list)
+				sub_server_list_sendmsg_to_all(reactors[i].list, frame);
+			else
+				reactor_post(&reactors[i], frame);
+		}
+		return 0;
+	}
+#endif
+	return sub_server_list_sendmsg_to_all(server_list, frame);
+}
+
+#if defined(UNIX)
+/* take a relay from a linked peer, a new message goes to the clients
+ * of this node and on to the other peers, return -1 if it is malformed */
+int peer_deliver(struct sub_server *link, struct frame *f)
+{
+	struct frame inner, rest;
+	struct out_frame *frame, *relay;
+	char *name;
+	size_t name_len;
+	unsigned int origin, boot;
+	unsigned long long seq;
+	if (f->len < RELAY_HEADER_SIZE + FRAME_HEADER_SIZE) return -1;
+	inner.cmd = (unsigned char)f->payload[RELAY_HEADER_SIZE];
+	inner.flags = 0;
+	inner.payload = f->payload + RELAY_HEADER_SIZE + FRAME_HEADER_SIZE;
+	inner.len = frame_get_u16(f->payload + RELAY_HEADER_SIZE + 2);
+	if (inner.len != f->len - RELAY_HEADER_SIZE - FRAME_HEADER_SIZE) return -1;
+	if (inner.cmd == CMD_RECV_ROOM_MSG)
+	{
+		if (frame_decode_name(&inner, &name, &name_len, &rest) == -1) return -1;
+	}
+	else if (inner.cmd != CMD_RECV_MSG) return -1;
+	origin = frame_get_u32(f->payload);
+	boot = frame_get_u32(f->payload + 4);
+	seq = frame_get_u64(f->payload + 8);
+	/* an own message come around, or one taken on another path */
+	if (origin == node_id || relay_seen(origin, boot, seq))
+	{
+		__sync_fetch_and_add(&relay_count[RELAY_SEEN], 1);
+		return 0;
+	}
+	__sync_fetch_and_add(&relay_count[RELAY_TAKEN], 1);
+	frame = out_frame_new(FRAME_HEADER_SIZE + inner.len);
+	if (frame == NULL) return 0;
+	frame->len = FRAME_HEADER_SIZE + inner.len;
+	frame_encode_header(frame->data, inner.cmd, 0, inner.len);
+	memcpy(frame->data + FRAME_HEADER_SIZE, inner.payload, inner.len);
+	frame->stamp = monotonic_ns();
+	frame->pending = 1;
+	if (inner.cmd == CMD_RECV_MSG) server_broadcast(link, frame);
+	else room_relay(name, name_len, frame);
+	relay = relay_frame_new(origin, boot, seq, frame->data, frame->len);
+	if (relay != NULL)
+	{
+		peer_relay(link, relay);
+		out_frame_unref(relay);
+	}
+	out_frame_release(frame);
+	out_frame_unref(frame);
+	return 0;
+}
+#endif
+
+/* clean work before exit server program */
+int clean(void)
+{
+	/* the roster thread must not send to them any more */
+	roster_lock();
+	__atomic_store_n(&roster_count, 0, __ATOMIC_SEQ_CST);
+	roster_unlock();
+	/* close sub servers */
+	sub_server_list_destroy(server_list);
+	/* close mini shell */
+#if defined(UNIX)
+	pthread_cancel(thd_shell);
+#elif defined(WINDOWS)
+	TerminateThread(&thd_shell, 0);
+#endif
+	return 0;
+}
+
+/* fatal error occurred, 
+ * print the error message and exit server program */
+void fatal_error(char *msg)
+{
+	printf("Error : %s\n", msg);
+	clean();
+	exit(1);
+}
+
+/* only the owner of the client changes its nickname, which is unique
+ * among registered clients, return -1 if it is taken */
+int set_nickname(struct sub_server *server, char *nickname, unsigned char nickname_len)
+{
+	if (server->nick_indexed && server->nickname_len == nickname_len && !memcmp(server->nickname, nickname, nickname_len)) return 0;
+	return nick_index_rename(server, nickname, nickname_len);
+}
+
+/* tell a client why a command failed */
+int sub_server_reply_error(struct sub_server *server, unsigned char cmd, const char *reason)
+{
+	struct out_frame *frame = sub_server_error_frame(cmd, reason);
+	if (frame == NULL) return -1;
+	sub_server_enqueue(server, frame);
+	out_frame_unref(frame);
+	return 0;
+}
+
+/* compression is agreed once and can't be turned off again,
+ * what was queued before goes out as it is */
+void sub_server_agree_deflate(struct sub_server *server)
+{
+	if (server->deflate) return;
+	__sync_fetch_and_add(&deflate_clients, 1);
+	sub_server_out_lock(server);
+	server->deflate = 1;
+	server->out_plain = server->out_count;
+	sub_server_out_unlock(server);
+}
+
+/* handle one frame received from a client */
+int sub_server_process(struct sub_server *server, struct frame *f)
+{
+	struct out_frame *frame;
+	struct room *room;
+	struct frame msg;
+	char *name; /* room or nickname */
+	size_t name_len;
+	unsigned int version, caps;
+#if defined(UNIX)
+	struct log_cursor *cursor;
+	const char *reason;
+#endif
+	metric_add(METRIC_MSGS_IN, 1);
+	metric_add(METRIC_BYTES_IN, FRAME_HEADER_SIZE + f->len);
+	switch (f->cmd)
+	{
+		case CMD_NULL:
+			/* do nothing */
+			break;
+		case CMD_SET_NICKNAME:
+			if (f->len > 0) /* length check */
+			{
+				int registered = server->nick_indexed;
+				if (set_nickname(server, f->payload, f->len > NICKNAME_LEN_MAX ? NICKNAME_LEN_MAX : f->len) == -1)
+				{
+					sub_server_reply_error(server, f->cmd, "nickname is taken");
+				}
+				/* a client joining the chat catches up first */
+				else if (!registered)
+				{
+					history_replay(&server_history, server);
+				}
+			}
+			break;
+		case CMD_SEND_MSG:
+			msg = *f;
+#if defined(UNIX)
+			msg.len = peer_msg_len(1 + server->nickname_len + 2, msg.len);
+#endif
+			/* encoded once, every client gets a reference */
+			frame = out_frame_new(frame_recv_msg_size(server->nickname_len, msg.len));
+			if (frame == NULL) break;
+			frame->len = frame_encode_recv_msg(frame->data, server->nickname, server->nickname_len, msg.payload, msg.len);
+			/* timed until every queue it goes to is done with it,
+			 * held meanwhile so early sends don't finish the clock */
+			frame->stamp = monotonic_ns();
+			frame->pending = 1;
+			/* send received message to all clients */
+			server_broadcast(server, frame);
+#if defined(UNIX)
+			if (node_id != 0) peer_publish(frame);
+#endif
+			out_frame_release(frame);
+			out_frame_unref(frame);
+			break;
+		case CMD_JOIN_ROOM:
+			if (sub_server_room(server, f->payload, f->len) != NULL) break;
+			/* a new member catches up with the room */
+			if (room_join(server, f->payload, f->len) == 0)
+			{
+				history_replay(&server->rooms[server->room_count - 1]->history, server);
+			}
+			break;
+		case CMD_LEAVE_ROOM:
+			room = sub_server_room(server, f->payload, f->len);
+			/* out of memory keeps the client in the room, it may ask again */
+			if (room != NULL) room_leave(server, room);
+			break;
+		case CMD_SEND_ROOM_MSG:
+			if (frame_decode_name(f, &name, &name_len, &msg) == -1) break;
+			/* only members talk in a room */
+			room = sub_server_room(server, name, name_len);
+			if (room == NULL) break;
+#if defined(UNIX)
+			msg.len = peer_msg_len(1 + room->name_len + 1 + server->nickname_len + 2, msg.len);
+#endif
+			frame = out_frame_new(frame_room_msg_size(room->name_len, server->nickname_len, msg.len));
+			if (frame == NULL) break;
+			frame->len = frame_encode_room_msg(frame->data, room->name, room->name_len, server->nickname, server->nickname_len, msg.payload, msg.len);
+			frame->stamp = monotonic_ns();
+			frame->pending = 1;
+			room_sendmsg(room, frame);
+#if defined(UNIX)
+			if (node_id != 0) peer_publish(frame);
+#endif
+			out_frame_release(frame);
+			out_frame_unref(frame);
+			break;
+		case CMD_SEND_DM:
+			if (frame_decode_name(f, &name, &name_len, &msg) == -1) break;
+			frame = out_frame_new(frame_recv_msg_size(server->nickname_len, msg.len));
+			if (frame == NULL) break;
+			frame->len = frame_encode_msg(frame->data, CMD_RECV_DM, server->nickname, server->nickname_len, msg.payload, msg.len);
+			/* one lookup and one enqueue */
+			if (nick_index_sendmsg(name, name_len, frame) == -1)
+			{
+				sub_server_reply_error(server, f->cmd, "no such nickname");
+			}
+			out_frame_unref(frame);
+			break;
+		case CMD_HISTORY:
+			if (f->len == 0)
+			{
+				history_replay(&server_history, server);
+				break;
+			}
+			room = sub_server_room(server, f->payload, f->len);
+			if (room == NULL)
+			{
+				sub_server_reply_error(server, f->cmd, "not in the room");
+				break;
+			}
+			history_replay(&room->history, server);
+			break;
+		case CMD_LOG_RANGE:
+#if defined(UNIX)
+			if (message_log == NULL || f->len != 17)
+			{
+				sub_server_reply_error(server, f->cmd, message_log == NULL ? "no message log" : "malformed range");
+				break;
+			}
+			cursor = log_cursor_new(f->payload[0] ? LOG_KEY_TIME : LOG_KEY_SEQ, frame_get_u64(f->payload + 1), frame_get_u64(f->payload + 9));
+			if (cursor == NULL) break;
+			/* streamed as the queue drains, one range at a time */
+			sub_server_out_lock(server);
+			if (server->range != NULL || server->closing)
+			{
+				sub_server_out_unlock(server);
+				log_cursor_free(cursor);
+				sub_server_reply_error(server, f->cmd, "a range is being sent");
+				break;
+			}
+			server->range = cursor;
+			log_cursor_fill(server);
+			if (sub_server_output(server) == -1) sub_server_kick(server);
+			sub_server_out_unlock(server);
+#elif defined(WINDOWS)
+			sub_server_reply_error(server, f->cmd, "no message log");
+#endif
+			break;
+		case CMD_SEARCH:
+#if defined(UNIX)
+			if (!search_enabled)
+			{
+				sub_server_reply_error(server, f->cmd, "search is off");
+				break;
+			}
+			if ((reason = search_submit(server, f->payload, f->len)) != NULL)
+			{
+				sub_server_reply_error(server, f->cmd, reason);
+			}
+#elif defined(WINDOWS)
+			sub_server_reply_error(server, f->cmd, "search is off");
+#endif
+			break;
+		case CMD_COMPRESS:
+			if (f->len == 1 && f->payload[0] == COMPRESS_DEFLATE) sub_server_agree_deflate(server);
+			frame = out_frame_new(FRAME_HEADER_SIZE + 1);
+			if (frame == NULL) break;
+			frame_encode_header(frame->data, CMD_COMPRESS, 0, 1);
+			frame->data[FRAME_HEADER_SIZE] = server->deflate ? COMPRESS_DEFLATE : COMPRESS_NONE;
+			sub_server_enqueue(server, frame);
+			out_frame_unref(frame);
+			break;
+		case CMD_HELLO:
+			if (f->len < HELLO_SIZE)
+			{
+				sub_server_reply_error(server, f->cmd, "malformed hello");
+				break;
+			}
+			/* capabilities came with version 2, whatever the client
+			 * knows beyond that is left out */
+			version = (unsigned char)f->payload[0] < PROTOCOL_VERSION ? (unsigned char)f->payload[0] : PROTOCOL_VERSION;
+			caps = version >= 2 ? frame_get_u32(f->payload + 1) : 0;
+			if (caps & CAP_DEFLATE) sub_server_agree_deflate(server);
+			if (caps & CAP_BATCH) sub_server_agree_batch(server);
+			frame = out_frame_new(FRAME_HEADER_SIZE + HELLO_SIZE);
+			if (frame == NULL) break;
+			frame_encode_header(frame->data, CMD_HELLO, 0, HELLO_SIZE);
+			frame->data[FRAME_HEADER_SIZE] = (char)version;
+			frame_put_u32(frame->data + FRAME_HEADER_SIZE + 1, (server->deflate ? CAP_DEFLATE : 0) | (server->batch ? CAP_BATCH : 0));
+			sub_server_enqueue(server, frame);
+			out_frame_unref(frame);
+			break;
+		case CMD_ROSTER:
+			roster_follow(server);
+			break;
+#if defined(UNIX)
+		case CMD_PEER_HELLO:
+			if (node_id == 0 || !peer_allowed(server))
+			{
+				sub_server_reply_error(server, f->cmd, node_id == 0 ? "not in a cluster" : "not a peer");
+				break;
+			}
+			if (f->len != PEER_HELLO_SIZE || frame_get_u32(f->payload) == 0 || frame_get_u32(f->payload) == node_id)
+			{
+				sub_server_reply_error(server, f->cmd, "bad node id");
+				break;
+			}
+			if (server->peer || peer_link(server, frame_get_u32(f->payload)) == -1) break;
+			/* the side connecting said hello first */
+			if (server->peer_out != NULL) break;
+			frame = out_frame_new(FRAME_HEADER_SIZE + PEER_HELLO_SIZE);
+			if (frame == NULL) break;
+			frame_encode_header(frame->data, CMD_PEER_HELLO, 0, PEER_HELLO_SIZE);
+			frame_put_u32(frame->data + FRAME_HEADER_SIZE, node_id);
+			sub_server_enqueue(server, frame);
+			out_frame_unref(frame);
+			break;
+		case CMD_PEER_RELAY:
+			/* only from linked peers */
+			if (server->peer) peer_deliver(server, f);
+			break;
+#endif
+		default:
+			/* not supported */
+			break;
+	}
+	return 0;
+}
+
+/* handle every complete frame buffered for a client, charging each to
+ * its rate limit, under the delay policy frames over the limit stay
+ * buffered and throttled_until says when they may go on */
+void sub_server_drain(struct sub_server *server)
+{
+	struct frame f;
+	unsigned long long now = 0;
+	int wait, limited = rate_limit_msgs > 0 || rate_limit_bytes > 0;
+	unsigned int scale = 1;
+	int was_throttled = server->throttled_until > 0;
+	if (limited) now = monotonic_ms();
+	server->throttled_until = 0;
+	/* nothing more of a kicked client goes on */
+	while (!server->closing && frame_decoder_peek(&server->decoder, &f))
+	{
+#if defined(UNIX)
+		/* relays of peers are the messages of all their clients,
+		 * a hello makes a client a peer in between */
+		if (server->peer) scale = PEER_RATE_SCALE;
+#endif
+		if (limited && (wait = token_bucket_take(&server->bucket, FRAME_HEADER_SIZE + f.len, now, scale)) > 0)
+		{
+			if (flood_policy == FLOOD_DELAY)
+			{
+				if (!was_throttled) __sync_fetch_and_add(&flood_count[FLOOD_DELAY], 1);
+				server->throttled_until = now + wait;
+				return;
+			}
+			frame_decoder_skip(&server->decoder, &f);
+			__sync_fetch_and_add(&flood_count[flood_policy], 1);
+			if (flood_policy == FLOOD_DISCONNECT)
+			{
+				sub_server_out_lock(server);
+				sub_server_kick(server);
+				sub_server_out_unlock(server);
+				return;
+			}
+			continue;
+		}
+		frame_decoder_skip(&server->decoder, &f);
+		sub_server_process(server, &f);
+	}
+}
+
+/* read once from a client and handle every frame completed by it,
+ * return what recv returned */
+int sub_server_recv(struct sub_server *server)
+{
+	size_t room;
+	int recv_len;
+	char *space = frame_decoder_space(&server->decoder, &room);
+	if (space == NULL) return -1;
+	recv_len = recv(server->client_fd, space, room, 0);
+	if (recv_len <= 0) return recv_len;
+	frame_decoder_commit(&server->decoder, recv_len);
+	/* a read may carry many frames or just a piece of one */
+	sub_server_drain(server);
+	return recv_len;
+}
+
+/* handle data some other way received from a client,
+ * return -1 if out of memory */
+int sub_server_feed(struct sub_server *server, const char *data, size_t len)
+{
+	size_t room, n;
+	char *space;
+	while (len > 0)
+	{
+		space = frame_decoder_space(&server->decoder, &room);
+		if (space == NULL) return -1;
+		n = len < room ? len : room;
+		memcpy(space, data, n);
+		frame_decoder_commit(&server->decoder, n);
+		data += n;
+		len -= n;
+		sub_server_drain(server);
+	}
+	return 0;
+}
+
+#define WAIT_READ 1
+#define WAIT_WRITE 2
+
+/* wait until the client socket is readable, or writable if there is
+ * queued output, return WAIT_* bits, 0 on timeout, -1 on error */
+int sub_server_wait(struct sub_server *server, int want_write, int timeout_ms)
+{
+	int ready = 0;
+#if defined(UNIX)
+	struct pollfd pfd;
+	pfd.fd = server->client_fd;
+	pfd.events = POLLIN | (want_write ? POLLOUT : 0);
+	pfd.revents = 0;
+	if (poll(&pfd, 1, timeout_ms) == -1)
+	{
+		return errno == EINTR ? 0 : -1;
+	}
+	/* errors and hang ups are reported by recv */
+	if (pfd.revents & (POLLIN | POLLERR | POLLHUP)) ready |= WAIT_READ;
+	if (pfd.revents & POLLOUT) ready |= WAIT_WRITE;
+#elif defined(WINDOWS)
+	fd_set rset, wset;
+	struct timeval tm;
+	FD_ZERO(&rset);
+	FD_ZERO(&wset);
+	FD_SET(server->client_fd, &rset);
+	if (want_write) FD_SET(server->client_fd, &wset);
+	tm.tv_sec = timeout_ms / 1000;
+	tm.tv_usec = (timeout_ms % 1000) * 1000;
+	if (select(server->client_fd + 1, &rset, &wset, NULL, &tm) == -1) return -1;
+	if (FD_ISSET(server->client_fd, &rset)) ready |= WAIT_READ;
+	if (FD_ISSET(server->client_fd, &wset)) ready |= WAIT_WRITE;
+#endif
+	return ready;
+}
+
+#if defined(UNIX)
+/* hot restart
+ * a new server takes the listening sockets and every client over from
+ * a running one, first every thread of the engine parks where it
+ * touches no socket, the threads count themselves in and out so the
+ * freezer knows when they all have */
+
+#define TAKEOVER_TIMEOUT_S 10
+
+int takeover_freezing; /* engine threads park at their next safe point */
+unsigned int takeover_threads; /* engine threads running */
+unsigned int takeover_parked;
+pthread_mutex_t mutex_takeover = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_takeover = PTHREAD_COND_INITIALIZER;
+#define takeover_frozen() __atomic_load_n(&takeover_freezing, __ATOMIC_ACQUIRE)
+
+void takeover_enter(void)
+{
+	pthread_mutex_lock(&mutex_takeover);
+	takeover_threads++;
+	pthread_mutex_unlock(&mutex_takeover);
+}
+
+void takeover_exit(void)
+{
+	pthread_mutex_lock(&mutex_takeover);
+	takeover_threads--;
+	pthread_cond_broadcast(&cond_takeover);
+	pthread_mutex_unlock(&mutex_takeover);
+}
+
+/* wait until thawed, a hand over that went through never thaws */
+void takeover_park(void)
+{
+	pthread_mutex_lock(&mutex_takeover);
+	takeover_parked++;
+	pthread_cond_broadcast(&cond_takeover);
+	while (takeover_freezing) pthread_cond_wait(&cond_takeover, &mutex_takeover);
+	takeover_parked--;
+	pthread_mutex_unlock(&mutex_takeover);
+}
+
+/* accept on a listening socket a hot restart may take away, nothing is
+ * accepted while frozen, return the client or -1 */
+int takeover_accept(int listen_fd, struct sockaddr *addr, socklen_t *addr_len)
+{
+	struct pollfd pfd;
+	if (takeover_frozen()) takeover_park();
+	pfd.fd = listen_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, OUT_RETRY_MS) <= 0 || takeover_frozen()) return -1;
+	return accept(listen_fd, addr, addr_len);
+}
+#endif
+
+/* listening sockets a hot restart handed over, used in this order,
+ * there are none on WINDOWS */
+#define TAKEOVER_LISTENERS_MAX 256
+int takeover_listen_fds[TAKEOVER_LISTENERS_MAX];
+unsigned int takeover_listen_count;
+
+/* sub server working threading */
+void *sub_server_start(void *data)
+{
+	/* server was added to server list before the thread started */
+	struct sub_server *server = (struct sub_server *)data;
+	/* get thread id */
+#if defined(UNIX)
+	server->thd = pthread_self();
+	server->thd_id = pthread_self();
+	pthread_detach(server->thd);
+#elif defined(WINDOWS)
+	server->thd_id = GetCurrentThreadId();
+#endif
+	int recv_len, ready;
+#if defined(UNIX)
+	takeover_enter();
+#endif
+	/* frames a hot restart handed over with the client */
+	sub_server_drain(server);
+	/* the socket is non-blocking, so a broadcast from another thread
+	 * never blocks on it, whatever it could not send is left in the
+	 * outbound queue and drained here */
+	/* message loop */
+	while (!server->closing)
+	{
+#if defined(UNIX)
+		if (takeover_frozen()) takeover_park();
+#endif
+		ready = sub_server_wait(server, server->out_count > 0, OUT_RETRY_MS);
+		if (ready == -1) break;
+		if (ready & WAIT_READ)
+		{
+			/* receive message */
+			recv_len = sub_server_recv(server);
+			if (recv_len == 0)
+			{
+				break;
+			}
+			if (recv_len < 0 && errno != EINTR && !socket_would_block())
+			{
+				break;
+			}
+			/* over the rate limit, the client is not read meanwhile */
+			while (server->throttled_until > 0 && !server->closing)
+			{
+				unsigned long long now = monotonic_ms();
+				if (server->throttled_until > now)
+				{
+#if defined(UNIX)
+					usleep((server->throttled_until - now) * 1000);
+#elif defined(WINDOWS)
+					Sleep((DWORD)(server->throttled_until - now));
+#endif
+				}
+				sub_server_drain(server);
+			}
+		}
+		if (server->out_count > 0 && sub_server_flush(server) == -1)
+		{
+			break;
+		}
+	}
+	/* to delete this server */
+	sub_server_leave(server);
+	sub_server_list_delete(server_list, server);
+	metrics_release();
+	deflate_release();
+#if defined(UNIX)
+	takeover_exit();
+#endif
+	return NULL;
+}
+
+/* flush ticks of the thread engine */
+#if defined(UNIX)
+void *flusher_start(void *data)
+#elif defined(WINDOWS)
+DWORD WINAPI flusher_start(void *data)
+#endif
+{
+	int interval = RATE_CHECK_MS;
+#if defined(UNIX)
+	takeover_enter();
+#endif
+	while (1)
+	{
+#if defined(UNIX)
+		usleep(interval * 1000);
+		if (takeover_frozen()) takeover_park();
+#elif defined(WINDOWS)
+		Sleep(interval);
+#endif
+		interval = sub_server_list_tick(server_list, interval);
+	}
+#if defined(UNIX)
+	return NULL;
+#elif defined(WINDOWS)
+	return 0;
+#endif
+}
+
+#if defined(UNIX)
+/* epoll engine
+ * every reactor thread owns one SO_REUSEPORT listening socket, one
+ * epoll instance and one shard of the clients, all sockets are
+ * non-blocking and registered edge-triggered */
+
+#define EPOLL_EVENTS_MAX 256
+
+/* add an accepted connection to the shard of reactor,
+ * return NULL and close it if out of memory */
+struct sub_server *reactor_add_client(struct reactor *r, int client_fd, struct sockaddr_in *cliaddr)
+{
+	/* same defaults as a threading sub server */
+	struct sub_server server;
+	server.client_fd = client_fd;
+	strcpy(server.nickname, "guest");
+	server.nickname_len = strlen("guest");
+	strncpy(server.client_ip_addr, inet_ntoa(cliaddr->sin_addr), 16);
+	server.thd = r->thd;
+	server.thd_id = r->thd;
+	struct sub_server *node = sub_server_list_push_back(r->list, &server);
+	if (node == NULL)
+	{
+		close(client_fd);
+		return NULL;
+	}
+	node->reactor = r;
+	return node;
+}
+
+/* add a connection whose address is not at hand */
+struct sub_server *reactor_add_socket(struct reactor *r, int client_fd)
+{
+	struct sockaddr_in cliaddr;
+	socklen_t sin_size = sizeof(struct sockaddr_in);
+	bzero(&cliaddr, sizeof(cliaddr));
+	getpeername(client_fd, (struct sockaddr *)&cliaddr, &sin_size);
+	return reactor_add_client(r, client_fd, &cliaddr);
+}
+
+/* accept every pending connection into the shard of reactor */
+int reactor_accept(struct reactor *r)
+{
+	int client_fd;
+	struct sockaddr_in cliaddr;
+	socklen_t sin_size;
+	struct epoll_event ev;
+	struct sub_server *node;
+	while (1)
+	{
+		sin_size = sizeof(struct sockaddr_in);
+		client_fd = accept(r->listen_fd, (struct sockaddr *)&cliaddr, &sin_size);
+		if (client_fd == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			/* EAGAIN: backlog drained, EMFILE etc: retry on next event */
+			break;
+		}
+		if (set_nonblocking(client_fd) == -1)
+		{
+			close(client_fd);
+			continue;
+		}
+		if ((node = reactor_add_client(r, client_fd, &cliaddr)) == NULL) continue;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = node;
+		if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, client_fd, &ev) == -1)
+		{
+			sub_server_list_delete(r->list, node);
+		}
+	}
+	return 0;
+}
+
+/* take over a socket another thread posted */
+void reactor_take(struct reactor *r, int client_fd, struct peer *peer)
+{
+	struct epoll_event ev;
+	struct sub_server *node = reactor_add_socket(r, client_fd);
+	if (node == NULL)
+	{
+		peer_lost(peer);
+		return;
+	}
+	node->peer_out = peer;
+	/* data already there is reported right away */
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = node;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, client_fd, &ev) == -1)
+	{
+		sub_server_list_delete(r->list, node);
+		peer_lost(peer);
+	}
+}
+
+/* run the flush tick of a reactor if it is due, also checked while a
+ * busy client is read, so a burst can't hold off the switch to
+ * throughput mode, return ms until the next tick or -1 if never */
+int reactor_tick(struct reactor *r)
+{
+	uint64_t now;
+	if (flush_window_ms == 0) return -1;
+	now = monotonic_ms();
+	if (now >= r->next_tick)
+	{
+		r->next_tick = now + sub_server_list_tick(r->list, (int)(now - r->last_tick));
+		r->last_tick = now;
+	}
+	return (int)(r->next_tick - now);
+}
+
+/* stop reading a client over its rate limit for now */
+void reactor_throttle(struct reactor *r, struct sub_server *server)
+{
+	if (server->throttled) return;
+	server->throttled = 1;
+	server->throttle_next = r->throttled_head;
+	r->throttled_head = server;
+}
+
+void reactor_unthrottle(struct reactor *r, struct sub_server *server)
+{
+	struct sub_server **p;
+	if (!server->throttled) return;
+	for (p = &r->throttled_head; *p != server; p = &(*p)->throttle_next);
+	*p = server->throttle_next;
+	server->throttled = 0;
+}
+
+/* take a parked client whose held frames went on, NULL if none */
+struct sub_server *reactor_resumable(struct reactor *r)
+{
+	unsigned long long now = monotonic_ms();
+	struct sub_server **p, *server;
+	for (p = &r->throttled_head; (server = *p) != NULL; p = &server->throttle_next)
+	{
+		if (server->throttled_until > now) continue;
+		sub_server_drain(server);
+		if (server->throttled_until > 0) continue;
+		*p = server->throttle_next;
+		server->throttled = 0;
+		return server;
+	}
+	return NULL;
+}
+
+/* ms until the reactor has to run again, -1 if only events wake it */
+int reactor_timeout(struct reactor *r)
+{
+	int timeout = reactor_tick(r), wait;
+	unsigned long long now;
+	struct sub_server *server;
+	if (r->throttled_head == NULL) return timeout;
+	now = monotonic_ms();
+	for (server = r->throttled_head; server != NULL; server = server->throttle_next)
+	{
+		wait = server->throttled_until > now ? (int)(server->throttled_until - now) : 0;
+		if (timeout == -1 || wait < timeout) timeout = wait;
+	}
+	return timeout;
+}
+
+/* read until the socket is drained,
+ * return -1 if the client should be closed */
+int reactor_read(struct reactor *r, struct sub_server *server)
+{
+	int recv_len;
+	while (!server->throttled)
+	{
+		reactor_tick(r);
+		recv_len = sub_server_recv(server);
+		if (recv_len == 0) return -1;
+		/* read again once reactor_resumable gives it back */
+		if (server->throttled_until > 0) reactor_throttle(r, server);
+		if (recv_len == -1)
+		{
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* fan out every message other reactors posted to this one */
+int reactor_drain_inbox(struct reactor *r)
+{
+	uint64_t count;
+	struct reactor_msg *msg, *next;
+	/* reset the eventfd before taking the inbox,
+	 * a later post will raise a new edge */
+	while (read(r->event_fd, &count, sizeof(count)) == -1 && errno == EINTR);
+	pthread_mutex_lock(&r->mutex_inbox);
+	msg = r->inbox_head;
+	r->inbox_head = r->inbox_tail = NULL;
+	pthread_mutex_unlock(&r->mutex_inbox);
+	while (msg != NULL)
+	{
+		next = msg->next;
+		if (msg->frame == NULL)
+		{
+			reactor_take(r, msg->fd, msg->peer);
+			free(msg);
+			msg = next;
+			continue;
+		}
+		sub_server_list_sendmsg_to_all(r->list, msg->frame);
+		out_frame_release(msg->frame);
+		out_frame_unref(msg->frame);
+		free(msg);
+		msg = next;
+	}
+	return 0;
+}
+
+/* reactor working threading, never returns */
+void *reactor_start(void *data)
+{
+	struct reactor *r = (struct reactor *)data;
+	int nfds, i;
+	struct epoll_event ev, events[EPOLL_EVENTS_MAX];
+	struct sub_server *server;
+	current_reactor = r;
+	takeover_enter();
+	/* listening socket and inbox are tagged with their address,
+	 * after a hot restart a reactor may have no listening socket */
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &r->listen_fd;
+	if (r->listen_fd != -1 && epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listen_fd, &ev) == -1)
+	{
+		fatal_error("register server socket failed");
+	}
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &r->event_fd;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->event_fd, &ev) == -1)
+	{
+		fatal_error("register reactor inbox failed");
+	}
+	r->last_tick = monotonic_ms();
+	r->next_tick = r->last_tick + RATE_CHECK_MS;
+	while (1)
+	{
+		/* a hot restart wakes the reactor through its inbox */
+		if (takeover_frozen()) takeover_park();
+		/* sleep no longer than until the next flush tick */
+		nfds = epoll_wait(r->epfd, events, EPOLL_EVENTS_MAX, reactor_timeout(r));
+		if (nfds == -1)
+		{
+			if (errno == EINTR) continue;
+			fatal_error("epoll wait failed");
+		}
+		for (i = 0; i < nfds; i++)
+		{
+			if (events[i].data.ptr == &r->listen_fd)
+			{
+				reactor_accept(r);
+				continue;
+			}
+			if (events[i].data.ptr == &r->event_fd)
+			{
+				reactor_drain_inbox(r);
+				continue;
+			}
+			server = (struct sub_server *)events[i].data.ptr;
+			int broken = 0;
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) broken = 1;
+			if (!broken && (events[i].events & EPOLLIN))
+			{
+				if (reactor_read(r, server) == -1) broken = 1;
+			}
+			if (!broken && (events[i].events & EPOLLRDHUP)) broken = 1;
+			if (!broken && (events[i].events & EPOLLOUT) && server->out_count > 0)
+			{
+				if (sub_server_flush(server) == -1) broken = 1;
+			}
+			/* closing fd also removes it from epoll */
+			if (broken)
+			{
+				reactor_unthrottle(r, server);
+				sub_server_leave(server);
+				sub_server_list_delete(r->list, server);
+			}
+		}
+		/* edge-triggered, a resumed client is read until drained */
+		while ((server = reactor_resumable(r)) != NULL)
+		{
+			if (reactor_read(r, server) == -1)
+			{
+				sub_server_leave(server);
+				sub_server_list_delete(r->list, server);
+			}
+		}
+	}
+	return NULL;
+}
+
+/* io_uring engine
+ * same reactors and shards as the epoll engine, but every socket
+ * operation is a completion: a multishot accept per listening socket,
+ * a multishot receive per client into buffers the reactor provides,
+ * and queued output leaves as a chain of linked sendmsg requests,
+ * one chain in flight per client, all through raw system calls */
+
+#define URING_ENTRIES 4096
+#define URING_BUFS 512 /* provided receive buffers, a power of two */
+#define URING_BUF_SIZE 4096
+#define URING_BGID 0
+#define URING_SEND_CHAIN 4 /* linked sendmsg of OUT_IOV_MAX frames each */
+
+/* low bits of user_data tell what completed */
+#define URING_TAG_ACCEPT 1
+#define URING_TAG_EVENT 2
+#define URING_TAG_RECV 3
+#define URING_TAG_SEND 4
+#define URING_TAG_MASK 7
+
+/* operations a client has in flight */
+#define URING_RECV 1
+#define URING_SEND 2
+
+/* send chain of a client, stays put until every link completed */
+struct uring_send
+{
+	struct msghdr mh[URING_SEND_CHAIN];
+	struct iovec iov[URING_SEND_CHAIN * OUT_IOV_MAX];
+	size_t len[URING_SEND_CHAIN];
+	int links;
+	int done;
+	int error;
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* check the kernel has everything the engine needs,
+ * IORING_OP_SEND_ZC came with multishot receive in 6.0 */
+int uring_probe(void)
+{
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	int fd, ret = -1;
+	bzero(&p, sizeof(p));
+	if ((fd = uring_setup(4, &p)) == -1) return -1;
+	probe = (struct io_uring_probe *)calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+	if (probe != NULL
+			&& (p.features & IORING_FEAT_SINGLE_MMAP)
+			&& (p.features & IORING_FEAT_EXT_ARG)
+			&& uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0
+			&& probe->ops_len > IORING_OP_SEND_ZC
+			&& (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED))
+	{
+		ret = 0;
+	}
+	free(probe);
+	close(fd);
+	return ret;
+}
+
+/* hand a receive buffer (back) to the kernel */
+static void uring_buf_return(struct uring *ring, unsigned short bid)
+{
+	struct io_uring_buf *buf = &ring->bufs->bufs[ring->buf_tail & (URING_BUFS - 1)];
+	buf->addr = (unsigned long)(ring->buf_pool + (size_t)bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	ring->buf_tail++;
+	__atomic_store_n(&ring->bufs->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* map the rings and register the receive buffers, return -1 on error */
+int uring_init(struct uring *ring)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	size_t ring_size;
+	char *ptr;
+	unsigned int i;
+	bzero(ring, sizeof(struct uring));
+	bzero(&p, sizeof(p));
+	/* multishot requests complete many times per submission */
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_ENTRIES * 4;
+	if ((ring->fd = uring_setup(URING_ENTRIES, &p)) == -1) return -1;
+	/* submission and completion rings share one mapping */
+	ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > ring_size)
+	{
+		ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	}
+	ptr = (char *)mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED) return -1;
+	ring->sq_head = (unsigned int *)(ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)(ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(ptr + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_head = (unsigned int *)(ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)(ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) return -1;
+	/* entries are used in ring order, slot i always holds sqe i */
+	for (i = 0; i < p.sq_entries; i++) ring->sq_array[i] = i;
+	ring->sq_local_tail = *ring->sq_tail;
+	/* receive buffers, the ring itself must be page aligned */
+	ring->bufs = (struct io_uring_buf_ring *)mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->bufs == MAP_FAILED) return -1;
+	if ((ring->buf_pool = (char *)malloc((size_t)URING_BUFS * URING_BUF_SIZE)) == NULL) return -1;
+	bzero(&reg, sizeof(reg));
+	reg.ring_addr = (unsigned long)ring->bufs;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) return -1;
+	for (i = 0; i < URING_BUFS; i++) uring_buf_return(ring, i);
+	return 0;
+}
+
+/* publish prepared submissions and wait for wait_nr completions, no
+ * longer than timeout_ms unless it is -1, return -1 on error */
+static int uring_submit(struct uring *ring, unsigned int wait_nr, int timeout_ms)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int to_submit, flags = IORING_ENTER_EXT_ARG;
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (to_submit == 0 && wait_nr == 0) return 0;
+	bzero(&arg, sizeof(arg));
+	if (wait_nr > 0)
+	{
+		flags |= IORING_ENTER_GETEVENTS;
+		if (timeout_ms >= 0)
+		{
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+			arg.ts = (unsigned long)&ts;
+		}
+	}
+	if (uring_enter(ring->fd, to_submit, wait_nr, flags, &arg, sizeof(arg)) == -1)
+	{
+		/* timed out, interrupted or completions to reap first */
+		if (errno == ETIME || errno == EINTR || errno == EBUSY) return 0;
+		return -1;
+	}
+	return 0;
+}
+
+/* make room for count submissions in a row, a link chain must not
+ * be split by a submit */
+static void uring_reserve(struct uring *ring, unsigned int count)
+{
+	while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count > ring->sq_entries)
+	{
+		if (uring_submit(ring, 0, -1) == -1) fatal_error("io_uring submit failed");
+	}
+}
+
+/* next submission entry, cleared */
+static struct io_uring_sqe *uring_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	uring_reserve(ring, 1);
+	sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+	ring->sq_local_tail++;
+	bzero(sqe, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+static void uring_arm_accept(struct reactor *r)
+{
+	struct io_uring_sqe *sqe;
+	if (r->quiescing || r->listen_fd == -1) return;
+	sqe = uring_sqe(&r->ring);
+	r->accepting = 1;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = r->listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = (unsigned long)r | URING_TAG_ACCEPT;
+}
+
+/* posts of other threads wake the ring through the eventfd */
+static void uring_arm_event(struct reactor *r)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&r->ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = r->event_fd;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = (unsigned long)r | URING_TAG_EVENT;
+}
+
+static void uring_arm_recv(struct reactor *r, struct sub_server *server)
+{
+	struct io_uring_sqe *sqe;
+	/* the previous receive ended, uring_thaw arms it again */
+	if (r->quiescing)
+	{
+		server->uring_inflight &= ~URING_RECV;
+		return;
+	}
+	sqe = uring_sqe(&r->ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = server->client_fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = (unsigned long)server | URING_TAG_RECV;
+	server->uring_inflight |= URING_RECV;
+}
+
+/* stop the multishot receive of a client, its last completion
+ * comes with -ECANCELED, the cancel itself is not tagged */
+static void uring_cancel_recv(struct reactor *r, struct sub_server *server)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&r->ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (unsigned long)server | URING_TAG_RECV;
+	sqe->user_data = 0;
+}
+
+/* send queued output as one chain of linked sendmsg,
+ * out lock held, return -1 if out of memory */
+static int uring_send_queue(struct reactor *r, struct sub_server *server)
+{
+	struct uring_send *us = server->uring_send;
+	struct out_frame *frame;
+	struct io_uring_sqe *sqe;
+	unsigned int i, n, first, iov_count;
+	int link;
+	if (r->quiescing) return 0;
+	if (us == NULL)
+	{
+		if ((us = (struct uring_send *)malloc(sizeof(struct uring_send))) == NULL) return -1;
+		server->uring_send = us;
+	}
+	for (n = 0, iov_count = 0; n < server->out_count && iov_count + 2 <= URING_SEND_CHAIN * OUT_IOV_MAX; n++)
+	{
+		frame = server->out_queue[(server->out_head + n) % out_queue_size];
+		iov_count += out_frame_iov(frame, sub_server_deflated(server, frame, n), n == 0 ? server->out_offset : 0, us->iov + iov_count);
+	}
+	us->links = (iov_count + OUT_IOV_MAX - 1) / OUT_IOV_MAX;
+	us->done = 0;
+	us->error = 0;
+	uring_reserve(&r->ring, us->links);
+	for (link = 0; link < us->links; link++)
+	{
+		struct msghdr *mh = &us->mh[link];
+		first = link * OUT_IOV_MAX;
+		bzero(mh, sizeof(struct msghdr));
+		mh->msg_iov = &us->iov[first];
+		mh->msg_iovlen = iov_count - first < OUT_IOV_MAX ? iov_count - first : OUT_IOV_MAX;
+		us->len[link] = 0;
+		for (i = 0; i < mh->msg_iovlen; i++) us->len[link] += mh->msg_iov[i].iov_len;
+		sqe = uring_sqe(&r->ring);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = server->client_fd;
+		sqe->addr = (unsigned long)mh;
+		sqe->len = 1;
+		/* whole link or an error, a short send cancels the rest */
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL | (link + 1 < us->links || server->out_count > n ? MSG_MORE : 0);
+		if (link + 1 < us->links) sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = (unsigned long)server | URING_TAG_SEND;
+	}
+	server->out_sending = n;
+	server->uring_inflight |= URING_SEND;
+	return 0;
+}
+
+/* delete a client once nothing of it is in flight any more,
+ * nobody but the ready list can still find it */
+static void uring_close(struct reactor *r, struct sub_server *server)
+{
+	struct sub_server **p;
+	pthread_mutex_lock(&r->mutex_inbox);
+	if (server->out_ready)
+	{
+		for (p = &r->ready_head; *p != NULL; p = &(*p)->ready_next)
+		{
+			if (*p == server)
+			{
+				*p = server->ready_next;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&r->mutex_inbox);
+	sub_server_list_delete(r->list, server);
+}
+
+/* fan out posted messages and start the sends of clients with output */
+static void uring_drain(struct reactor *r)
+{
+	struct reactor_msg *msg, *next_msg;
+	struct sub_server *server, *next, *node;
+	while (1)
+	{
+		pthread_mutex_lock(&r->mutex_inbox);
+		msg = r->inbox_head;
+		r->inbox_head = r->inbox_tail = NULL;
+		server = r->ready_head;
+		r->ready_head = NULL;
+		pthread_mutex_unlock(&r->mutex_inbox);
+		if (msg == NULL && server == NULL) break;
+		for (; msg != NULL; msg = next_msg)
+		{
+			next_msg = msg->next;
+			if (msg->frame == NULL)
+			{
+				if ((node = reactor_add_socket(r, msg->fd)) != NULL)
+				{
+					node->peer_out = msg->peer;
+					uring_arm_recv(r, node);
+				}
+				else peer_lost(msg->peer);
+				free(msg);
+				continue;
+			}
+			sub_server_list_sendmsg_to_all(r->list, msg->frame);
+			out_frame_release(msg->frame);
+			out_frame_unref(msg->frame);
+			free(msg);
+		}
+		for (; server != NULL; server = next)
+		{
+			next = server->ready_next;
+			sub_server_out_lock(server);
+			server->out_ready = 0;
+			if (!server->closing && server->out_sending == 0 && server->out_count > 0
+					&& uring_send_queue(r, server) == -1)
+			{
+				sub_server_kick(server);
+			}
+			sub_server_out_unlock(server);
+		}
+	}
+}
+
+static void uring_accepted(struct reactor *r, struct io_uring_cqe *cqe)
+{
+	struct sub_server *node;
+	if (cqe->res >= 0)
+	{
+		if ((node = reactor_add_socket(r, cqe->res)) != NULL) uring_arm_recv(r, node);
+	}
+	/* EMFILE etc end the multishot accept */
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+	{
+		r->accepting = 0;
+		uring_arm_accept(r);
+	}
+}
+
+/* the receive of a client ended for good, fail a send still in flight */
+static void uring_finish(struct reactor *r, struct sub_server *server)
+{
+	reactor_unthrottle(r, server);
+	server->uring_inflight &= ~URING_RECV;
+	sub_server_leave(server);
+	sub_server_out_lock(server);
+	sub_server_kick(server);
+	sub_server_out_unlock(server);
+	if (server->uring_inflight == 0) uring_close(r, server);
+}
+
+static void uring_received(struct reactor *r, struct sub_server *server, struct io_uring_cqe *cqe)
+{
+	int res = cqe->res;
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+	{
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (res > 0 && sub_server_feed(server, r->ring.buf_pool + (size_t)bid * URING_BUF_SIZE, res) == -1) res = -ENOMEM;
+		uring_buf_return(&r->ring, bid);
+	}
+	if (cqe->flags & IORING_CQE_F_MORE)
+	{
+		if (res > 0)
+		{
+			/* over the rate limit, stop receiving until it may go on */
+			if (server->throttled_until > 0 && !server->throttled)
+			{
+				reactor_throttle(r, server);
+				uring_cancel_recv(r, server);
+			}
+			return;
+		}
+		/* still armed, the shutdown makes it end */
+		sub_server_out_lock(server);
+		sub_server_kick(server);
+		sub_server_out_unlock(server);
+		return;
+	}
+	/* out of buffers, parked, or the kernel stopped a multishot on its own */
+	if ((res > 0 || res == -ENOBUFS || res == -ECANCELED) && !server->closing)
+	{
+		if (server->throttled_until > 0) reactor_throttle(r, server);
+		if (server->throttled)
+		{
+			/* a parked client stays until uring_resume */
+			server->uring_inflight &= ~URING_RECV;
+			return;
+		}
+		uring_arm_recv(r, server);
+		return;
+	}
+	uring_finish(r, server);
+}
+
+/* receive again from parked clients within their limits again */
+static void uring_resume(struct reactor *r)
+{
+	struct sub_server *server;
+	while ((server = reactor_resumable(r)) != NULL)
+	{
+		/* else its receive is still being cancelled */
+		if (server->uring_inflight & URING_RECV) continue;
+		if (server->closing)
+		{
+			uring_finish(r, server);
+		}
+		else
+		{
+			uring_arm_recv(r, server);
+		}
+	}
+}
+
+/* one link of a send chain completed, links complete in order */
+static void uring_sent(struct reactor *r, struct sub_server *server, int res)
+{
+	struct uring_send *us = server->uring_send;
+	int link = us->done++;
+	sub_server_out_lock(server);
+	if (res > 0) server->out_sending -= sub_server_out_consume(server, res);
+	if (res < 0 || (size_t)res < us->len[link]) us->error = 1;
+	if (us->done == us->links)
+	{
+		server->out_sending = 0;
+		server->uring_inflight &= ~URING_SEND;
+		/* sends cut short by a hot restart went on where they stopped */
+		if (us->error && !r->quiescing)
+		{
+			sub_server_kick(server);
+		}
+		else if (!server->closing && server->out_count > 0 && uring_send_queue(r, server) == -1)
+		{
+			sub_server_kick(server);
+		}
+	}
+	sub_server_out_unlock(server);
+	/* a parked client is closed by uring_resume */
+	if (server->uring_inflight == 0 && !server->throttled) uring_close(r, server);
+}
+
+/* a hot restart needs every operation of the ring completed, one
+ * cancel takes them all, what was received or sent so far is kept,
+ * return 1 once nothing is in flight any more */
+static int uring_quiet(struct reactor *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int i;
+	if (!r->quiescing)
+	{
+		r->quiescing = 1;
+		sqe = uring_sqe(&r->ring);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data = 0;
+		return 0;
+	}
+	if (r->accepting) return 0;
+	for (i = 0; i < r->list->size; i++)
+	{
+		if (r->list->members[i]->uring_inflight != 0) return 0;
+	}
+	return 1;
+}
+
+/* arm everything again after a hand over that did not go through */
+static void uring_thaw(struct reactor *r)
+{
+	struct sub_server *server;
+	unsigned int i;
+	r->quiescing = 0;
+	uring_arm_accept(r);
+	for (i = 0; i < r->list->size; i++)
+	{
+		server = r->list->members[i];
+		if (server->closing) continue;
+		if (!server->throttled && !(server->uring_inflight & URING_RECV)) uring_arm_recv(r, server);
+		sub_server_out_lock(server);
+		if (server->out_sending == 0 && server->out_count > 0 && uring_send_queue(r, server) == -1)
+		{
+			sub_server_kick(server);
+		}
+		sub_server_out_unlock(server);
+	}
+}
+
+/* io_uring reactor working threading, never returns */
+void *uring_start(void *data)
+{
+	struct reactor *r = (struct reactor *)data;
+	struct uring *ring = &r->ring;
+	struct io_uring_cqe cqe;
+	unsigned int head;
+	uint64_t count;
+	current_reactor = r;
+	takeover_enter();
+	uring_arm_accept(r);
+	uring_arm_event(r);
+	r->last_tick = monotonic_ms();
+	r->next_tick = r->last_tick + RATE_CHECK_MS;
+	while (1)
+	{
+		/* a hot restart wakes the reactor through its inbox */
+		if (takeover_frozen() && uring_quiet(r))
+		{
+			takeover_park();
+			uring_thaw(r);
+		}
+		uring_resume(r);
+		uring_drain(r);
+		/* sleep no longer than until the next flush tick */
+		if (uring_submit(ring, 1, reactor_timeout(r)) == -1)
+		{
+			fatal_error("io_uring wait failed");
+		}
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			cqe = ring->cqes[head & *ring->cq_mask];
+			__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+			void *ptr = (void *)(unsigned long)(cqe.user_data & ~(unsigned long long)URING_TAG_MASK);
+			switch (cqe.user_data & URING_TAG_MASK)
+			{
+				case URING_TAG_ACCEPT:
+					uring_accepted(r, &cqe);
+					break;
+				case URING_TAG_EVENT:
+					while (read(r->event_fd, &count, sizeof(count)) == -1 && errno == EINTR);
+					if (!(cqe.flags & IORING_CQE_F_MORE)) uring_arm_event(r);
+					break;
+				case URING_TAG_RECV:
+					uring_received(r, (struct sub_server *)ptr, &cqe);
+					break;
+				case URING_TAG_SEND:
+					uring_sent(r, (struct sub_server *)ptr, cqe.res);
+					break;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* create a listening socket sharing port with the other reactors */
+int reactor_listen_socket(unsigned short port)
+{
+	int fd, opt = 1;
+	struct sockaddr_in servaddr;
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+	bzero(&servaddr, sizeof(servaddr));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_port = htons(port);
+	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) == -1
+			|| listen(fd, SOMAXCONN) == -1
+			|| (server_engine == ENGINE_EPOLL && set_nonblocking(fd) == -1))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* create reactors, the first one reuses the listening socket of main,
+ * the next ones take those a hot restart handed over, if any */
+int reactors_init(int count, int listen_fd, unsigned short port)
+{
+	int i, handed;
+	reactors = (struct reactor *)calloc(count, sizeof(struct reactor));
+	if (reactors == NULL) return -1;
+	reactor_count = count;
+	for (i = 0; i < count; i++)
+	{
+		struct reactor *r = &reactors[i];
+		r->id = i;
+		handed = i < (int)takeover_listen_count;
+		r->listen_fd = i == 0 ? listen_fd : handed ? takeover_listen_fds[i] : reactor_listen_socket(port);
+		/* a socket of the thread engine can't share its port,
+		 * the reactors it was not enough for only get clients */
+		if (r->listen_fd == -1 && takeover_listen_count == 0) return -1;
+		/* io_uring waits in the kernel on blocking sockets */
+		if (server_engine == ENGINE_URING)
+		{
+			r->epfd = -1;
+			if (handed && set_blocking(r->listen_fd) == -1) return -1;
+			if (uring_init(&r->ring) == -1) return -1;
+		}
+		else
+		{
+			if ((i == 0 || handed) && set_nonblocking(r->listen_fd) == -1) return -1;
+			if ((r->epfd = epoll_create1(0)) == -1) return -1;
+		}
+		if ((r->event_fd = eventfd(0, EFD_NONBLOCK)) == -1) return -1;
+		if ((r->list = sub_server_list_new()) == NULL) return -1;
+		pthread_mutex_init(&r->mutex_inbox, NULL);
+		r->inbox_head = r->inbox_tail = NULL;
+		r->ready_head = NULL;
+		r->throttled_head = NULL;
+	}
+	return 0;
+}
+
+/* start one thread per reactor, pinned to a core each */
+int reactors_start(void)
+{
+	int i, cores = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t cpus;
+	for (i = 0; i < reactor_count; i++)
+	{
+		if (pthread_create(&reactors[i].thd, NULL, server_engine == ENGINE_URING ? uring_start : reactor_start, &reactors[i]) != 0) return -1;
+		if (cores > 0)
+		{
+			CPU_ZERO(&cpus);
+			CPU_SET(i % cores, &cpus);
+			pthread_setaffinity_np(reactors[i].thd, sizeof(cpus), &cpus);
+		}
+	}
+	return 0;
+}
+
+/* add a connected socket to the server list of the thread engine,
+ * its thread is not started yet, return NULL and close it if out of
+ * memory */
+struct sub_server *server_add_socket(int fd)
+{
+	struct sub_server server, *node;
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	server.client_fd = fd;
+	strcpy(server.nickname, "guest");
+	server.nickname_len = strlen("guest");
+	bzero(&addr, sizeof(addr));
+	getpeername(fd, (struct sockaddr *)&addr, &addr_len);
+	strncpy(server.client_ip_addr, inet_ntoa(addr.sin_addr), 16);
+	if ((node = sub_server_list_push_back(server_list, &server)) == NULL) close(fd);
+	return node;
+}
+
+/* hand a connected socket to the engine as if it was accepted,
+ * return -1 and close it on error */
+int server_adopt(int fd, struct peer *peer)
+{
+	struct sub_server *node;
+	pthread_t thd;
+	if (server_engine != ENGINE_URING && set_nonblocking(fd) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	if (server_engine != ENGINE_THREAD) return reactor_post_socket(&reactors[fd % reactor_count], fd, peer);
+	if ((node = server_add_socket(fd)) == NULL) return -1;
+	node->peer_out = peer;
+	if (pthread_create(&thd, NULL, sub_server_start, (void *)node) != 0)
+	{
+		sub_server_list_delete(server_list, node);
+		return -1;
+	}
+	return 0;
+}
+
+/* connect to a configured peer and say hello, return the socket or -1 */
+static int peer_connect(struct peer *peer)
+{
+	struct addrinfo hints, *res, *ai;
+	struct timeval tv;
+	char hello[FRAME_HEADER_SIZE + PEER_HELLO_SIZE];
+	int fd = -1;
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(peer->host, peer->port, &hints, &res) != 0) return -1;
+	for (ai = res; ai != NULL; ai = ai->ai_next)
+	{
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1) continue;
+		/* an unreachable peer does not hold up the connector for long */
+		tv.tv_sec = PEER_CONNECT_TIMEOUT_S;
+		tv.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd == -1) return -1;
+	frame_encode_header(hello, CMD_PEER_HELLO, 0, PEER_HELLO_SIZE);
+	frame_put_u32(hello + FRAME_HEADER_SIZE, node_id);
+	if (send(fd, hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello))
+	{
+		close(fd);
+		return -1;
+	}
+	tv.tv_sec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	return fd;
+}
+
+/* connector thread, keeps the link to a configured peer up */
+void *peer_start(void *data)
+{
+	struct peer *peer = (struct peer *)data;
+	int fd;
+	while (1)
+	{
+		if (!__atomic_load_n(&peer->linked, __ATOMIC_ACQUIRE) && (fd = peer_connect(peer)) != -1)
+		{
+			__atomic_store_n(&peer->linked, 1, __ATOMIC_RELEASE);
+			if (server_adopt(fd, peer) == -1) peer_lost(peer);
+		}
+		sleep(PEER_RETRY_S);
+	}
+	return NULL;
+}
+
+/* start a connector per configured peer, the engine must be running */
+int peers_start(void)
+{
+	int i;
+	for (i = 0; i < peer_count; i++)
+	{
+		if (pthread_create(&peers[i].thd, NULL, peer_start, &peers[i]) != 0) return -1;
+		pthread_detach(peers[i].thd);
+	}
+	return 0;
+}
+
+/* --peer=host:port */
+int peer_parse(const char *addr)
+{
+	const char *colon = strrchr(addr, ':');
+	struct peer *peer;
+	if (peer_count == PEERS_MAX || colon == NULL || colon == addr
+			|| colon - addr >= (int)sizeof(peer->host) || strlen(colon + 1) >= sizeof(peer->port))
+	{
+		return -1;
+	}
+	peer = &peers[peer_count++];
+	memcpy(peer->host, addr, colon - addr);
+	peer->host[colon - addr] = '\0';
+	strcpy(peer->port, colon + 1);
+	return 0;
+}
+
+/* --peer-allow=host */
+int peer_allow_parse(const char *host)
+{
+	if (peer_allow_count == PEERS_MAX || *host == '\0' || strlen(host) >= sizeof(peer_allow_hosts[0])) return -1;
+	strcpy(peer_allow_hosts[peer_allow_count++], host);
+	return 0;
+}
+#endif
+
+#if defined(UNIX)
+/* hot restart, the hand over
+ * a new server started with --takeover=path connects to the admin
+ * socket of the running one and asks it to take over, the running one
+ * parks its engine, sends its listening sockets and then every client
+ * with its state, and exits once the new one has them all, else it
+ * thaws and goes on as before, every socket rides along with the
+ * header of its message
+ * message: u8 TAKEOVER_*, u32 length, body
+ * client body: u8 TAKEOVER_HAS_*, u8 nickname_len, nickname,
+ *   u8 room_count, u8 name_len and name of every room,
+ *   u32 length and bytes received but not handled yet,
+ *   u32 length and bytes queued but not sent yet
+ * the address of a client is asked of its socket again, links to
+ * peers are closed and connected again by the new server */
+
+#define TAKEOVER_HEADER_SIZE 5
+#define TAKEOVER_ACK 'y' /* the new server has everything */
+#define TAKEOVER_BYE 'x' /* the running server exits */
+
+enum {
+	TAKEOVER_LISTENER = 1, /* a listening socket, no body */
+	TAKEOVER_CLIENT = 2, /* a client socket and its state */
+	TAKEOVER_END = 3, /* nothing follows */
+};
+
+enum {
+	TAKEOVER_HAS_NICKNAME = 0x01, /* registered, not the default one */
+	TAKEOVER_HAS_DEFLATE = 0x02,
+	TAKEOVER_HAS_BATCH = 0x04,
+	TAKEOVER_HAS_ROSTER = 0x08,
+};
+
+const char *takeover_path; /* NULL: a plain start */
+
+/* a client handed over, restored once the engine is set up */
+struct takeover_client
+{
+	int fd;
+	char *state;
+	size_t len;
+	int roster; /* follows the roster */
+};
+
+struct takeover_client *takeover_clients;
+unsigned int takeover_client_count;
+/* listening sockets the engine does not listen on, an acceptor each */
+int takeover_spare_fds[TAKEOVER_LISTENERS_MAX];
+unsigned int takeover_spare_count;
+
+/* send a message, fd if not -1 rides along, return -1 on error */
+static int takeover_put(int sock, unsigned char type, int fd, const char *body, size_t len)
+{
+	char head[TAKEOVER_HEADER_SIZE];
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+	head[0] = (char)type;
+	frame_put_u32(head + 1, len);
+	iov.iov_base = head;
+	iov.iov_len = sizeof(head);
+	bzero(&mh, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (fd != -1)
+	{
+		bzero(control, sizeof(control));
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	if (sendmsg(sock, &mh, MSG_NOSIGNAL) != sizeof(head)) return -1;
+	while (len > 0)
+	{
+		if ((n = send(sock, body, len, MSG_NOSIGNAL)) <= 0)
+		{
+			if (n == -1 && errno == EINTR) continue;
+			return -1;
+		}
+		body += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* receive exactly len bytes, a socket sent along is stored in fd,
+ * the kernel never reads past a message that carries one, so it
+ * comes with the header it was sent with, return -1 on error */
+static int takeover_read(int sock, char *buf, size_t len, int *fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+	while (len > 0)
+	{
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		bzero(&mh, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		if ((n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) <= 0)
+		{
+			if (n == -1 && errno == EINTR) continue;
+			return -1;
+		}
+		for (cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg))
+		{
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* receive a message, fd is -1 if none came along, return -1 on error */
+static int takeover_get(int sock, unsigned char *type, int *fd, char **body, size_t *len)
+{
+	char head[TAKEOVER_HEADER_SIZE];
+	int extra = -1;
+	*fd = -1;
+	*body = NULL;
+	if (takeover_read(sock, head, sizeof(head), fd) == -1) return -1;
+	*type = (unsigned char)head[0];
+	*len = frame_get_u32(head + 1);
+	if (*len == 0) return 0;
+	if ((*body = (char *)malloc(*len)) == NULL || takeover_read(sock, *body, *len, &extra) == -1)
+	{
+		free(*body);
+		if (*fd != -1) close(*fd);
+		return -1;
+	}
+	return 0;
+}
+
+/* state of a client as laid out above, out lock held,
+ * return NULL if out of memory */
+static char *takeover_state(struct sub_server *server, size_t *len)
+{
+	struct iovec iov[2];
+	struct out_frame *frame;
+	size_t in_len = server->decoder.end - server->decoder.start, out_len = 0;
+	unsigned int i, j, n;
+	char *state, *p;
+	/* queued bytes in the form they go out, the oldest frame from
+	 * where its send stopped */
+	for (i = 0; i < server->out_count; i++)
+	{
+		frame = server->out_queue[(server->out_head + i) % out_queue_size];
+		n = out_frame_iov(frame, sub_server_deflated(server, frame, i), i == 0 ? server->out_offset : 0, iov);
+		for (j = 0; j < n; j++) out_len += iov[j].iov_len;
+	}
+	*len = 2 + server->nickname_len + 1 + 4 + in_len + 4 + out_len;
+	for (i = 0; i < server->room_count; i++) *len += 1 + server->rooms[i]->name_len;
+	if ((state = p = (char *)malloc(*len)) == NULL) return NULL;
+	*p++ = (server->nick_indexed ? TAKEOVER_HAS_NICKNAME : 0) | (server->deflate ? TAKEOVER_HAS_DEFLATE : 0)
+		| (server->batch ? TAKEOVER_HAS_BATCH : 0) | (server->roster ? TAKEOVER_HAS_ROSTER : 0);
+	*p++ = (char)server->nickname_len;
+	memcpy(p, server->nickname, server->nickname_len);
+	p += server->nickname_len;
+	*p++ = (char)server->room_count;
+	for (i = 0; i < server->room_count; i++)
+	{
+		*p++ = (char)server->rooms[i]->name_len;
+		memcpy(p, server->rooms[i]->name, server->rooms[i]->name_len);
+		p += server->rooms[i]->name_len;
+	}
+	frame_put_u32(p, in_len);
+	p += 4;
+	if (in_len > 0) memcpy(p, server->decoder.buf + server->decoder.start, in_len);
+	p += in_len;
+	frame_put_u32(p, out_len);
+	p += 4;
+	for (i = 0; i < server->out_count; i++)
+	{
+		frame = server->out_queue[(server->out_head + i) % out_queue_size];
+		n = out_frame_iov(frame, sub_server_deflated(server, frame, i), i == 0 ? server->out_offset : 0, iov);
+		for (j = 0; j < n; j++)
+		{
+			memcpy(p, iov[j].iov_base, iov[j].iov_len);
+			p += iov[j].iov_len;
+		}
+	}
+	return state;
+}
+
+/* thaw every parked thread of the engine */
+static void takeover_thaw(void)
+{
+	pthread_mutex_lock(&mutex_takeover);
+	__atomic_store_n(&takeover_freezing, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&cond_takeover);
+	pthread_mutex_unlock(&mutex_takeover);
+}
+
+/* park every thread of the engine and settle what they left behind,
+ * return -1 if a hand over is going on or they did not all park */
+static int takeover_freeze(void)
+{
+	struct timespec deadline;
+	uint64_t one = 1;
+	int i, ret = 0;
+	pthread_mutex_lock(&mutex_takeover);
+	if (takeover_freezing)
+	{
+		pthread_mutex_unlock(&mutex_takeover);
+		return -1;
+	}
+	__atomic_store_n(&takeover_freezing, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&mutex_takeover);
+	/* a reactor may wait for events for long */
+	if (server_engine != ENGINE_THREAD)
+	{
+		for (i = 0; i < reactor_count; i++)
+		{
+			if (write(reactors[i].event_fd, &one, sizeof(one)) != sizeof(one)) continue;
+		}
+	}
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += TAKEOVER_TIMEOUT_S;
+	pthread_mutex_lock(&mutex_takeover);
+	while (ret == 0 && takeover_parked < takeover_threads)
+	{
+		if (pthread_cond_timedwait(&cond_takeover, &mutex_takeover, &deadline) == ETIMEDOUT) ret = -1;
+	}
+	pthread_mutex_unlock(&mutex_takeover);
+	if (ret == -1)
+	{
+		takeover_thaw();
+		return -1;
+	}
+	/* sockets posted to reactors and their ready lists */
+	for (i = 0; server_engine != ENGINE_THREAD && i < reactor_count; i++)
+	{
+		if (server_engine == ENGINE_URING) uring_drain(&reactors[i]);
+		else reactor_drain_inbox(&reactors[i]);
+	}
+	/* batches still open are queued to their clients */
+	for (i = 0; i < (server_engine == ENGINE_THREAD ? 1 : reactor_count); i++)
+	{
+		struct sub_server_list *list = server_engine == ENGINE_THREAD ? server_list : reactors[i].list;
+		sub_server_list_batch_lock(list);
+		sub_server_list_batch_send(list);
+		sub_server_list_batch_unlock(list);
+	}
+	/* so are roster changes, the lock keeps new ones from going out */
+	roster_flush();
+	roster_lock();
+	return 0;
+}
+
+/* send every client of a list but links to peers, return -1 on error */
+static int takeover_send_list(int sock, struct sub_server_list *list, unsigned int *count)
+{
+	struct sub_server *server;
+	char *state;
+	size_t len;
+	unsigned int i;
+	int ret = 0;
+	/* a peer connector may still add a link */
+	sub_server_list_lock(list);
+	for (i = 0; ret == 0 && i < list->size; i++)
+	{
+		server = list->members[i];
+		if (server->closing || server->peer != 0 || server->peer_out != NULL) continue;
+		sub_server_out_lock(server);
+		state = takeover_state(server, &len);
+		sub_server_out_unlock(server);
+		if (state == NULL || takeover_put(sock, TAKEOVER_CLIENT, server->client_fd, state, len) == -1) ret = -1;
+		else (*count)++;
+		free(state);
+	}
+	sub_server_list_unlock(list);
+	return ret;
+}
+
+/* hand everything over to the new server on sock, only comes back if
+ * that did not work out, the engine runs on as before then */
+void takeover_send(int sock)
+{
+	struct timeval tv;
+	unsigned int i, count = 0;
+	int ret = 0;
+	char reply;
+	tv.tv_sec = TAKEOVER_TIMEOUT_S;
+	tv.tv_usec = 0;
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	printf("Hot restart requested on the admin socket\n");
+	if (takeover_freeze() == -1)
+	{
+		printf("Hot restart failed, the engine did not park\n");
+		return;
+	}
+	/* listening sockets in the order the reactors take them */
+	if (server_engine == ENGINE_THREAD) ret = takeover_put(sock, TAKEOVER_LISTENER, server_fd, NULL, 0);
+	for (i = 0; ret == 0 && server_engine != ENGINE_THREAD && i < (unsigned int)reactor_count; i++)
+	{
+		if (reactors[i].listen_fd != -1) ret = takeover_put(sock, TAKEOVER_LISTENER, reactors[i].listen_fd, NULL, 0);
+	}
+	for (i = 0; ret == 0 && i < takeover_spare_count; i++)
+	{
+		ret = takeover_put(sock, TAKEOVER_LISTENER, takeover_spare_fds[i], NULL, 0);
+	}
+	if (server_engine == ENGINE_THREAD)
+	{
+		if (ret == 0) ret = takeover_send_list(sock, server_list, &count);
+	}
+	for (i = 0; ret == 0 && server_engine != ENGINE_THREAD && i < (unsigned int)reactor_count; i++)
+	{
+		ret = takeover_send_list(sock, reactors[i].list, &count);
+	}
+	if (ret == 0 && takeover_put(sock, TAKEOVER_END, -1, NULL, 0) == 0
+			&& recv(sock, &reply, 1, 0) == 1 && reply == TAKEOVER_ACK)
+	{
+		/* the log and the admin socket are let go of at exit */
+		reply = TAKEOVER_BYE;
+		send(sock, &reply, 1, MSG_NOSIGNAL);
+		printf("Handed %u client(s) over to a new server\n", count);
+		exit(0);
+	}
+	printf("Hot restart failed, the new server did not take over\n");
+	roster_unlock();
+	takeover_thaw();
+}
+
+/* take the listening sockets and the clients over from the server
+ * whose admin socket is at takeover_path, once this returns it is
+ * gone, port is set to the one it listened on, return -1 on error */
+int takeover_receive(unsigned short *port)
+{
+	struct sockaddr_un addr;
+	struct sockaddr_in servaddr;
+	socklen_t servaddr_len = sizeof(servaddr);
+	struct takeover_client *c;
+	unsigned int capacity = 0;
+	unsigned char type;
+	char *body, reply;
+	size_t len;
+	int sock, fd;
+	printf("Take over from %s..", takeover_path);
+	fflush(stdout);
+	if (strlen(takeover_path) >= sizeof(addr.sun_path)) return -1;
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) return -1;
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, takeover_path);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1
+			|| send(sock, "takeover\n", strlen("takeover\n"), MSG_NOSIGNAL) == -1)
+	{
+		goto fail;
+	}
+	while (1)
+	{
+		if (takeover_get(sock, &type, &fd, &body, &len) == -1) goto fail;
+		if (type == TAKEOVER_END) break;
+		if (type == TAKEOVER_LISTENER && fd != -1 && takeover_listen_count < TAKEOVER_LISTENERS_MAX)
+		{
+			takeover_listen_fds[takeover_listen_count++] = fd;
+			free(body);
+			continue;
+		}
+		if (type == TAKEOVER_CLIENT && fd != -1)
+		{
+			if (takeover_client_count == capacity)
+			{
+				unsigned int new_capacity = capacity == 0 ? SLAB_CHUNK_SIZE : capacity * 2;
+				c = (struct takeover_client *)realloc(takeover_clients, new_capacity * sizeof(struct takeover_client));
+				if (c == NULL)
+				{
+					close(fd);
+					free(body);
+					goto fail;
+				}
+				takeover_clients = c;
+				capacity = new_capacity;
+			}
+			c = &takeover_clients[takeover_client_count++];
+			c->fd = fd;
+			c->state = body;
+			c->len = len;
+			c->roster = 0;
+			continue;
+		}
+		/* anything else is not understood */
+		if (fd != -1) close(fd);
+		free(body);
+		goto fail;
+	}
+	if (takeover_listen_count == 0) goto fail;
+	reply = TAKEOVER_ACK;
+	if (send(sock, &reply, 1, MSG_NOSIGNAL) != 1 || recv(sock, &reply, 1, 0) != 1 || reply != TAKEOVER_BYE) goto fail;
+	/* its log and admin socket are free once it is gone */
+	while (recv(sock, &reply, 1, 0) > 0);
+	close(sock);
+	bzero(&servaddr, sizeof(servaddr));
+	getsockname(takeover_listen_fds[0], (struct sockaddr *)&servaddr, &servaddr_len);
+	*port = ntohs(servaddr.sin_port);
+	printf("ok\n");
+	printf("%u listening socket(s) and %u client(s) handed over\n", takeover_listen_count, takeover_client_count);
+	return 0;
+fail:
+	close(sock);
+	return -1;
+}
+
+/* restore the state of a client handed over into its node,
+ * return its TAKEOVER_HAS_* or -1 if the state is malformed */
+static int takeover_restore(struct sub_server *server, const char *p, size_t len)
+{
+	const char *end = p + len;
+	struct out_frame *frame;
+	unsigned char flags, n, count, i;
+	size_t part, room;
+	char *space;
+	if (end - p < 2) return -1;
+	flags = (unsigned char)*p++;
+	n = (unsigned char)*p++;
+	if (n > NICKNAME_LEN_MAX || end - p < n + 1) return -1;
+	if ((flags & TAKEOVER_HAS_NICKNAME) && set_nickname(server, (char *)p, n) == -1) return -1;
+	p += n;
+	count = (unsigned char)*p++;
+	for (i = 0; i < count; i++)
+	{
+		if (end - p < 1 || end - p < 1 + (unsigned char)*p) return -1;
+		room_join(server, p + 1, (unsigned char)*p);
+		p += 1 + (unsigned char)*p;
+	}
+	if (flags & TAKEOVER_HAS_DEFLATE) sub_server_agree_deflate(server);
+	if (flags & TAKEOVER_HAS_BATCH) sub_server_agree_batch(server);
+	/* bytes received, handled once the engine runs */
+	if (end - p < 4) return -1;
+	part = frame_get_u32(p);
+	p += 4;
+	if ((size_t)(end - p) < part) return -1;
+	while (part > 0)
+	{
+		if ((space = frame_decoder_space(&server->decoder, &room)) == NULL) return -1;
+		if (room > part) room = part;
+		memcpy(space, p, room);
+		frame_decoder_commit(&server->decoder, room);
+		p += room;
+		part -= room;
+	}
+	/* bytes queued, they go out before anything else */
+	if (end - p < 4) return -1;
+	part = frame_get_u32(p);
+	p += 4;
+	if ((size_t)(end - p) != part) return -1;
+	if (part > 0)
+	{
+		if ((frame = out_frame_new(part)) == NULL) return -1;
+		memcpy(frame->data, p, part);
+		sub_server_enqueue(server, frame);
+		out_frame_unref(frame);
+	}
+	return flags;
+}
+
+/* acceptor of a listening socket handed over the engine does not
+ * listen on, so nothing that comes in on it is lost */
+void *takeover_spare_start(void *data)
+{
+	int listen_fd = (int)(long)data, fd;
+	takeover_enter();
+	while (1)
+	{
+		if ((fd = takeover_accept(listen_fd, NULL, NULL)) == -1) continue;
+		server_adopt(fd, NULL);
+	}
+	return NULL;
+}
+
+/* put the clients handed over into the engine, which is set up but
+ * not started yet, return -1 on error */
+int takeover_adopt(void)
+{
+	struct takeover_client *c;
+	struct sub_server **nodes, *node;
+	struct reactor *r = NULL;
+	struct epoll_event ev;
+	struct frame f;
+	unsigned int i, j, used;
+	int flags, ret = 0;
+	pthread_t thd;
+	nodes = NULL;
+	if (takeover_client_count > 0)
+	{
+		nodes = (struct sub_server **)calloc(takeover_client_count, sizeof(struct sub_server *));
+		if (nodes == NULL)
+		{
+			for (i = 0; i < takeover_client_count; i++) close(takeover_clients[i].fd);
+			ret = -1;
+			goto done;
+		}
+	}
+	for (i = 0; i < takeover_client_count; i++)
+	{
+		c = &takeover_clients[i];
+		/* io_uring waits in the kernel on blocking sockets */
+		if ((server_engine == ENGINE_URING ? set_blocking(c->fd) : set_nonblocking(c->fd)) == -1)
+		{
+			close(c->fd);
+			continue;
+		}
+		if (server_engine == ENGINE_THREAD)
+		{
+			node = server_add_socket(c->fd);
+		}
+		else
+		{
+			r = &reactors[i % reactor_count];
+			node = reactor_add_socket(r, c->fd);
+		}
+		if (node == NULL) continue;
+		if ((flags = takeover_restore(node, c->state, c->len)) == -1)
+		{
+			sub_server_leave(node);
+			sub_server_list_delete(node->list, node);
+			continue;
+		}
+		c->roster = (flags & TAKEOVER_HAS_ROSTER) != 0;
+		if (server_engine == ENGINE_EPOLL)
+		{
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			ev.data.ptr = node;
+			if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+			{
+				sub_server_leave(node);
+				sub_server_list_delete(r->list, node);
+				continue;
+			}
+		}
+		/* frames handed over are handled as those of a client over
+		 * its rate limit, its reactor reads on afterwards */
+		if (server_engine != ENGINE_THREAD && frame_decoder_peek(&node->decoder, &f))
+		{
+			node->throttled_until = monotonic_ms();
+			reactor_throttle(r, node);
+		}
+		else if (server_engine == ENGINE_URING)
+		{
+			uring_arm_recv(r, node);
+		}
+		nodes[i] = node;
+	}
+	/* roster followers are told changes from now on, they got their
+	 * snapshot from the running server */
+	roster_lock();
+	for (i = 0; i < takeover_client_count; i++)
+	{
+		if (nodes[i] != NULL && takeover_clients[i].roster) roster_add(nodes[i]);
+	}
+	roster_unlock();
+	for (i = 0; server_engine == ENGINE_THREAD && i < takeover_client_count; i++)
+	{
+		if (nodes[i] != NULL && pthread_create(&thd, NULL, sub_server_start, (void *)nodes[i]) != 0) break;
+	}
+	/* out of threads, the clients with one are kicked and deleted by
+	 * it, the others by nobody but here */
+	if (server_engine == ENGINE_THREAD && i < takeover_client_count)
+	{
+		for (j = 0; j < takeover_client_count; j++)
+		{
+			if (nodes[j] == NULL) continue;
+			if (j < i)
+			{
+				sub_server_out_lock(nodes[j]);
+				sub_server_kick(nodes[j]);
+				sub_server_out_unlock(nodes[j]);
+			}
+			else
+			{
+				sub_server_leave(nodes[j]);
+				sub_server_list_delete(server_list, nodes[j]);
+			}
+		}
+		ret = -1;
+	}
+done:
+	for (i = 0; i < takeover_client_count; i++) free(takeover_clients[i].state);
+	free(takeover_clients);
+	free(nodes);
+	takeover_clients = NULL;
+	takeover_client_count = 0;
+	if (ret == -1) return -1;
+	/* the thread engine listens on one socket, the reactors on one each */
+	used = server_engine == ENGINE_THREAD ? 1 : reactor_count;
+	for (i = used; i < takeover_listen_count; i++)
+	{
+		if (pthread_create(&thd, NULL, takeover_spare_start, (void *)(long)takeover_listen_fds[i]) != 0) return -1;
+		pthread_detach(thd);
+		takeover_spare_fds[takeover_spare_count++] = takeover_listen_fds[i];
+	}
+	return 0;
+}
+#endif
+
+#if defined(UNIX)
+/* admin socket
+ * a Unix domain socket for supervisors and monitoring agents, every
+ * request is one line and every reply one line of JSON:
+ *   jobs       clients of every list and rooms
+ *   stats      counters and latency percentiles
+ *   kick id    disconnect a client, id as listed by jobs
+ *   shutdown   exit the server
+ *   takeover   hand everything over to a new server, see --takeover
+ * listings are copied out of snapshots before anything is written, so
+ * a slow admin client never holds up the data path */
+
+#define ADMIN_LINE_MAX 512
+
+const char *admin_path; /* NULL: no admin socket */
+int admin_fd = -1;
+
+static void json_string(FILE *out, const char *p, size_t len)
+{
+	size_t i;
+	fputc('"', out);
+	for (i = 0; i < len; i++)
+	{
+		unsigned char c = (unsigned char)p[i];
+		if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+		else if (c < 0x20) fprintf(out, "\\u%04x", c);
+		else fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+/* sub server list by number, the thread engine has only one,
+ * NULL past the last */
+static struct sub_server_list *admin_list(int id)
+{
+	if (server_engine == ENGINE_THREAD) return id == 0 ? server_list : NULL;
+	return id >= 0 && id < reactor_count ? reactors[id].list : NULL;
+}
+
+static void admin_jobs(FILE *out)
+{
+	struct sub_server_list *list;
+	struct job *jobs;
+	struct room_info *rooms;
+	int id, i, n, first = 1;
+	fprintf(out, "{\"ok\":true,\"jobs\":[");
+	for (id = 0; (list = admin_list(id)) != NULL; id++)
+	{
+		if ((n = sub_server_list_jobs(list, &jobs)) == -1) continue;
+		for (i = 0; i < n; i++)
+		{
+			fprintf(out, "%s{\"id\":\"%d.%llu\",\"address\":", first ? "" : ",", id, jobs[i].handle);
+			json_string(out, jobs[i].client_ip_addr, strlen(jobs[i].client_ip_addr));
+			fprintf(out, ",\"nickname\":");
+			json_string(out, jobs[i].nickname, jobs[i].nickname_len);
+			fprintf(out, ",\"fd\":%d,\"queued\":%u}", jobs[i].client_fd, jobs[i].queued);
+			first = 0;
+		}
+		free(jobs);
+	}
+	fprintf(out, "],\"rooms\":[");
+	n = rooms_collect(&rooms);
+	for (i = 0; i < n; i++)
+	{
+		fprintf(out, "%s{\"name\":", i > 0 ? "," : "");
+		json_string(out, rooms[i].name, rooms[i].name_len);
+		fprintf(out, ",\"members\":%u}", rooms[i].size);
+	}
+	free(rooms);
+	fprintf(out, "]}\n");
+}
+
+/* disconnect the client of a job id "list.handle",
+ * return why it failed, NULL on success */
+static const char *admin_kick(const char *id)
+{
+	struct sub_server_list *list;
+	struct sub_server *server;
+	unsigned long long handle;
+	char *end;
+	long list_id = strtol(id, &end, 10);
+	if (end == id || *end != '.') return "malformed id";
+	handle = strtoull(end + 1, &end, 10);
+	if (*end != '\0') return "malformed id";
+	/* the client may be on its way to a new server */
+	if (takeover_frozen()) return "restarting";
+	if ((list = admin_list((int)list_id)) == NULL) return "no such job";
+	/* the mutex keeps the node from being deleted meanwhile, the owner
+	 * of the client deletes it once it sees the socket shut down */
+	sub_server_list_lock(list);
+	server = sub_server_list_get(list, handle);
+	if (server != NULL)
+	{
+		sub_server_out_lock(server);
+		sub_server_kick(server);
+		sub_server_out_unlock(server);
+	}
+	sub_server_list_unlock(list);
+	return server != NULL ? NULL : "no such job";
+}
+
+/* serve one admin connection until it is closed */
+void *admin_session(void *data)
+{
+	int fd = (int)(long)data, out_fd;
+	char line[ADMIN_LINE_MAX];
+	const char *reason;
+	FILE *in, *out = NULL;
+	if ((in = fdopen(fd, "r")) == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+	if ((out_fd = dup(fd)) == -1 || (out = fdopen(out_fd, "w")) == NULL)
+	{
+		if (out_fd != -1) close(out_fd);
+		fclose(in);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), in) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0') continue;
+		if (!strcmp(line, "jobs"))
+		{
+			admin_jobs(out);
+		}
+		else if (!strcmp(line, "stats"))
+		{
+			fprintf(out, "{\"ok\":true,\"stats\":");
+			stats_json(out);
+			fprintf(out, "}\n");
+		}
+		else if (!strncmp(line, "kick ", strlen("kick ")))
+		{
+			if ((reason = admin_kick(line + strlen("kick "))) == NULL) fprintf(out, "{\"ok\":true}\n");
+			else fprintf(out, "{\"ok\":false,\"error\":\"%s\"}\n", reason);
+		}
+		else if (!strcmp(line, "shutdown"))
+		{
+			fprintf(out, "{\"ok\":true}\n");
+			fflush(out);
+			printf("Shutdown requested on the admin socket\n");
+			exit(0);
+		}
+		else if (!strcmp(line, "takeover"))
+		{
+			/* the stream is the new server's from now on, it is
+			 * closed if that did not work out */
+			takeover_send(fd);
+			break;
+		}
+		else
+		{
+			fprintf(out, "{\"ok\":false,\"error\":\"unknown command\"}\n");
+		}
+		if (fflush(out) == EOF) break;
+	}
+	fclose(out);
+	fclose(in);
+	return NULL;
+}
+
+/* accept admin connections, each is served by a thread of its own so a
+ * stuck one does not lock the others out */
+void *admin_start(void *data)
+{
+	int fd;
+	pthread_t thd;
+	while (1)
+	{
+		if ((fd = accept(admin_fd, NULL, NULL)) == -1) continue;
+		if (pthread_create(&thd, NULL, admin_session, (void *)(long)fd) != 0)
+		{
+			close(fd);
+			continue;
+		}
+		pthread_detach(thd);
+	}
+	return NULL;
 }
 
-int set_nickname(struct sub_server *server, char *nickname, unsigned char nickname_len)
+static void admin_close(void)
 {
-#if defined(UNIX)
-	pthread_mutex_lock(&mutex_server_list);
-#elif defined(WINDOWS)
-	EnterCriticalSection(&cs_server_list);
-#endif
-	server->nickname_len = nickname_len;
-	strncpy(server->nickname, nickname, nickname_len);
-#if defined(UNIX)
-	pthread_mutex_unlock(&mutex_server_list);
-#elif defined(WINDOWS)
-	LeaveCriticalSection(&cs_server_list);
-#endif
-	return 0;
+	unlink(admin_path);
 }
 
-/* sub server working threading */
-void *sub_server_start(void *data)
+/* listen on admin_path, return -1 on error */
+int admin_open(void)
 {
-	/* get thread id */
-#if defined(UNIX)
-	((struct sub_server *)data)->thd_id = pthread_self();
-#elif defined(WINDOWS)
-	((struct sub_server *)data)->thd_id = GetCurrentThreadId();
-#endif
-	/* add current server to server list */
-	struct sub_server *server;
-	server = sub_server_list_push_back(server_list, data);
-	if (server == NULL)
+	struct sockaddr_un addr;
+	struct stat st;
+	pthread_t thd;
+	if (strlen(admin_path) >= sizeof(addr.sun_path)) return -1;
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, admin_path);
+	/* a socket left behind by a previous run is in the way,
+	 * anything else at the path is not ours to remove */
+	if (lstat(admin_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(admin_path);
+	if ((admin_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) return -1;
+	if (bind(admin_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
 	{
-		fatal_error("fork server failed");
+		close(admin_fd);
+		return -1;
 	}
-	char send_buf[BUFFER_SIZE], recv_buf[BUFFER_SIZE];
-	int send_len, recv_len;
-	char *send_buf_p;
-	char *msg_cmd = recv_buf;
-	char *msg_body = recv_buf + 1;
-	/* message loop */
-	while (1)
+	/* it can shut the server down, only its owner may connect */
+	if (chmod(admin_path, 0600) == -1 || listen(admin_fd, 16) == -1
+			|| pthread_create(&thd, NULL, admin_start, NULL) != 0)
 	{
-		/* receive message */
-		recv_len = recv(server->client_fd, recv_buf, BUFFER_SIZE, 0);
-		if (recv_len <= 0)
-		{
-			break;
-		}
-		/* verify command length */
-		if (recv_len > 1)
-		{
-			switch (*msg_cmd)
-			{
-				case CMD_NULL:
-					/* do nothing */
-					break;
-				case CMD_SET_NICKNAME:
-					if (recv_len > 2) /* length check */
-					{
-						unsigned char nickname_len = *((unsigned char *)recv_buf + 1);
-						char *nickname_p = recv_buf + 2;
-						set_nickname(server, nickname_p, nickname_len);
-					}
-					break;
-				case CMD_SEND_MSG:
-					send_buf_p = send_buf;
-					/* command */
-					*send_buf_p++ = CMD_RECV_MSG;
-					/* nickname length */
-					*send_buf_p++ = server->nickname_len;
-					/* nickname */
-					strncpy(send_buf_p, server->nickname, server->nickname_len);
-					send_buf_p += server->nickname_len;
-					/* message_len */
-					*send_buf_p++ = (unsigned char)(recv_len - 1);
-					/* message */
-					strncpy(send_buf_p, msg_body, recv_len - 1);
-					send_buf_p += recv_len - 1;
-					/* whole command length */
-					send_len = send_buf_p - send_buf;
-					/* send received message to all clients */
-					sub_server_list_sendmsg_to_all(server_list, send_buf, send_len);
-					break;
-				default:
-					/* not supported */
-					break;
-			}
-		}
+		close(admin_fd);
+		unlink(admin_path);
+		return -1;
 	}
-	/* to delete this server */
-	sub_server_list_delete(server_list, server);
-	return NULL;
+	pthread_detach(thd);
+	atexit(admin_close);
+	return 0;
 }
+#endif
 
 /* signal handler */
 static void sig_int(int signo)
@@ -434,14 +6999,22 @@ DWORD WINAPI mini_shell(void *data)
 #endif
 {
 	char *help_info = ""
-		"jobs          -- list all running clients\n"
+		"jobs          -- list all running clients and rooms\n"
+		"queues        -- show slow consumer policy counters and output mode\n"
+		"limits        -- show rate limits and flood protection counters\n"
+		"log           -- show the message log\n"
+		"search words  -- find messages holding all the words in the log\n"
+		"stats         -- show traffic counters and latency percentiles\n"
+		"peers         -- show the cluster node and its links\n"
 		"quit          -- quit server program\n"
 		"help          -- show this information\n";
 	char cmd[CMD_LEN_MAX];
 	while (1)
 	{
 		printf("$ ");
-		fgets(cmd, BUFFER_SIZE, stdin);
+		/* a server under a supervisor has no terminal,
+		 * it is driven through the admin socket then */
+		if (fgets(cmd, CMD_LEN_MAX, stdin) == NULL) break;
 		if (strlen(cmd) > 0) cmd[strlen(cmd) - 1] = '\0';
 		if (!strncmp(cmd, "help", CMD_LEN_MAX))
 		{
@@ -451,8 +7024,137 @@ DWORD WINAPI mini_shell(void *data)
 		{
 			exit(1);
 		}
+		else if (!strncmp(cmd, "queues", CMD_LEN_MAX))
+		{
+			int i;
+			printf("policy %s, %u message(s) per client, policy %s for links\n", policy_names[slow_consumer_policy], out_queue_size, policy_names[peer_policy]);
+			for (i = 0; i < POLICY_MAX; i++)
+			{
+				printf("%-12s: %lu\n", policy_names[i], slow_consumer_count[i]);
+			}
+			if (flush_window_ms == 0)
+			{
+				printf("coalescing off\n");
+				continue;
+			}
+			printf("coalescing above %lu msg/s, flush window %d ms\n", coalesce_rate, flush_window_ms);
+#if defined(UNIX)
+			if (server_engine != ENGINE_THREAD)
+			{
+				for (i = 0; i < reactor_count; i++)
+				{
+					printf("reactor %d: %s mode\n", i, reactors[i].list->coalescing ? "throughput" : "latency");
+				}
+				continue;
+			}
+#endif
+			printf("%s mode\n", server_list->coalescing ? "throughput" : "latency");
+		}
+#if defined(UNIX)
+		else if (!strncmp(cmd, "log", CMD_LEN_MAX))
+		{
+			struct message_log *log = message_log;
+			if (log == NULL)
+			{
+				printf("no message log\n");
+				continue;
+			}
+			pthread_mutex_lock(&log->mutex);
+			if (log->segment != NULL)
+			{
+				printf("%s, segment %llu, %lu of %lu byte(s) used\n", log_dir, log->segment->first_seq,
+						(unsigned long)log->segment->end, (unsigned long)log->segment->size);
+			}
+			printf("next seq %llu, %lu record(s) appended, %lu lost\n", log->next_seq, log->appended, log->failed);
+			printf("rotate at %lu byte(s) or %d second(s), sync every %d ms\n", (unsigned long)log_segment_size, log_segment_age, log_sync_ms);
+			pthread_mutex_unlock(&log->mutex);
+		}
+		else if (!strncmp(cmd, "peers", CMD_LEN_MAX))
+		{
+			int i;
+			if (node_id == 0)
+			{
+				printf("not in a cluster\n");
+				continue;
+			}
+			pthread_mutex_lock(&mutex_peers);
+			printf("node %u, %u link(s), %u origin(s) heard of\n", node_id, peer_link_count, relay_origin_count);
+			for (i = 0; i < (int)peer_link_count; i++)
+			{
+				printf("node %u at %s, %s\n", peer_links[i]->peer, peer_links[i]->client_ip_addr, peer_links[i]->peer_out != NULL ? "connected to it" : "connected from it");
+			}
+			pthread_mutex_unlock(&mutex_peers);
+			for (i = 0; i < peer_count; i++)
+			{
+				printf("%s:%s %s\n", peers[i].host, peers[i].port, peers[i].linked ? "linked" : "connecting");
+			}
+			printf("%lu relay(s) sent, %lu taken, %lu seen before\n", relay_count[RELAY_SENT], relay_count[RELAY_TAKEN], relay_count[RELAY_SEEN]);
+		}
+		else if (!strncmp(cmd, "search ", 7))
+		{
+			unsigned long long seqs[SEARCH_RESULTS_MAX], start, elapsed;
+			char *buf, *nickname, *msg;
+			size_t len, pos, nickname_len, msg_len;
+			struct frame f;
+			int found;
+			if (!search_enabled)
+			{
+				printf("search is off\n");
+				continue;
+			}
+			start = monotonic_us();
+			found = search_query(cmd + 7, strlen(cmd + 7), seqs, SEARCH_RESULTS_MAX);
+			elapsed = monotonic_us() - start;
+			len = search_records(seqs, found > 0 ? found : 0, &buf);
+			for (pos = 0; pos < len; pos += LOG_RECORD_SIZE(frame_get_u32(buf + pos)))
+			{
+				f.len = frame_get_u32(buf + pos) - FRAME_HEADER_SIZE;
+				f.payload = buf + pos + LOG_RECORD_HEADER_SIZE + FRAME_HEADER_SIZE;
+				if (frame_decode_recv_msg(&f, &nickname, &nickname_len, &msg, &msg_len) == -1) continue;
+				printf("#%llu %.*s: %.*s\n", frame_get_u64(buf + pos + 8), (int)nickname_len, nickname, (int)msg_len, msg);
+			}
+			free(buf);
+			pthread_rwlock_rdlock(&search_index.lock);
+			printf("%d newest match(es) in %llu us, %llu message(s) indexed, %lu word(s), %lu posting(s) in %lu byte(s)\n",
+					found > 0 ? found : 0, elapsed, search_index.indexed, search_index.term_count,
+					search_index.posting_count, (unsigned long)search_index.posting_bytes);
+			pthread_rwlock_unlock(&search_index.lock);
+		}
+#endif
+		else if (!strncmp(cmd, "stats", CMD_LEN_MAX))
+		{
+			stats_print(stdout);
+		}
+		else if (!strncmp(cmd, "limits", CMD_LEN_MAX))
+		{
+			int i;
+			if (rate_limit_msgs == 0 && rate_limit_bytes == 0)
+			{
+				printf("no rate limit\n");
+				continue;
+			}
+			printf("policy %s, %lu frame(s) and %lu byte(s) per second per client (0: no limit)\n",
+					flood_names[flood_policy], rate_limit_msgs, rate_limit_bytes);
+			for (i = 0; i < FLOOD_MAX; i++)
+			{
+				printf("%-12s: %lu\n", flood_names[i], flood_count[i]);
+			}
+		}
 		else if (!strncmp(cmd, "jobs", CMD_LEN_MAX))
 		{
+#if defined(UNIX)
+			if (server_engine != ENGINE_THREAD)
+			{
+				int i;
+				for (i = 0; i < reactor_count; i++)
+				{
+					printf("reactor %d: %d job(s)\n", i, reactors[i].list->size);
+					sub_server_list_walk(reactors[i].list);
+				}
+				rooms_walk();
+				continue;
+			}
+#endif
 			if (server_list->size == 0)
 			{
 				printf("no job\n");
@@ -462,6 +7164,7 @@ DWORD WINAPI mini_shell(void *data)
 				printf("%d job(s)\n", server_list->size);
 				sub_server_list_walk(server_list);
 			}
+			rooms_walk();
 		}
 		else
 		{
@@ -482,27 +7185,212 @@ int main(int argc, const char *argv[])
 	port = SERVER_PORT_DEFAULT;
 
 	/* parser argv */
-	if (argc > 1)
+	int i;
+	for (i = 1; i < argc; i++)
 	{
-		if (!strcmp(argv[1], "-p") && argc > 2)
+		if (!strcmp(argv[i], "-p") && i + 1 < argc)
 		{
-			port = atoi(argv[2]);
+			port = atoi(argv[++i]);
+		}
+		else if (!strncmp(argv[i], "--engine=", strlen("--engine=")))
+		{
+			const char *engine = argv[i] + strlen("--engine=");
+			if (!strcmp(engine, "thread"))
+			{
+				server_engine = ENGINE_THREAD;
+			}
+#if defined(UNIX)
+			else if (!strcmp(engine, "epoll"))
+			{
+				server_engine = ENGINE_EPOLL;
+			}
+			else if (!strcmp(engine, "uring"))
+			{
+				server_engine = ENGINE_URING;
+			}
+#endif
+			else
+			{
+				printf("Error : engine %s is not supported\n", engine);
+				exit(1);
+			}
+		}
+		else if (!strncmp(argv[i], "--slow-policy=", strlen("--slow-policy=")))
+		{
+			const char *policy = argv[i] + strlen("--slow-policy=");
+			for (slow_consumer_policy = 0; slow_consumer_policy < POLICY_MAX; slow_consumer_policy++)
+			{
+				if (!strcmp(policy, policy_names[slow_consumer_policy])) break;
+			}
+			if (slow_consumer_policy == POLICY_MAX)
+			{
+				printf("Error : slow consumer policy %s is not supported\n", policy);
+				exit(1);
+			}
+		}
+		else if (!strncmp(argv[i], "--peer-policy=", strlen("--peer-policy=")))
+		{
+			const char *policy = argv[i] + strlen("--peer-policy=");
+			for (peer_policy = 0; peer_policy < POLICY_MAX; peer_policy++)
+			{
+				if (!strcmp(policy, policy_names[peer_policy])) break;
+			}
+			if (peer_policy == POLICY_MAX)
+			{
+				printf("Error : slow consumer policy %s is not supported\n", policy);
+				exit(1);
+			}
+		}
+		else if (!strncmp(argv[i], "--flush-window=", strlen("--flush-window=")))
+		{
+			flush_window_ms = atoi(argv[i] + strlen("--flush-window="));
+			if (flush_window_ms < 0 || flush_window_ms > FLUSH_WINDOW_MS_MAX)
+			{
+				printf("Error : flush window must be 0 to %d ms\n", FLUSH_WINDOW_MS_MAX);
+				exit(1);
+			}
+		}
+		else if (!strncmp(argv[i], "--coalesce-rate=", strlen("--coalesce-rate=")))
+		{
+			coalesce_rate = strtoul(argv[i] + strlen("--coalesce-rate="), NULL, 10);
+			if (coalesce_rate == 0) coalesce_rate = COALESCE_RATE_DEFAULT;
+		}
+		else if (!strncmp(argv[i], "--rate-limit=", strlen("--rate-limit=")))
+		{
+			rate_limit_msgs = strtoul(argv[i] + strlen("--rate-limit="), NULL, 10);
+		}
+		else if (!strncmp(argv[i], "--rate-limit-bytes=", strlen("--rate-limit-bytes=")))
+		{
+			rate_limit_bytes = strtoul(argv[i] + strlen("--rate-limit-bytes="), NULL, 10);
+		}
+		else if (!strncmp(argv[i], "--flood-policy=", strlen("--flood-policy=")))
+		{
+			const char *policy = argv[i] + strlen("--flood-policy=");
+			for (flood_policy = 0; flood_policy < FLOOD_MAX; flood_policy++)
+			{
+				if (!strcmp(policy, flood_names[flood_policy])) break;
+			}
+			if (flood_policy == FLOOD_MAX)
+			{
+				printf("Error : flood policy %s is not supported\n", policy);
+				exit(1);
+			}
+		}
+		else if (!strncmp(argv[i], "--history=", strlen("--history=")))
+		{
+			int size = atoi(argv[i] + strlen("--history="));
+			if (size < 0)
+			{
+				printf("Error : history must be 0 or more messages\n");
+				exit(1);
+			}
+			history_size = size > HISTORY_SIZE_MAX ? HISTORY_SIZE_MAX : size;
+		}
+		else if (!strncmp(argv[i], "--roster-window=", strlen("--roster-window=")))
+		{
+			roster_window_ms = atoi(argv[i] + strlen("--roster-window="));
+			if (roster_window_ms < 1 || roster_window_ms > ROSTER_WINDOW_MS_MAX)
+			{
+				printf("Error : roster window must be 1 to %d ms\n", ROSTER_WINDOW_MS_MAX);
+				exit(1);
+			}
+		}
+		else if (!strncmp(argv[i], "--out-queue=", strlen("--out-queue=")))
+		{
+			int size = atoi(argv[i] + strlen("--out-queue="));
+			if (size < 1)
+			{
+				printf("Error : out queue must be 1 or more messages\n");
+				exit(1);
+			}
+			out_queue_size = size > OUT_QUEUE_SIZE_MAX ? OUT_QUEUE_SIZE_MAX : size;
+		}
+		else if (!strncmp(argv[i], "--stats-file=", strlen("--stats-file=")))
+		{
+			stats_file = argv[i] + strlen("--stats-file=");
+		}
+		else if (!strncmp(argv[i], "--stats-interval=", strlen("--stats-interval=")))
+		{
+			stats_interval = atoi(argv[i] + strlen("--stats-interval="));
+			if (stats_interval <= 0) stats_interval = STATS_INTERVAL_DEFAULT;
+		}
+#if defined(UNIX)
+		else if (!strncmp(argv[i], "--reactors=", strlen("--reactors=")))
+		{
+			reactor_count = atoi(argv[i] + strlen("--reactors="));
+		}
+		else if (!strncmp(argv[i], "--log-dir=", strlen("--log-dir=")))
+		{
+			log_dir = argv[i] + strlen("--log-dir=");
+		}
+		else if (!strncmp(argv[i], "--log-segment-size=", strlen("--log-segment-size=")))
+		{
+			log_segment_size = strtoul(argv[i] + strlen("--log-segment-size="), NULL, 10);
+			/* the biggest frame must fit in a segment */
+			if (log_segment_size < LOG_RECORD_SIZE(FRAME_SIZE_MAX)) log_segment_size = LOG_RECORD_SIZE(FRAME_SIZE_MAX);
+		}
+		else if (!strncmp(argv[i], "--log-segment-age=", strlen("--log-segment-age=")))
+		{
+			log_segment_age = atoi(argv[i] + strlen("--log-segment-age="));
+			if (log_segment_age <= 0) log_segment_age = LOG_SEGMENT_AGE_DEFAULT;
+		}
+		else if (!strncmp(argv[i], "--log-sync=", strlen("--log-sync=")))
+		{
+			log_sync_ms = atoi(argv[i] + strlen("--log-sync="));
+		}
+		else if (!strcmp(argv[i], "--search"))
+		{
+			search_enabled = 1;
+		}
+		else if (!strncmp(argv[i], "--admin-socket=", strlen("--admin-socket=")))
+		{
+			admin_path = argv[i] + strlen("--admin-socket=");
+		}
+		else if (!strncmp(argv[i], "--node-id=", strlen("--node-id=")))
+		{
+			node_id = strtoul(argv[i] + strlen("--node-id="), NULL, 10);
+		}
+		else if (!strncmp(argv[i], "--takeover=", strlen("--takeover=")))
+		{
+			takeover_path = argv[i] + strlen("--takeover=");
+		}
+		else if (!strncmp(argv[i], "--peer-allow=", strlen("--peer-allow=")))
+		{
+			if (peer_allow_parse(argv[i] + strlen("--peer-allow=")) == -1)
+			{
+				printf("Error : peer host %s is malformed or there are more than %d\n", argv[i] + strlen("--peer-allow="), PEERS_MAX);
+				exit(1);
+			}
+		}
+		else if (!strncmp(argv[i], "--peer=", strlen("--peer=")))
+		{
+			if (peer_parse(argv[i] + strlen("--peer=")) == -1)
+			{
+				printf("Error : peer %s is not host:port or there are more than %d\n", argv[i] + strlen("--peer="), PEERS_MAX);
+				exit(1);
+			}
 		}
-	}
-
-#if defined(WINDOWS)
-	/* need to initialize critical section for Windows*/
-	if (InitializeCriticalSectionAndSpinCount(&cs_server_list, 4000) != TRUE)
-	{
-		fatal_error("initialize critical section failed");
-	}
 #endif
+	}
 
 	/* initialize global variables */
+	stats_started_ms = monotonic_ms();
 	thd_shell = 0;
 	server_fd = 0;
 	server_list = sub_server_list_new();
 	if (server_list == NULL) fatal_error("initialize server list error");
+	rooms_init();
+	nick_index_init();
+	roster_init();
+	if (history_init(&server_history) == -1) fatal_error("initialize history error");
+#if defined(UNIX)
+	/* before the log, the running server has it open till it exits */
+	if (takeover_path != NULL && takeover_receive(&port) == -1) fatal_error("take over from the running server failed");
+	if (log_dir != NULL && log_open() == -1) fatal_error("open message log error");
+	if (search_enabled && (message_log == NULL || search_init() == -1)) fatal_error("start search error, it needs --log-dir");
+	if (peer_count > 0 && node_id == 0) fatal_error("peers need a --node-id");
+	if (node_id != 0 && peer_init() == -1) fatal_error("initialize cluster error");
+#endif
 
 	printf("Install signal..");
 	/* install signal */
@@ -510,6 +7398,10 @@ int main(int argc, const char *argv[])
 	{
 		fatal_error("install signal failed");
 	}
+#if defined(UNIX)
+	/* a peer closing its socket must not kill the server */
+	signal(SIGPIPE, SIG_IGN);
+#endif
 	printf("ok\n");
 
 	/* initialize winsock */
@@ -529,9 +7421,13 @@ int main(int argc, const char *argv[])
 	int client_fd;
 	struct sockaddr_in servaddr, cliaddr;
 
-	/* create server socket */
+	/* create server socket, or use the one handed over */
 	printf("Create server socket..");
-	if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+	if (takeover_listen_count > 0)
+	{
+		server_fd = takeover_listen_fds[0];
+	}
+	else if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
 	{
 		fatal_error("create server socket failed");
 	}
@@ -547,17 +7443,34 @@ int main(int argc, const char *argv[])
 	const char opt = 1;
 #endif
 	setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-	/* bind */
-	bzero(&(servaddr.sin_zero), sizeof(servaddr.sin_zero));
-	servaddr.sin_family = AF_INET;
-	servaddr.sin_port = htons(port);
-	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-	bind(server_fd, (struct sockaddr *)&servaddr, sizeof(servaddr));
+#if defined(UNIX)
+	/* an old kernel gets the epoll engine instead */
+	if (server_engine == ENGINE_URING && uring_probe() == -1)
+	{
+		printf("io_uring is not supported, fall back to epoll..");
+		server_engine = ENGINE_EPOLL;
+	}
+	/* every reactor listens on the same port, a socket handed over
+	 * keeps what it was bound with */
+	if (server_engine != ENGINE_THREAD && takeover_listen_count == 0)
+	{
+		setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+	}
+#endif
+	/* bind, a socket handed over is bound already */
+	if (takeover_listen_count == 0)
+	{
+		bzero(&(servaddr.sin_zero), sizeof(servaddr.sin_zero));
+		servaddr.sin_family = AF_INET;
+		servaddr.sin_port = htons(port);
+		servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+		bind(server_fd, (struct sockaddr *)&servaddr, sizeof(servaddr));
+	}
 	printf("ok\n");
 
 	/* listen */
 	printf("Listen..");
-	if (listen(server_fd, 5) == -1)
+	if (listen(server_fd, server_engine == ENGINE_THREAD ? 5 : SOMAXCONN) == -1)
 	{
 		fatal_error("server socket listen failed");
 	}
@@ -565,6 +7478,41 @@ int main(int argc, const char *argv[])
 
 	printf("Server is now ready to work\n");
 
+	/* metrics are dumped from the start */
+	if (stats_file != NULL)
+	{
+#if defined(UNIX)
+		pthread_t thd_stats;
+		if (pthread_create(&thd_stats, NULL, stats_start, NULL) != 0)
+		{
+			fatal_error("start stats dump failed");
+		}
+		pthread_detach(thd_stats);
+#elif defined(WINDOWS)
+		DWORD thd_stats_id;
+		if (CreateThread(NULL, 0, stats_start, NULL, 0, &thd_stats_id) == NULL)
+		{
+			fatal_error("start stats dump failed");
+		}
+#endif
+	}
+
+	/* changes of the roster go out once per window */
+#if defined(UNIX)
+	pthread_t thd_roster;
+	if (pthread_create(&thd_roster, NULL, roster_start, NULL) != 0)
+	{
+		fatal_error("start roster failed");
+	}
+	pthread_detach(thd_roster);
+#elif defined(WINDOWS)
+	DWORD thd_roster_id;
+	if (CreateThread(NULL, 0, roster_start, NULL, 0, &thd_roster_id) == NULL)
+	{
+		fatal_error("start roster failed");
+	}
+#endif
+
 	/* for a server shell */
 #if defined(UNIX)
 	int ret;
@@ -581,18 +7529,94 @@ int main(int argc, const char *argv[])
 	}
 #endif
 
+#if defined(UNIX)
+	if (server_engine != ENGINE_THREAD)
+	{
+		/* one reactor per core by default */
+		if (reactor_count <= 0) reactor_count = sysconf(_SC_NPROCESSORS_ONLN);
+		if (reactor_count <= 0) reactor_count = 1;
+		printf("Engine is %s with %d reactor(s)\n", server_engine == ENGINE_URING ? "io_uring" : "epoll", reactor_count);
+		raise_fd_limit();
+		if (reactors_init(reactor_count, server_fd, port) == -1)
+		{
+			fatal_error("initialize reactors failed");
+		}
+		if (takeover_adopt() == -1)
+		{
+			fatal_error("restore clients handed over failed");
+		}
+		if (reactors_start() == -1)
+		{
+			fatal_error("start reactors failed");
+		}
+		if (admin_path != NULL && admin_open() == -1)
+		{
+			fatal_error("open admin socket failed");
+		}
+		if (peers_start() == -1)
+		{
+			fatal_error("start peer connectors failed");
+		}
+		/* reactors never return */
+		for (i = 0; i < reactor_count; i++)
+		{
+			pthread_join(reactors[i].thd, NULL);
+		}
+	}
+#endif
+
+	/* clients of the thread engine share one flush tick */
+	if (flush_window_ms > 0)
+	{
+#if defined(UNIX)
+		pthread_t thd_flusher;
+		if (pthread_create(&thd_flusher, NULL, flusher_start, NULL) != 0)
+		{
+			fatal_error("start flusher failed");
+		}
+		pthread_detach(thd_flusher);
+#elif defined(WINDOWS)
+		DWORD thd_flusher_id;
+		if (CreateThread(NULL, 0, flusher_start, NULL, 0, &thd_flusher_id) == NULL)
+		{
+			fatal_error("start flusher failed");
+		}
+#endif
+	}
+
+#if defined(UNIX)
+	if (takeover_adopt() == -1)
+	{
+		fatal_error("restore clients handed over failed");
+	}
+	if (admin_path != NULL && admin_open() == -1)
+	{
+		fatal_error("open admin socket failed");
+	}
+	if (peers_start() == -1)
+	{
+		fatal_error("start peer connectors failed");
+	}
+	/* the accept loop parks for a hot restart as well */
+	takeover_enter();
+#endif
+
 	/* main loop for listen */
 	while (1)
 	{
 #if defined(UNIX)
 		unsigned int sin_size = sizeof(struct sockaddr_in);
+		if ((client_fd = takeover_accept(server_fd, (struct sockaddr *)&cliaddr, &sin_size)) == -1)
+		{
+			continue;
+		}
 #elif defined(WINDOWS)
 		int sin_size = sizeof(struct sockaddr_in);
-#endif
 		if ((client_fd = accept(server_fd, (struct sockaddr *)&cliaddr, &sin_size)) == -1)
 		{
 			continue;
 		}
+#endif
 		/* make setting for client threading */
 		struct sub_server server;
 		server.client_fd = client_fd;
@@ -604,17 +7628,29 @@ int main(int argc, const char *argv[])
 		client_ip_addr_buffer = inet_ntoa(cliaddr.sin_addr);
 		strncpy(server.client_ip_addr, client_ip_addr_buffer, 16);
 
+		/* the socket is non-blocking before any broadcast can reach it,
+		 * and the node is added to server list here, so the next accept
+		 * never overwrites a server the thread has not copied yet */
+		struct sub_server *node;
+		if (set_nonblocking(client_fd) == -1
+				|| (node = sub_server_list_push_back(server_list, &server)) == NULL)
+		{
+			close(client_fd);
+			continue;
+		}
+
 		/* fork a sub server threading */
 #if defined(UNIX)
-		ret = pthread_create(&server.thd, NULL, sub_server_start, (void *)&server);
+		pthread_t thd;
+		ret = pthread_create(&thd, NULL, sub_server_start, (void *)node);
 		if (ret != 0)
 		{
 			fatal_error("fork sub server failed");
 		}
 #elif defined(WINDOWS)
 		DWORD sub_server_thd_id;
-		server.thd = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)sub_server_start, (void *)&server, 0, (PDWORD)&sub_server_thd_id);
-		if (server.thd == NULL)
+		node->thd = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)sub_server_start, (void *)node, 0, (PDWORD)&sub_server_thd_id);
+		if (node->thd == NULL)
 		{
 			fatal_error("fork sub server failed");
 		}
@@ -629,10 +7665,6 @@ int main(int argc, const char *argv[])
 	WSACleanup();
 #endif
 
-#if defined(WINDOWS)
-	/* need to delete critical section for Windows*/
-	DeleteCriticalSection(&cs_server_list);
-#endif
 	return 0;
 }
 